@@ -0,0 +1,623 @@
+//
+// Address-ordered First Fit malloc implementation
+// Always reuses the free block at the LOWEST address that fits. The other
+// strategies push freed blocks at the head of a list (LIFO), so consecutive
+// mallocs scatter across pages. Here live data stays packed at the bottom of
+// the heap and the pages above it drain, until whole regions are free and can
+// be returned to the system.
+//
+// Free blocks are nodes of a red-black tree keyed by address. Each node also
+// remembers the largest free block in its subtree, so the lowest block that
+// fits is found in O(log n) without walking the free blocks in between.
+//
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc_stats.h"
+#include "telemetry.h"
+
+void *mmap_from_system(size_t size);
+void munmap_to_system(void *ptr, size_t size);
+
+// Same block layout as mix.c: one header word with the size and the flags,
+// a footer with the size at the end of every free block, and a size-0 fence
+// header at the end of each mmap'd region.
+//
+// The tree fields are only needed while a block is free, so they live in the
+// first 32 bytes of its payload. The tree needs no memory of its own.
+//
+//   in use: | size|flags | payload ............................................. |
+//   free:   | size|flags | left | right | parent | max_size | ...        | footer |
+typedef struct my_metadata_t {
+  size_t size : 60;
+  size_t is_free : 1;
+  size_t prev_free : 1;        // Is the block physically to the left free?
+  size_t first_in_region : 1;  // Does this block start its mmap'd region?
+  size_t is_red : 1;           // Node color, only meaningful while free.
+  // Free blocks only, overlapping the payload:
+  struct my_metadata_t *left;
+  struct my_metadata_t *right;
+  struct my_metadata_t *parent;
+  size_t max_size;  // The largest size in this node's subtree.
+} my_metadata_t;
+
+#define HEADER_SIZE offsetof(my_metadata_t, left)
+// A free block must hold its tree fields and its footer.
+#define MIN_PAYLOAD_SIZE (sizeof(my_metadata_t) - HEADER_SIZE + sizeof(size_t))
+
+// A region whose blocks are all free again goes back to the system, but only
+// while more than munmap_retain_size bytes would still be free afterwards, so
+// the next peak doesn't mmap the same pages again (same hysteresis as mix.c,
+// and set the same way with --option=munmap_retain=BYTES).
+#define MUNMAP_RETAIN_SIZE (32 * 1024)
+
+typedef struct my_heap_t {
+  my_metadata_t *root;
+  size_t free_size;  // Total payload bytes in the tree.
+} my_heap_t;
+
+my_heap_t my_heap;
+size_t munmap_retain_size = MUNMAP_RETAIN_SIZE;
+
+#ifdef ENABLE_ALLOC_STATS
+alloc_stats_t my_alloc_stats;
+#endif
+
+void *get_payload(my_metadata_t *metadata) {
+  return (char *)metadata + HEADER_SIZE;
+}
+
+my_metadata_t *get_metadata(void *ptr) {
+  return (my_metadata_t *)((char *)ptr - HEADER_SIZE);
+}
+
+my_metadata_t *get_next_block(my_metadata_t *metadata) {
+  return (my_metadata_t *)((char *)get_payload(metadata) + metadata->size);
+}
+
+// Round a request up to a block size that can be freed again.
+size_t get_block_size(size_t size) {
+  if (size < MIN_PAYLOAD_SIZE) {
+    return MIN_PAYLOAD_SIZE;
+  }
+  return (size + 7) / 8 * 8;
+}
+
+// --- Red-black tree ---
+// Blocks are ordered by address. Rotations and the walks up from an inserted
+// or removed node keep every max_size up to date.
+
+bool node_is_red(my_metadata_t *node) { return node && node->is_red; }
+
+void update_max_size(my_metadata_t *node) {
+  size_t max_size = node->size;
+  if (node->left && node->left->max_size > max_size) {
+    max_size = node->left->max_size;
+  }
+  if (node->right && node->right->max_size > max_size) {
+    max_size = node->right->max_size;
+  }
+  node->max_size = max_size;
+}
+
+// Recompute max_size from |node| up to the root.
+void update_max_size_path(my_metadata_t *node) {
+  for (; node; node = node->parent) {
+    update_max_size(node);
+  }
+}
+
+// Put |new_child| where |old_child| was under |parent| (or at the root).
+void replace_child(my_metadata_t *parent, my_metadata_t *old_child,
+                   my_metadata_t *new_child) {
+  if (!parent) {
+    my_heap.root = new_child;
+  } else if (parent->left == old_child) {
+    parent->left = new_child;
+  } else {
+    parent->right = new_child;
+  }
+}
+
+void rotate_left(my_metadata_t *x) {
+  my_metadata_t *y = x->right;
+  x->right = y->left;
+  if (y->left) {
+    y->left->parent = x;
+  }
+  y->parent = x->parent;
+  replace_child(x->parent, x, y);
+  y->left = x;
+  x->parent = y;
+  update_max_size(x);
+  update_max_size(y);
+}
+
+void rotate_right(my_metadata_t *x) {
+  my_metadata_t *y = x->left;
+  x->left = y->right;
+  if (y->right) {
+    y->right->parent = x;
+  }
+  y->parent = x->parent;
+  replace_child(x->parent, x, y);
+  y->right = x;
+  x->parent = y;
+  update_max_size(x);
+  update_max_size(y);
+}
+
+void tree_insert(my_metadata_t *node) {
+  my_metadata_t *parent = NULL;
+  my_metadata_t **link = &my_heap.root;
+  while (*link) {
+    parent = *link;
+    link = node < parent ? &parent->left : &parent->right;
+  }
+  node->left = NULL;
+  node->right = NULL;
+  node->parent = parent;
+  node->is_red = true;
+  *link = node;
+  update_max_size_path(node);
+
+  // Fix a red node under a red parent. The grandparent exists because the
+  // root is always black.
+  while (node_is_red(node->parent)) {
+    parent = node->parent;
+    my_metadata_t *grandparent = parent->parent;
+    if (parent == grandparent->left) {
+      my_metadata_t *uncle = grandparent->right;
+      if (node_is_red(uncle)) {
+        parent->is_red = false;
+        uncle->is_red = false;
+        grandparent->is_red = true;
+        node = grandparent;
+        continue;
+      }
+      if (node == parent->right) {
+        rotate_left(parent);
+        node = parent;
+        parent = node->parent;
+      }
+      parent->is_red = false;
+      grandparent->is_red = true;
+      rotate_right(grandparent);
+    } else {
+      my_metadata_t *uncle = grandparent->left;
+      if (node_is_red(uncle)) {
+        parent->is_red = false;
+        uncle->is_red = false;
+        grandparent->is_red = true;
+        node = grandparent;
+        continue;
+      }
+      if (node == parent->left) {
+        rotate_right(parent);
+        node = parent;
+        parent = node->parent;
+      }
+      parent->is_red = false;
+      grandparent->is_red = true;
+      rotate_left(grandparent);
+    }
+  }
+  my_heap.root->is_red = false;
+}
+
+// Restore the black height after a black node was removed above |node|.
+// |node| may be NULL, so its parent is passed separately.
+void remove_fixup(my_metadata_t *node, my_metadata_t *parent) {
+  while (node != my_heap.root && !node_is_red(node)) {
+    if (node == parent->left) {
+      my_metadata_t *sibling = parent->right;
+      if (sibling->is_red) {
+        sibling->is_red = false;
+        parent->is_red = true;
+        rotate_left(parent);
+        sibling = parent->right;
+      }
+      if (!node_is_red(sibling->left) && !node_is_red(sibling->right)) {
+        sibling->is_red = true;
+        node = parent;
+        parent = node->parent;
+        continue;
+      }
+      if (!node_is_red(sibling->right)) {
+        sibling->left->is_red = false;
+        sibling->is_red = true;
+        rotate_right(sibling);
+        sibling = parent->right;
+      }
+      sibling->is_red = parent->is_red;
+      parent->is_red = false;
+      sibling->right->is_red = false;
+      rotate_left(parent);
+    } else {
+      my_metadata_t *sibling = parent->left;
+      if (sibling->is_red) {
+        sibling->is_red = false;
+        parent->is_red = true;
+        rotate_right(parent);
+        sibling = parent->left;
+      }
+      if (!node_is_red(sibling->left) && !node_is_red(sibling->right)) {
+        sibling->is_red = true;
+        node = parent;
+        parent = node->parent;
+        continue;
+      }
+      if (!node_is_red(sibling->left)) {
+        sibling->right->is_red = false;
+        sibling->is_red = true;
+        rotate_left(sibling);
+        sibling = parent->left;
+      }
+      sibling->is_red = parent->is_red;
+      parent->is_red = false;
+      sibling->left->is_red = false;
+      rotate_right(parent);
+    }
+    node = my_heap.root;
+  }
+  if (node) {
+    node->is_red = false;
+  }
+}
+
+void tree_remove(my_metadata_t *node) {
+  my_metadata_t *child;
+  my_metadata_t *child_parent;
+  bool removed_red = node->is_red;
+  if (!node->left || !node->right) {
+    // At most one child: it takes the node's place.
+    child = node->left ? node->left : node->right;
+    child_parent = node->parent;
+    replace_child(node->parent, node, child);
+    if (child) {
+      child->parent = node->parent;
+    }
+  } else {
+    // Two children: the successor (leftmost of the right subtree) takes the
+    // node's place and color, and the tree loses a node where it was.
+    my_metadata_t *successor = node->right;
+    while (successor->left) {
+      successor = successor->left;
+    }
+    removed_red = successor->is_red;
+    child = successor->right;
+    if (successor->parent == node) {
+      child_parent = successor;
+    } else {
+      child_parent = successor->parent;
+      child_parent->left = child;
+      if (child) {
+        child->parent = child_parent;
+      }
+      successor->right = node->right;
+      successor->right->parent = successor;
+    }
+    replace_child(node->parent, node, successor);
+    successor->parent = node->parent;
+    successor->left = node->left;
+    successor->left->parent = successor;
+    successor->is_red = node->is_red;
+  }
+  // Every node whose subtree lost |node| is on the path up from here (the
+  // successor, if it moved, is above |child_parent| now).
+  update_max_size_path(child_parent);
+  if (!removed_red) {
+    remove_fixup(child, child_parent);
+  }
+}
+
+// Return the free block at the lowest address with at least |size| bytes, or
+// NULL if there is none. max_size tells which subtree to go down, so this never
+// backtracks.
+my_metadata_t *tree_find_first_fit(size_t size) {
+  my_metadata_t *node = my_heap.root;
+  if (!node || node->max_size < size) {
+    return NULL;
+  }
+  while (true) {
+    ALLOC_STATS_INC(my_alloc_stats, list_walk_steps);
+    if (node->left && node->left->max_size >= size) {
+      node = node->left;
+    } else if (node->size >= size) {
+      return node;
+    } else {
+      node = node->right;  // Its max_size must be the one that fits.
+    }
+  }
+}
+
+// --- Free blocks ---
+
+void my_add_to_free_list(my_metadata_t *metadata) {
+  tree_insert(metadata);
+  metadata->is_free = true;
+  my_heap.free_size += metadata->size;
+  *((size_t *)get_next_block(metadata) - 1) = metadata->size;
+  get_next_block(metadata)->prev_free = true;
+}
+
+void my_remove_from_free_list(my_metadata_t *metadata) {
+  tree_remove(metadata);
+  metadata->is_free = false;
+  my_heap.free_size -= metadata->size;
+  get_next_block(metadata)->prev_free = false;
+}
+
+// Get a new region from the system that can hold at least |size| bytes and
+// return its (not yet free-listed) single block.
+my_metadata_t *my_refill(size_t size) {
+  size_t buffer_size = (size + 2 * HEADER_SIZE + 4095) / 4096 * 4096;
+  char *region = (char *)mmap_from_system(buffer_size);
+  ALLOC_STATS_INC(my_alloc_stats, refills);
+  ALLOC_STATS_ADD(my_alloc_stats, refill_size, buffer_size);
+  my_metadata_t *fence = get_metadata(region + buffer_size);
+  fence->size = 0;
+  fence->is_free = false;
+  fence->prev_free = false;
+  fence->first_in_region = false;
+  my_metadata_t *metadata = (my_metadata_t *)region;
+  metadata->size = buffer_size - 2 * HEADER_SIZE;
+  metadata->is_free = false;
+  metadata->prev_free = false;
+  metadata->first_in_region = true;
+  return metadata;
+}
+
+void my_initialize() {
+  my_heap.root = NULL;
+  my_heap.free_size = 0;
+  ALLOC_STATS_RESET(my_alloc_stats);
+}
+
+// Options: munmap_retain=BYTES.
+bool my_set_option(const char *name, const char *value) {
+  if (strcmp(name, "munmap_retain") != 0) {
+    return false;
+  }
+  char *end;
+  unsigned long long retain_size = strtoull(value, &end, 10);
+  if (end == value || *end != '\0') {
+    return false;
+  }
+  munmap_retain_size = retain_size;
+  return true;
+}
+
+void *my_malloc(size_t size) {
+  size = get_block_size(size);
+  ALLOC_STATS_INC(my_alloc_stats, mallocs);
+  my_metadata_t *metadata = tree_find_first_fit(size);
+  if (metadata) {
+    if (metadata == my_heap.root) {
+      ALLOC_STATS_INC(my_alloc_stats, fast_path_hits);
+    }
+    my_remove_from_free_list(metadata);
+  } else {
+    metadata = my_refill(size);
+  }
+
+  void *ptr = get_payload(metadata);
+  size_t remaining_size = metadata->size - size;
+  if (remaining_size >= HEADER_SIZE + MIN_PAYLOAD_SIZE) {
+    metadata->size = size;
+    my_metadata_t *new_metadata = get_next_block(metadata);
+    new_metadata->size = remaining_size - HEADER_SIZE;
+    new_metadata->prev_free = false;
+    new_metadata->first_in_region = false;
+    my_add_to_free_list(new_metadata);
+    ALLOC_STATS_INC(my_alloc_stats, splits);
+  }
+  return ptr;
+}
+
+void my_free(void *ptr) {
+  my_metadata_t *metadata = get_metadata(ptr);
+  ALLOC_STATS_INC(my_alloc_stats, frees);
+
+  // Merge with the right neighbor. The fence guarantees there is one.
+  my_metadata_t *right = get_next_block(metadata);
+  if (right->is_free) {
+    my_remove_from_free_list(right);
+    metadata->size += HEADER_SIZE + right->size;
+    ALLOC_STATS_INC(my_alloc_stats, coalesce_right);
+  }
+  // Merge with the left neighbor, found through its footer.
+  if (metadata->prev_free) {
+    size_t left_size = *((size_t *)metadata - 1);
+    my_metadata_t *left = get_metadata((char *)metadata - left_size);
+    my_remove_from_free_list(left);
+    left->size += HEADER_SIZE + metadata->size;
+    metadata = left;
+    ALLOC_STATS_INC(my_alloc_stats, coalesce_left);
+  }
+
+  // The whole region is free: give it back instead of keeping it in the tree.
+  if (metadata->first_in_region && get_next_block(metadata)->size == 0 &&
+      my_heap.free_size >= munmap_retain_size) {
+    size_t region_size = metadata->size + 2 * HEADER_SIZE;
+    ALLOC_STATS_INC(my_alloc_stats, releases);
+    ALLOC_STATS_ADD(my_alloc_stats, release_size, region_size);
+    munmap_to_system(metadata, region_size);
+    return;
+  }
+  my_add_to_free_list(metadata);
+}
+
+void my_finalize() {
+  ALLOC_STATS_PRINT("addrfit", my_alloc_stats);
+}
+
+void add_subtree_stats(heap_stats_t *heap_stats, my_metadata_t *node) {
+  if (!node) {
+    return;
+  }
+  add_subtree_stats(heap_stats, node->left);
+  heap_stats_add_free_block(heap_stats, node->size);
+  add_subtree_stats(heap_stats, node->right);
+}
+
+// Report every free block for the per-epoch telemetry (see telemetry.h).
+void my_heap_stats(heap_stats_t *heap_stats) {
+  heap_stats_reset(heap_stats);
+  add_subtree_stats(heap_stats, my_heap.root);
+}
+
+// Check the red-black, ordering and max_size invariants below |node| and
+// return its black height.
+int check_subtree(my_metadata_t *node) {
+  if (!node) {
+    return 1;
+  }
+  assert(node->is_free);
+  size_t max_size = node->size;
+  if (node->left) {
+    assert(node->left->parent == node);
+    assert(node->left < node);
+    max_size = node->left->max_size > max_size ? node->left->max_size : max_size;
+  }
+  if (node->right) {
+    assert(node->right->parent == node);
+    assert(node < node->right);
+    max_size = node->right->max_size > max_size ? node->right->max_size : max_size;
+  }
+  assert(node->max_size == max_size);
+  if (node->is_red) {
+    assert(!node_is_red(node->left) && !node_is_red(node->right));
+  }
+  int left_height = check_subtree(node->left);
+  int right_height = check_subtree(node->right);
+  assert(left_height == right_height);
+  return left_height + (node->is_red ? 0 : 1);
+}
+
+void test() {
+  my_initialize();
+  // The tests below expect the default hysteresis, whatever --option says.
+  size_t old_retain_size = munmap_retain_size;
+  munmap_retain_size = MUNMAP_RETAIN_SIZE;
+  // Test that the lowest block that fits wins, not the tightest or the last freed
+  char *a = my_malloc(512);
+  my_malloc(8);  // Keep a, b and c apart.
+  char *b = my_malloc(256);
+  my_malloc(8);
+  char *c = my_malloc(1024);
+  my_malloc(8);
+  my_free(c);
+  my_free(b);
+  my_free(a);
+  check_subtree(my_heap.root);
+  char *from_a = my_malloc(200);
+  char *from_c = my_malloc(600);
+  char *rest_of_a = my_malloc(256);
+  char *from_b = my_malloc(256);
+  assert(from_a == a && from_c == c);
+  assert(rest_of_a == a + 200 + HEADER_SIZE);
+  assert(from_b == b);
+  check_subtree(my_heap.root);
+
+  // Test that max_size follows the rotations of an insert: three nodes in
+  // address order make the tree rotate left at the root. (The tree only needs
+  // a node's size and links, so the nodes can live in a local array, which
+  // also puts them in address order.)
+  my_initialize();
+  static my_metadata_t nodes[255];
+  nodes[0].size = 4096;
+  nodes[1].size = 16;
+  nodes[2].size = 8;
+  for (int i = 0; i < 3; i++) {
+    nodes[i].is_free = true;
+    tree_insert(&nodes[i]);
+  }
+  assert(my_heap.root == &nodes[1]);
+  assert(nodes[1].max_size == 4096 && nodes[2].max_size == 8);
+  check_subtree(my_heap.root);
+  // ... and the removal of the node that held it
+  tree_remove(&nodes[0]);
+  nodes[0].is_free = false;
+  assert(my_heap.root->max_size == 16);
+  check_subtree(my_heap.root);
+  assert(!tree_find_first_fit(24));
+  assert(tree_find_first_fit(8) == &nodes[1]);
+
+  // Through removals of leaves, of nodes with two children and the fixups'
+  // rotations, every max_size stays right, so the search still finds the
+  // lowest node that fits
+  my_initialize();
+  for (int i = 0; i < 255; i++) {
+    nodes[i].size = (i * 97 % 255 + 1) * 8;  // Every size up to 2040, shuffled.
+    nodes[i].is_free = true;
+    tree_insert(&nodes[i]);
+  }
+  for (int round = 0; round < 3; round++) {
+    check_subtree(my_heap.root);
+    for (size_t size = 8; size <= 2048; size += 8) {
+      my_metadata_t *lowest = NULL;
+      for (int i = 0; i < 255 && !lowest; i++) {
+        if (nodes[i].is_free && nodes[i].size >= size) {
+          lowest = &nodes[i];
+        }
+      }
+      assert(tree_find_first_fit(size) == lowest);
+    }
+    // Remove the largest node left, then every third one.
+    my_metadata_t *largest = &nodes[0];
+    for (int i = 0; i < 255; i++) {
+      if (nodes[i].is_free &&
+          (!largest->is_free || nodes[i].size > largest->size)) {
+        largest = &nodes[i];
+      }
+    }
+    tree_remove(largest);
+    largest->is_free = false;
+    assert(my_heap.root->max_size < largest->size);
+    for (int i = round; i < 255; i += 3) {
+      if (nodes[i].is_free) {
+        tree_remove(&nodes[i]);
+        nodes[i].is_free = false;
+      }
+    }
+  }
+  check_subtree(my_heap.root);
+
+  // Test that regions that become free go back to the system, down to the
+  // retained amount
+  my_initialize();
+  void *pages[64];
+  for (int i = 0; i < 64; i++) {
+    pages[i] = my_malloc(4000);  // One region each.
+  }
+  for (int i = 0; i < 64; i++) {
+    my_free(pages[i]);
+  }
+  assert(my_heap.free_size < MUNMAP_RETAIN_SIZE + 4096);
+  check_subtree(my_heap.root);
+
+  // The retained amount is a runtime option. With none, every region that
+  // becomes free goes back.
+  bool accepted = my_set_option("munmap_retain", "0");
+  assert(accepted && munmap_retain_size == 0);
+  accepted = my_set_option("munmap_retain", "lots");
+  assert(!accepted);
+  my_initialize();
+  for (int i = 0; i < 64; i++) {
+    pages[i] = my_malloc(4000);
+  }
+  for (int i = 0; i < 64; i++) {
+    my_free(pages[i]);
+  }
+  assert(my_heap.free_size == 0 && !my_heap.root);
+
+  munmap_retain_size = old_retain_size;
+  my_initialize();
+}
@@ -0,0 +1,42 @@
+//
+// Allocator-side counters: see alloc_stats.h
+//
+
+#include "alloc_stats.h"
+
+#include <stdio.h>
+#include <string.h>
+
+void alloc_stats_reset(alloc_stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+}
+
+void alloc_stats_merge(alloc_stats_t *to, alloc_stats_t *from) {
+  uint64_t *to_fields = (uint64_t *)to;
+  uint64_t *from_fields = (uint64_t *)from;
+  for (size_t i = 0; i < sizeof(*to) / sizeof(uint64_t); i++) {
+    to_fields[i] += from_fields[i];
+  }
+  alloc_stats_reset(from);
+}
+
+void alloc_stats_print(const char *name, alloc_stats_t *stats) {
+  double mallocs = stats->mallocs ? stats->mallocs : 1;
+  printf("[%s] mallocs %lu, frees %lu, fast path %.1f%%\n", name,
+         (unsigned long)stats->mallocs, (unsigned long)stats->frees,
+         100.0 * stats->fast_path_hits / mallocs);
+  printf("[%s] per malloc: %.2f bin misses, %.2f list walk steps, "
+         "%.2f splits\n",
+         name, stats->bin_misses / mallocs, stats->list_walk_steps / mallocs,
+         stats->splits / mallocs);
+  double frees = stats->frees ? stats->frees : 1;
+  printf("[%s] per free: %.2f list walk steps; coalesce left %lu, right %lu\n",
+         name, stats->free_walk_steps / frees,
+         (unsigned long)stats->coalesce_left,
+         (unsigned long)stats->coalesce_right);
+  printf("[%s] refills %lu (%lu KiB), releases %lu (%lu KiB)\n", name,
+         (unsigned long)stats->refills,
+         (unsigned long)(stats->refill_size / 1024),
+         (unsigned long)stats->releases,
+         (unsigned long)(stats->release_size / 1024));
+}
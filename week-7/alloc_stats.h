@@ -0,0 +1,63 @@
+//
+// Allocator-side counters: why a strategy is slow, not just that it is
+//
+// An allocator that supports them keeps one alloc_stats_t, my_alloc_stats
+// (defined only with ENABLE_ALLOC_STATS), bumps it with the ALLOC_STATS_*
+// macros on its malloc / free paths, resets it in my_initialize() and prints
+// it from my_finalize(). The counters are only compiled in with
+// -DENABLE_ALLOC_STATS (make run_stats). Otherwise the macros expand to
+// nothing, so normal builds pay nothing for them.
+//
+// list_walk_steps means the same thing in every allocator, so the column can
+// be compared across them: each free block (or tree node) malloc looks at
+// counts once, where it is compared with the request, including the one it
+// takes. A block taken without a comparison (the head of a bin a bitmap or a
+// size class picked) counts once too. A malloc that searches again after a
+// refill counts the blocks of both searches; one that takes the fresh block
+// directly doesn't count it.
+//
+
+#ifndef ALLOC_STATS_H
+#define ALLOC_STATS_H
+
+#include <stdint.h>
+
+typedef struct alloc_stats_t {
+  uint64_t mallocs;
+  uint64_t frees;
+  uint64_t fast_path_hits;   // Mallocs served by the first list looked at.
+  uint64_t bin_misses;       // Lists looked at that had no block to use.
+  uint64_t list_walk_steps;  // Free blocks looked at by malloc.
+  uint64_t free_walk_steps;  // Free blocks looked at by free, to find neighbors.
+  uint64_t splits;           // Free blocks split to serve a malloc.
+  uint64_t coalesce_left;    // Merges with the left neighbor.
+  uint64_t coalesce_right;   // Merges with the right neighbor.
+  uint64_t refills;          // Times new memory was taken from the system.
+  uint64_t refill_size;
+  uint64_t releases;  // Times memory was given back to the system.
+  uint64_t release_size;
+} alloc_stats_t;
+
+#ifdef ENABLE_ALLOC_STATS
+#define ALLOC_STATS_ADD(stats, field, n) ((stats).field += (n))
+#define ALLOC_STATS_RESET(stats) alloc_stats_reset(&(stats))
+#define ALLOC_STATS_PRINT(name, stats) alloc_stats_print((name), &(stats))
+#define ALLOC_STATS_MERGE(to, from) alloc_stats_merge(&(to), &(from))
+#else
+#define ALLOC_STATS_ADD(stats, field, n) ((void)0)
+#define ALLOC_STATS_RESET(stats) ((void)0)
+#define ALLOC_STATS_PRINT(name, stats) ((void)0)
+#define ALLOC_STATS_MERGE(to, from) ((void)0)
+#endif
+#define ALLOC_STATS_INC(stats, field) ALLOC_STATS_ADD(stats, field, 1)
+
+void alloc_stats_reset(alloc_stats_t *stats);
+
+// Add the counters of |from| to |to| and reset |from|, e.g. to fold a
+// thread's own counters into the allocator's.
+void alloc_stats_merge(alloc_stats_t *to, alloc_stats_t *from);
+
+// Print the counters of one challenge run, with per-malloc averages.
+void alloc_stats_print(const char *name, alloc_stats_t *stats);
+
+#endif  // ALLOC_STATS_H
@@ -0,0 +1,83 @@
+//
+// Arena: see arena.h
+//
+
+#include "arena.h"
+
+#include <assert.h>
+#include <stdint.h>
+
+void *mmap_from_system(size_t size);
+void munmap_to_system(void *ptr, size_t size);
+
+void arena_initialize(arena_t *arena, size_t min_chunk_size,
+                      size_t max_chunk_size) {
+  assert(min_chunk_size % 4096 == 0 && max_chunk_size % 4096 == 0);
+  assert(min_chunk_size <= max_chunk_size);
+  arena->cursor = NULL;
+  arena->limit = NULL;
+  arena->min_chunk_size = min_chunk_size;
+  arena->max_chunk_size = max_chunk_size;
+  arena->mapped_size = 0;
+  arena->num_chunks = 0;
+}
+
+// Map a new chunk that can hold at least |size| bytes and make it current.
+void arena_grow(arena_t *arena, size_t size) {
+  // Give the unused tail of the old chunk back; nobody will ever get it.
+  if (arena->cursor != arena->limit) {
+    munmap_to_system(arena->cursor, arena->limit - arena->cursor);
+    arena->mapped_size -= arena->limit - arena->cursor;
+  }
+  // Grow with the heap rather than with the number of refills, so a heap that
+  // stays small never pays for a big chunk it won't fill.
+  size_t chunk_size = arena->mapped_size / ARENA_GROWTH_DIVISOR / 4096 * 4096;
+  if (chunk_size < arena->min_chunk_size) {
+    chunk_size = arena->min_chunk_size;
+  }
+  if (chunk_size > arena->max_chunk_size) {
+    chunk_size = arena->max_chunk_size;
+  }
+  if (chunk_size < size) {
+    chunk_size = size;
+  }
+  char *chunk = (char *)mmap_from_system(chunk_size);
+  arena->mapped_size += chunk_size;
+  if (arena->num_chunks < ARENA_MAX_CHUNKS) {
+    arena->chunk_begin[arena->num_chunks] = chunk;
+    arena->chunk_end[arena->num_chunks] = chunk + chunk_size;
+    arena->num_chunks++;
+  } else {
+    // Out of slots: forget the oldest chunk. That only means blocks in it
+    // are never extended, which is safe.
+    for (int i = 1; i < ARENA_MAX_CHUNKS; i++) {
+      arena->chunk_begin[i - 1] = arena->chunk_begin[i];
+      arena->chunk_end[i - 1] = arena->chunk_end[i];
+    }
+    arena->chunk_begin[ARENA_MAX_CHUNKS - 1] = chunk;
+    arena->chunk_end[ARENA_MAX_CHUNKS - 1] = chunk + chunk_size;
+  }
+  arena->cursor = chunk;
+  arena->limit = chunk + chunk_size;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+  assert(size % 4096 == 0);
+  if ((size_t)(arena->limit - arena->cursor) < size) {
+    arena_grow(arena, size);
+  }
+  void *ptr = arena->cursor;
+  arena->cursor += size;
+  return ptr;
+}
+
+bool arena_same_chunk(arena_t *arena, void *begin, void *end) {
+  // Search newest first: that is almost always the chunk being asked about.
+  for (int i = arena->num_chunks - 1; i >= 0; i--) {
+    if (arena->chunk_begin[i] <= (char *)begin &&
+        (char *)end <= arena->chunk_end[i]) {
+      return true;
+    }
+  }
+  return false;
+}
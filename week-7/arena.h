@@ -0,0 +1,48 @@
+//
+// Arena: reserves big regions from the system and hands out pages from them
+//
+// Allocators used to call mmap_from_system(4096) every time their free lists
+// ran dry, which is one syscall per page under peak load. An arena instead
+// maps a chunk and carves pages off it. Each new chunk is a fraction
+// (1 / ARENA_GROWTH_DIVISOR) of what the arena has mapped so far, between
+// |min_chunk_size| and |max_chunk_size|, so chunks grow geometrically with
+// the heap. The unused tail of the current chunk counts as mapped memory, so
+// a small heap only ever has a small chunk tail.
+//
+// The arena remembers the bounds of every chunk so an allocator can tell
+// whether two addresses belong to the same mapping (coalescing must never
+// cross from one chunk into another).
+//
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ARENA_MAX_CHUNKS 64
+#define ARENA_GROWTH_DIVISOR 8
+
+typedef struct arena_t {
+  char *cursor;  // Next page to hand out from the current chunk.
+  char *limit;   // End of the current chunk.
+  size_t min_chunk_size;
+  size_t max_chunk_size;
+  size_t mapped_size;  // Bytes in chunks mapped so far, minus returned tails.
+  int num_chunks;
+  char *chunk_begin[ARENA_MAX_CHUNKS];
+  char *chunk_end[ARENA_MAX_CHUNKS];
+} arena_t;
+
+// Set up an empty arena. Both sizes need to be multiples of 4096 bytes.
+void arena_initialize(arena_t *arena, size_t min_chunk_size,
+                      size_t max_chunk_size);
+
+// Hand out |size| bytes of fresh pages. |size| needs to be a multiple of 4096
+// bytes. Consecutive calls return adjacent pages until a chunk runs out.
+void *arena_alloc(arena_t *arena, size_t size);
+
+// Return true if [begin, end) lies inside a single chunk.
+bool arena_same_chunk(arena_t *arena, void *begin, void *end);
+
+#endif  // ARENA_H
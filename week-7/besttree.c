@@ -0,0 +1,496 @@
+//
+// Best Fit malloc implementation backed by a red-black tree
+// best.c finds the tightest block by scanning every free block. Here the free
+// blocks are nodes of a red-black tree keyed by (size, address), so the exact
+// best fit is found in O(log n), and free is O(log n) plus O(1) coalescing.
+//
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc_stats.h"
+#include "telemetry.h"
+
+void *mmap_from_system(size_t size);
+void munmap_to_system(void *ptr, size_t size);
+
+// Same block layout as mix.c: one header word with the size and the flags,
+// a footer with the size at the end of every free block, and a size-0 fence
+// header at the end of each mmap'd region.
+//
+// The tree links are only needed while a block is free, so they live in the
+// first 24 bytes of its payload. The tree needs no memory of its own.
+//
+//   in use: | size|flags | payload ...................................... |
+//   free:   | size|flags | left | right | parent | ...            | footer |
+typedef struct my_metadata_t {
+  size_t size : 61;
+  size_t is_free : 1;
+  size_t prev_free : 1;  // Is the block physically to the left free?
+  size_t is_red : 1;     // Node color, only meaningful while free.
+  // Free blocks only, overlapping the payload:
+  struct my_metadata_t *left;
+  struct my_metadata_t *right;
+  struct my_metadata_t *parent;
+} my_metadata_t;
+
+#define HEADER_SIZE offsetof(my_metadata_t, left)
+// A free block must hold its three links and its footer.
+#define MIN_PAYLOAD_SIZE (3 * sizeof(my_metadata_t *) + sizeof(size_t))
+
+typedef struct my_heap_t {
+  my_metadata_t *root;
+} my_heap_t;
+
+my_heap_t my_heap;
+
+#ifdef ENABLE_ALLOC_STATS
+alloc_stats_t my_alloc_stats;
+#endif
+
+void *get_payload(my_metadata_t *metadata) {
+  return (char *)metadata + HEADER_SIZE;
+}
+
+my_metadata_t *get_metadata(void *ptr) {
+  return (my_metadata_t *)((char *)ptr - HEADER_SIZE);
+}
+
+my_metadata_t *get_next_block(my_metadata_t *metadata) {
+  return (my_metadata_t *)((char *)get_payload(metadata) + metadata->size);
+}
+
+// Round a request up to a block size that can be freed again.
+size_t get_block_size(size_t size) {
+  if (size < MIN_PAYLOAD_SIZE) {
+    return MIN_PAYLOAD_SIZE;
+  }
+  return (size + 7) / 8 * 8;
+}
+
+// --- Red-black tree ---
+// Blocks are ordered by size, then by address. The address makes every key
+// unique, and among equally tight blocks malloc takes the lowest one.
+
+bool node_less(my_metadata_t *a, my_metadata_t *b) {
+  return a->size < b->size || (a->size == b->size && a < b);
+}
+
+bool node_is_red(my_metadata_t *node) { return node && node->is_red; }
+
+// Put |new_child| where |old_child| was under |parent| (or at the root).
+void replace_child(my_metadata_t *parent, my_metadata_t *old_child,
+                   my_metadata_t *new_child) {
+  if (!parent) {
+    my_heap.root = new_child;
+  } else if (parent->left == old_child) {
+    parent->left = new_child;
+  } else {
+    parent->right = new_child;
+  }
+}
+
+void rotate_left(my_metadata_t *x) {
+  my_metadata_t *y = x->right;
+  x->right = y->left;
+  if (y->left) {
+    y->left->parent = x;
+  }
+  y->parent = x->parent;
+  replace_child(x->parent, x, y);
+  y->left = x;
+  x->parent = y;
+}
+
+void rotate_right(my_metadata_t *x) {
+  my_metadata_t *y = x->left;
+  x->left = y->right;
+  if (y->right) {
+    y->right->parent = x;
+  }
+  y->parent = x->parent;
+  replace_child(x->parent, x, y);
+  y->right = x;
+  x->parent = y;
+}
+
+void tree_insert(my_metadata_t *node) {
+  my_metadata_t *parent = NULL;
+  my_metadata_t **link = &my_heap.root;
+  while (*link) {
+    parent = *link;
+    link = node_less(node, parent) ? &parent->left : &parent->right;
+  }
+  node->left = NULL;
+  node->right = NULL;
+  node->parent = parent;
+  node->is_red = true;
+  *link = node;
+
+  // Fix a red node under a red parent. The grandparent exists because the
+  // root is always black.
+  while (node_is_red(node->parent)) {
+    parent = node->parent;
+    my_metadata_t *grandparent = parent->parent;
+    if (parent == grandparent->left) {
+      my_metadata_t *uncle = grandparent->right;
+      if (node_is_red(uncle)) {
+        parent->is_red = false;
+        uncle->is_red = false;
+        grandparent->is_red = true;
+        node = grandparent;
+        continue;
+      }
+      if (node == parent->right) {
+        rotate_left(parent);
+        node = parent;
+        parent = node->parent;
+      }
+      parent->is_red = false;
+      grandparent->is_red = true;
+      rotate_right(grandparent);
+    } else {
+      my_metadata_t *uncle = grandparent->left;
+      if (node_is_red(uncle)) {
+        parent->is_red = false;
+        uncle->is_red = false;
+        grandparent->is_red = true;
+        node = grandparent;
+        continue;
+      }
+      if (node == parent->left) {
+        rotate_right(parent);
+        node = parent;
+        parent = node->parent;
+      }
+      parent->is_red = false;
+      grandparent->is_red = true;
+      rotate_left(grandparent);
+    }
+  }
+  my_heap.root->is_red = false;
+}
+
+// Restore the black height after a black node was removed above |node|.
+// |node| may be NULL, so its parent is passed separately.
+void remove_fixup(my_metadata_t *node, my_metadata_t *parent) {
+  while (node != my_heap.root && !node_is_red(node)) {
+    if (node == parent->left) {
+      my_metadata_t *sibling = parent->right;
+      if (sibling->is_red) {
+        sibling->is_red = false;
+        parent->is_red = true;
+        rotate_left(parent);
+        sibling = parent->right;
+      }
+      if (!node_is_red(sibling->left) && !node_is_red(sibling->right)) {
+        sibling->is_red = true;
+        node = parent;
+        parent = node->parent;
+        continue;
+      }
+      if (!node_is_red(sibling->right)) {
+        sibling->left->is_red = false;
+        sibling->is_red = true;
+        rotate_right(sibling);
+        sibling = parent->right;
+      }
+      sibling->is_red = parent->is_red;
+      parent->is_red = false;
+      sibling->right->is_red = false;
+      rotate_left(parent);
+    } else {
+      my_metadata_t *sibling = parent->left;
+      if (sibling->is_red) {
+        sibling->is_red = false;
+        parent->is_red = true;
+        rotate_right(parent);
+        sibling = parent->left;
+      }
+      if (!node_is_red(sibling->left) && !node_is_red(sibling->right)) {
+        sibling->is_red = true;
+        node = parent;
+        parent = node->parent;
+        continue;
+      }
+      if (!node_is_red(sibling->left)) {
+        sibling->right->is_red = false;
+        sibling->is_red = true;
+        rotate_left(sibling);
+        sibling = parent->left;
+      }
+      sibling->is_red = parent->is_red;
+      parent->is_red = false;
+      sibling->left->is_red = false;
+      rotate_right(parent);
+    }
+    node = my_heap.root;
+  }
+  if (node) {
+    node->is_red = false;
+  }
+}
+
+void tree_remove(my_metadata_t *node) {
+  my_metadata_t *child;
+  my_metadata_t *child_parent;
+  bool removed_red = node->is_red;
+  if (!node->left || !node->right) {
+    // At most one child: it takes the node's place.
+    child = node->left ? node->left : node->right;
+    child_parent = node->parent;
+    replace_child(node->parent, node, child);
+    if (child) {
+      child->parent = node->parent;
+    }
+  } else {
+    // Two children: the successor (leftmost of the right subtree) takes the
+    // node's place and color, and the tree loses a node where it was.
+    my_metadata_t *successor = node->right;
+    while (successor->left) {
+      successor = successor->left;
+    }
+    removed_red = successor->is_red;
+    child = successor->right;
+    if (successor->parent == node) {
+      child_parent = successor;
+    } else {
+      child_parent = successor->parent;
+      child_parent->left = child;
+      if (child) {
+        child->parent = child_parent;
+      }
+      successor->right = node->right;
+      successor->right->parent = successor;
+    }
+    replace_child(node->parent, node, successor);
+    successor->parent = node->parent;
+    successor->left = node->left;
+    successor->left->parent = successor;
+    successor->is_red = node->is_red;
+  }
+  if (!removed_red) {
+    remove_fixup(child, child_parent);
+  }
+}
+
+// Return the smallest free block of at least |size| bytes (the lowest
+// address among equal sizes), or NULL if there is none.
+my_metadata_t *tree_find_best_fit(size_t size) {
+  my_metadata_t *best = NULL;
+  my_metadata_t *node = my_heap.root;
+  while (node) {
+    ALLOC_STATS_INC(my_alloc_stats, list_walk_steps);
+    if (node->size >= size) {
+      best = node;
+      node = node->left;
+    } else {
+      node = node->right;
+    }
+  }
+  return best;
+}
+
+// --- Free blocks ---
+
+void my_add_to_free_list(my_metadata_t *metadata) {
+  tree_insert(metadata);
+  metadata->is_free = true;
+  *((size_t *)get_next_block(metadata) - 1) = metadata->size;
+  get_next_block(metadata)->prev_free = true;
+}
+
+void my_remove_from_free_list(my_metadata_t *metadata) {
+  tree_remove(metadata);
+  metadata->is_free = false;
+  get_next_block(metadata)->prev_free = false;
+}
+
+// Get a new region from the system that can hold at least |size| bytes and
+// return its (not yet free-listed) single block.
+my_metadata_t *my_refill(size_t size) {
+  size_t buffer_size = (size + 2 * HEADER_SIZE + 4095) / 4096 * 4096;
+  char *region = (char *)mmap_from_system(buffer_size);
+  ALLOC_STATS_INC(my_alloc_stats, refills);
+  ALLOC_STATS_ADD(my_alloc_stats, refill_size, buffer_size);
+  my_metadata_t *fence = get_metadata(region + buffer_size);
+  fence->size = 0;
+  fence->is_free = false;
+  fence->prev_free = false;
+  my_metadata_t *metadata = (my_metadata_t *)region;
+  metadata->size = buffer_size - 2 * HEADER_SIZE;
+  metadata->is_free = false;
+  metadata->prev_free = false;
+  return metadata;
+}
+
+void my_initialize() {
+  my_heap.root = NULL;
+  ALLOC_STATS_RESET(my_alloc_stats);
+}
+
+void *my_malloc(size_t size) {
+  size = get_block_size(size);
+  ALLOC_STATS_INC(my_alloc_stats, mallocs);
+  my_metadata_t *metadata = tree_find_best_fit(size);
+  if (metadata) {
+    if (metadata->size == size) {
+      // A perfect fit: nothing to split off.
+      ALLOC_STATS_INC(my_alloc_stats, fast_path_hits);
+    }
+    my_remove_from_free_list(metadata);
+  } else {
+    metadata = my_refill(size);
+  }
+
+  void *ptr = get_payload(metadata);
+  size_t remaining_size = metadata->size - size;
+  if (remaining_size >= HEADER_SIZE + MIN_PAYLOAD_SIZE) {
+    metadata->size = size;
+    my_metadata_t *new_metadata = get_next_block(metadata);
+    new_metadata->size = remaining_size - HEADER_SIZE;
+    new_metadata->prev_free = false;
+    my_add_to_free_list(new_metadata);
+    ALLOC_STATS_INC(my_alloc_stats, splits);
+  }
+  return ptr;
+}
+
+void my_free(void *ptr) {
+  my_metadata_t *metadata = get_metadata(ptr);
+  ALLOC_STATS_INC(my_alloc_stats, frees);
+
+  // Merge with the right neighbor. The fence guarantees there is one.
+  my_metadata_t *right = get_next_block(metadata);
+  if (right->is_free) {
+    my_remove_from_free_list(right);
+    metadata->size += HEADER_SIZE + right->size;
+    ALLOC_STATS_INC(my_alloc_stats, coalesce_right);
+  }
+  // Merge with the left neighbor, found through its footer.
+  if (metadata->prev_free) {
+    size_t left_size = *((size_t *)metadata - 1);
+    my_metadata_t *left = get_metadata((char *)metadata - left_size);
+    my_remove_from_free_list(left);
+    left->size += HEADER_SIZE + metadata->size;
+    metadata = left;
+    ALLOC_STATS_INC(my_alloc_stats, coalesce_left);
+  }
+  my_add_to_free_list(metadata);
+}
+
+void my_finalize() {
+  ALLOC_STATS_PRINT("besttree", my_alloc_stats);
+}
+
+void add_subtree_stats(heap_stats_t *heap_stats, my_metadata_t *node) {
+  if (!node) {
+    return;
+  }
+  add_subtree_stats(heap_stats, node->left);
+  heap_stats_add_free_block(heap_stats, node->size);
+  add_subtree_stats(heap_stats, node->right);
+}
+
+// Report every free block for the per-epoch telemetry (see telemetry.h).
+void my_heap_stats(heap_stats_t *heap_stats) {
+  heap_stats_reset(heap_stats);
+  add_subtree_stats(heap_stats, my_heap.root);
+}
+
+// Check the red-black and ordering invariants below |node| and return its
+// black height.
+int check_subtree(my_metadata_t *node) {
+  if (!node) {
+    return 1;
+  }
+  assert(node->is_free);
+  if (node->left) {
+    assert(node->left->parent == node);
+    assert(node_less(node->left, node));
+  }
+  if (node->right) {
+    assert(node->right->parent == node);
+    assert(node_less(node, node->right));
+  }
+  if (node->is_red) {
+    assert(!node_is_red(node->left) && !node_is_red(node->right));
+  }
+  int left_height = check_subtree(node->left);
+  int right_height = check_subtree(node->right);
+  assert(left_height == right_height);
+  return left_height + (node->is_red ? 0 : 1);
+}
+
+// Return the number of nodes on the longest path down from |node|.
+int get_height(my_metadata_t *node) {
+  if (!node) {
+    return 0;
+  }
+  int left_height = get_height(node->left);
+  int right_height = get_height(node->right);
+  return 1 + (left_height > right_height ? left_height : right_height);
+}
+
+void test() {
+  my_initialize();
+  // Test that the tightest block wins, not the first or the lowest one
+  char *a = my_malloc(512);
+  my_malloc(8);  // Keep a, b and c apart.
+  char *b = my_malloc(256);
+  my_malloc(8);
+  char *c = my_malloc(1024);
+  my_malloc(8);
+  my_free(a);
+  my_free(b);
+  my_free(c);
+  check_subtree(my_heap.root);
+  char *from_b = my_malloc(200);
+  char *from_c = my_malloc(600);
+  assert(from_b == b && from_c == c);
+  check_subtree(my_heap.root);
+
+  // Test that the tree stays balanced when blocks come in size order, the
+  // worst case for a plain binary search tree. (The tree only needs a node's
+  // size and links, so the nodes can live in a local array.)
+  my_initialize();
+  static my_metadata_t nodes[1023];
+  for (int i = 0; i < 1023; i++) {
+    nodes[i].size = (i + 1) * 8;
+    nodes[i].is_free = true;
+    tree_insert(&nodes[i]);
+  }
+  check_subtree(my_heap.root);
+  assert(get_height(my_heap.root) <= 2 * 10);  // 2 log2(n + 1)
+
+  // Removing every other node keeps it balanced
+  for (int i = 0; i < 1023; i += 2) {
+    tree_remove(&nodes[i]);
+  }
+  check_subtree(my_heap.root);
+  assert(get_height(my_heap.root) <= 2 * 9);
+
+  // Every request gets the tightest node: the sizes left are 16, 32, ...,
+  // 8176, in nodes[1], nodes[3], ...
+  for (size_t size = 1; size <= 8200; size++) {
+    my_metadata_t *best =
+        size <= 8176 ? &nodes[(size + 15) / 16 * 2 - 1] : NULL;
+    assert(tree_find_best_fit(size) == best);
+  }
+  // Among equally tight nodes, the lowest address wins
+  nodes[2].size = 32;
+  nodes[0].size = 32;
+  tree_insert(&nodes[2]);
+  tree_insert(&nodes[0]);
+  check_subtree(my_heap.root);
+  assert(tree_find_best_fit(24) == &nodes[0]);
+  tree_remove(&nodes[0]);
+  assert(tree_find_best_fit(32) == &nodes[2]);
+  check_subtree(my_heap.root);
+  my_initialize();
+}
@@ -2,6 +2,13 @@
 // Complete Coalescing malloc implementation
 // Merges freed blocks with adjacent free blocks on both left and right
 //
+// Coalescing can also be deferred (--option=coalesce=deferred). Freed blocks of
+// up to QUICK_MAX_SIZE bytes then go to a quick cache for their size class, and
+// the next malloc of that size takes them back without searching the free list
+// or splitting. Cached blocks look in use to the coalescer. They are all merged
+// in one batch when a malloc finds no fitting free block (before mapping new
+// pages), or when more than QUICK_CACHE_LIMIT bytes sit in the caches.
+//
 
 #include <assert.h>
 #include <stdbool.h>
@@ -10,6 +17,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+
+#include "alloc_stats.h"
 
 void *mmap_from_system(size_t size);
 void munmap_to_system(void *ptr, size_t size);
@@ -18,14 +28,26 @@ typedef struct my_metadata_t {
   size_t size;
   struct my_metadata_t *next;
   bool is_free;
+  bool is_cached;  // In a quick cache: freed, but |is_free| is still false.
 } my_metadata_t;
 
+#define QUICK_MAX_SIZE 512
+#define NUM_QUICK_CACHES (QUICK_MAX_SIZE / 8 + 1)  // One per 8-byte size class.
+#define QUICK_CACHE_LIMIT (64 * 1024)
+
 typedef struct my_heap_t {
   my_metadata_t *free_head;
   my_metadata_t dummy;
+  my_metadata_t *quick_caches[NUM_QUICK_CACHES];  // Linked through |next|.
+  size_t cached_size;  // Total payload bytes in the quick caches.
 } my_heap_t;
 
 my_heap_t my_heap;
+bool deferred_coalescing = false;  // Set with --option=coalesce=deferred.
+
+#ifdef ENABLE_ALLOC_STATS
+alloc_stats_t my_alloc_stats;
+#endif
 
 void my_add_to_free_list(my_metadata_t *metadata) {
   assert(!metadata->next);
@@ -50,6 +72,7 @@ my_metadata_t *find_and_remove_from_free_list(my_metadata_t *target) {
   my_metadata_t *prev = NULL;
   
   while (current) {
+    ALLOC_STATS_INC(my_alloc_stats, free_walk_steps);
     if (current == target && current->is_free) {
       my_remove_from_free_list(current, prev);
       return current;
@@ -65,6 +88,7 @@ my_metadata_t *find_left_neighbor(void *ptr) {
   my_metadata_t *current = my_heap.free_head;
   
   while (current) {
+    ALLOC_STATS_INC(my_alloc_stats, free_walk_steps);
     if (current->is_free) {
       char *block_end = (char *)(current + 1) + current->size;
       if (block_end == (char *)ptr) {
@@ -83,6 +107,7 @@ my_metadata_t *find_right_neighbor(my_metadata_t *metadata) {
   
   my_metadata_t *current = my_heap.free_head;
   while (current) {
+    ALLOC_STATS_INC(my_alloc_stats, free_walk_steps);
     if (current == potential_neighbor && current->is_free) {
       return current;
     }
@@ -91,43 +116,173 @@ my_metadata_t *find_right_neighbor(my_metadata_t *metadata) {
   return NULL;
 }
 
+// Merge two lists that are sorted by address.
+my_metadata_t *merge_by_address(my_metadata_t *a, my_metadata_t *b) {
+  my_metadata_t head;
+  my_metadata_t *tail = &head;
+  while (a && b) {
+    if (a < b) {
+      tail->next = a;
+      a = a->next;
+    } else {
+      tail->next = b;
+      b = b->next;
+    }
+    tail = tail->next;
+  }
+  tail->next = a ? a : b;
+  return head.next;
+}
+
+// Merge sort a list by address. Needs no memory besides the |next| links.
+my_metadata_t *sort_by_address(my_metadata_t *list) {
+  if (!list || !list->next) {
+    return list;
+  }
+  my_metadata_t *slow = list;
+  my_metadata_t *fast = list->next;
+  while (fast && fast->next) {
+    slow = slow->next;
+    fast = fast->next->next;
+  }
+  my_metadata_t *second_half = slow->next;
+  slow->next = NULL;
+  return merge_by_address(sort_by_address(list), sort_by_address(second_half));
+}
+
+// Batch coalescing: put every cached block back and merge all the adjacent
+// free blocks in a single pass over the free blocks sorted by address. This
+// is O(n log n) for the whole batch. Merging the same blocks one my_free()
+// at a time would search the free list for every one of them.
+void coalesce_quick_caches() {
+  my_metadata_t *list = NULL;
+  for (my_metadata_t *metadata = my_heap.free_head; metadata;) {
+    my_metadata_t *next = metadata->next;
+    if (metadata != &my_heap.dummy) {
+      metadata->next = list;
+      list = metadata;
+    }
+    metadata = next;
+  }
+  for (int i = 0; i < NUM_QUICK_CACHES; i++) {
+    while (my_heap.quick_caches[i]) {
+      my_metadata_t *metadata = my_heap.quick_caches[i];
+      my_heap.quick_caches[i] = metadata->next;
+      metadata->is_free = true;
+      metadata->is_cached = false;
+      metadata->next = list;
+      list = metadata;
+    }
+  }
+  my_heap.cached_size = 0;
+
+  list = sort_by_address(list);
+  for (my_metadata_t *metadata = list; metadata;) {
+    my_metadata_t *next = metadata->next;
+    if ((char *)(metadata + 1) + metadata->size == (char *)next) {
+      ALLOC_STATS_INC(my_alloc_stats, coalesce_right);
+      metadata->size += sizeof(my_metadata_t) + next->size;
+      metadata->next = next->next;
+    } else {
+      metadata = next;
+    }
+  }
+  my_heap.free_head = &my_heap.dummy;
+  my_heap.dummy.next = list;
+}
+
 void my_initialize() {
   my_heap.free_head = &my_heap.dummy;
   my_heap.dummy.size = 0;
   my_heap.dummy.next = NULL;
   my_heap.dummy.is_free = true;
+  my_heap.dummy.is_cached = false;
+  for (int i = 0; i < NUM_QUICK_CACHES; i++) {
+    my_heap.quick_caches[i] = NULL;
+  }
+  my_heap.cached_size = 0;
+  ALLOC_STATS_RESET(my_alloc_stats);
+}
+
+// Options: coalesce=immediate (the default) or coalesce=deferred.
+bool my_set_option(const char *name, const char *value) {
+  if (strcmp(name, "coalesce") != 0) {
+    return false;
+  }
+  if (strcmp(value, "immediate") == 0) {
+    if (my_heap.cached_size) {
+      coalesce_quick_caches();
+    }
+    deferred_coalescing = false;
+  } else if (strcmp(value, "deferred") == 0) {
+    deferred_coalescing = true;
+  } else {
+    return false;
+  }
+  return true;
 }
 
 void *my_malloc(size_t size) {
+  if (deferred_coalescing && size <= QUICK_MAX_SIZE) {
+    my_metadata_t *cached = my_heap.quick_caches[(size + 7) / 8];
+    if (cached && cached->size >= size) {
+      ALLOC_STATS_INC(my_alloc_stats, mallocs);
+      ALLOC_STATS_INC(my_alloc_stats, fast_path_hits);
+      ALLOC_STATS_INC(my_alloc_stats, list_walk_steps);
+      my_heap.quick_caches[(size + 7) / 8] = cached->next;
+      my_heap.cached_size -= cached->size;
+      cached->next = NULL;
+      cached->is_cached = false;
+      return cached + 1;
+    }
+    ALLOC_STATS_INC(my_alloc_stats, bin_misses);
+  }
+
   my_metadata_t *metadata = my_heap.free_head;
   my_metadata_t *prev = NULL;
   
   // First-fit search
-  while (metadata && metadata->size < size) {
+  while (metadata) {
+    ALLOC_STATS_INC(my_alloc_stats, list_walk_steps);
+    if (metadata->size >= size) {
+      break;
+    }
     prev = metadata;
     metadata = metadata->next;
   }
 
   if (!metadata) {
+    ALLOC_STATS_INC(my_alloc_stats, bin_misses);
+    if (my_heap.cached_size) {
+      // Maybe the cached blocks merge into one that fits.
+      coalesce_quick_caches();
+      return my_malloc(size);
+    }
     size_t buffer_size = 4096;
     my_metadata_t *new_metadata = (my_metadata_t *)mmap_from_system(buffer_size);
+    ALLOC_STATS_INC(my_alloc_stats, refills);
+    ALLOC_STATS_ADD(my_alloc_stats, refill_size, buffer_size);
     new_metadata->size = buffer_size - sizeof(my_metadata_t);
     new_metadata->next = NULL;
     new_metadata->is_free = false;
+    new_metadata->is_cached = false;
     my_add_to_free_list(new_metadata);
     return my_malloc(size);
   }
 
+  ALLOC_STATS_INC(my_alloc_stats, mallocs);
   void *ptr = metadata + 1;
   size_t remaining_size = metadata->size - size;
   my_remove_from_free_list(metadata, prev);
 
   if (remaining_size > sizeof(my_metadata_t)) {
+    ALLOC_STATS_INC(my_alloc_stats, splits);
     metadata->size = size;
     my_metadata_t *new_metadata = (my_metadata_t *)((char *)ptr + size);
     new_metadata->size = remaining_size - sizeof(my_metadata_t);
     new_metadata->next = NULL;
     new_metadata->is_free = false;
+    new_metadata->is_cached = false;
     my_add_to_free_list(new_metadata);
   }
   return ptr;
@@ -135,6 +290,25 @@ void *my_malloc(size_t size) {
 
 void my_free(void *ptr) {
   my_metadata_t *metadata = (my_metadata_t *)ptr - 1;
+  ALLOC_STATS_INC(my_alloc_stats, frees);
+#ifdef ENABLE_HEAP_CHECK
+  if (metadata->is_free || metadata->is_cached) {
+    fprintf(stderr, "both: %p is already free (double free?)\n", ptr);
+    abort();
+  }
+#endif
+
+  if (deferred_coalescing && metadata->size <= QUICK_MAX_SIZE) {
+    int index = (metadata->size + 7) / 8;
+    metadata->is_cached = true;
+    metadata->next = my_heap.quick_caches[index];
+    my_heap.quick_caches[index] = metadata;
+    my_heap.cached_size += metadata->size;
+    if (my_heap.cached_size > QUICK_CACHE_LIMIT) {
+      coalesce_quick_caches();
+    }
+    return;
+  }
   
   // Look for left neighbor to coalesce
   my_metadata_t *left_neighbor = find_left_neighbor(metadata);
@@ -144,6 +318,8 @@ void my_free(void *ptr) {
   
   if (left_neighbor && right_neighbor) {
     // Coalesce with both neighbors
+    ALLOC_STATS_INC(my_alloc_stats, coalesce_left);
+    ALLOC_STATS_INC(my_alloc_stats, coalesce_right);
     find_and_remove_from_free_list(left_neighbor);
     find_and_remove_from_free_list(right_neighbor);
     
@@ -154,12 +330,14 @@ void my_free(void *ptr) {
     
   } else if (left_neighbor) {
     // Coalesce with left neighbor only
+    ALLOC_STATS_INC(my_alloc_stats, coalesce_left);
     find_and_remove_from_free_list(left_neighbor);
     left_neighbor->size += sizeof(my_metadata_t) + metadata->size;
     my_add_to_free_list(left_neighbor);
     
   } else if (right_neighbor) {
     // Coalesce with right neighbor only
+    ALLOC_STATS_INC(my_alloc_stats, coalesce_right);
     find_and_remove_from_free_list(right_neighbor);
     metadata->size += sizeof(my_metadata_t) + right_neighbor->size;
     my_add_to_free_list(metadata);
@@ -170,8 +348,104 @@ void my_free(void *ptr) {
   }
 }
 
+#ifdef ENABLE_HEAP_CHECK
+void heap_check_failed(const char *message, void *block) {
+  fprintf(stderr, "both: heap check failed at %p: %s\n", block, message);
+  abort();
+}
+
+int compare_address(const void *a, const void *b) {
+  uintptr_t address_a = *(const uintptr_t *)a;
+  uintptr_t address_b = *(const uintptr_t *)b;
+  return address_a < address_b ? -1 : address_a > address_b;
+}
+
+// Count the blocks in a list linked through |next|, or abort if it loops.
+size_t check_list(my_metadata_t *list) {
+  size_t count = 0;
+  my_metadata_t *fast = list;
+  for (my_metadata_t *slow = list; slow; slow = slow->next) {
+    count++;
+    fast = fast && fast->next ? fast->next->next : NULL;
+    if (fast && fast == slow->next) {
+      heap_check_failed("the list loops", slow);
+    }
+  }
+  return count;
+}
+
+// There is no list of the pages we got from the system, so unlike mix.c this
+// can't walk the heap block by block. It checks what the lists say instead:
+// free list blocks are free, cached blocks are marked cached (not free) and
+// sit in the cache for their size, cached_size adds up, and no two listed
+// blocks overlap (a block on two lists, or a corrupted size). |live_size|
+// isn't checked: without the walk we don't know how much is in use. Called
+// every few epochs in builds with ENABLE_HEAP_CHECK (make run_check). Returns
+// true.
+bool my_check_heap(size_t live_size) {
+  (void)live_size;
+  size_t count = check_list(my_heap.free_head);
+  size_t cached_size = 0;
+  for (int i = 0; i < NUM_QUICK_CACHES; i++) {
+    count += check_list(my_heap.quick_caches[i]);
+    for (my_metadata_t *metadata = my_heap.quick_caches[i]; metadata;
+         metadata = metadata->next) {
+      if (metadata->is_free || !metadata->is_cached ||
+          (metadata->size + 7) / 8 != (size_t)i) {
+        heap_check_failed("a free block or the wrong size in a quick cache",
+                          metadata);
+      }
+      cached_size += metadata->size;
+    }
+  }
+  if (cached_size != my_heap.cached_size) {
+    heap_check_failed("cached_size doesn't match the quick caches", &my_heap);
+  }
+
+  // Sort every listed block by address in a scratch mapping. It comes straight
+  // from mmap(), so it doesn't count in the challenge's mapped pages.
+  size_t scratch_size = (count * sizeof(uintptr_t) + 4095) / 4096 * 4096;
+  if (!scratch_size) {
+    return true;
+  }
+  uintptr_t *blocks = (uintptr_t *)mmap(NULL, scratch_size,
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (blocks == MAP_FAILED) {
+    heap_check_failed("no memory to sort the free blocks", &my_heap);
+  }
+  size_t num_blocks = 0;
+  for (my_metadata_t *metadata = my_heap.free_head; metadata;
+       metadata = metadata->next) {
+    if (metadata == &my_heap.dummy) {
+      continue;
+    }
+    if (!metadata->is_free || metadata->is_cached) {
+      heap_check_failed("a block in use on the free list", metadata);
+    }
+    blocks[num_blocks++] = (uintptr_t)metadata;
+  }
+  for (int i = 0; i < NUM_QUICK_CACHES; i++) {
+    for (my_metadata_t *metadata = my_heap.quick_caches[i]; metadata;
+         metadata = metadata->next) {
+      blocks[num_blocks++] = (uintptr_t)metadata;
+    }
+  }
+  qsort(blocks, num_blocks, sizeof(uintptr_t), compare_address);
+  for (size_t i = 1; i < num_blocks; i++) {
+    my_metadata_t *prev = (my_metadata_t *)blocks[i - 1];
+    if ((char *)(prev + 1) + prev->size > (char *)blocks[i]) {
+      heap_check_failed("overlaps the next free block (or is listed twice)",
+                        prev);
+    }
+  }
+  munmap(blocks, scratch_size);
+  return true;
+}
+#endif
+
 void my_finalize() {
-  // Nothing here for now
+  ALLOC_STATS_PRINT("both", my_alloc_stats);
 }
 
 void test() {
@@ -193,4 +467,31 @@ void test() {
   my_free(ptr5);
   
   assert(ptr1 != NULL && ptr2 != NULL && ptr3 != NULL && ptr4 != NULL && ptr5 != NULL);
+
+  // Test deferred coalescing
+  bool was_deferred = deferred_coalescing;
+  deferred_coalescing = true;
+  my_initialize();
+  char *a = my_malloc(64);
+  char *b = my_malloc(64);
+  char *c = my_malloc(64);
+  my_free(b);
+  assert(!((my_metadata_t *)b - 1)->is_free);  // Cached, not merged.
+  assert(((my_metadata_t *)b - 1)->is_cached);
+  char *again = my_malloc(64);
+  assert(again == b);  // Same size: straight back.
+  my_free(a);
+  my_free(b);
+  my_free(c);
+  coalesce_quick_caches();
+  my_metadata_t *merged = (my_metadata_t *)a - 1;
+  assert(merged->is_free);
+  assert(merged->size >= 3 * 64 + 2 * sizeof(my_metadata_t));
+  assert(my_heap.cached_size == 0);
+#ifdef ENABLE_HEAP_CHECK
+  bool heap_ok = my_check_heap(0);
+  assert(heap_ok);
+#endif
+  deferred_coalescing = was_deferred;
+  my_initialize();
 }
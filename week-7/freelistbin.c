@@ -11,6 +11,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "alloc_stats.h"
+
 void *mmap_from_system(size_t size);
 void munmap_to_system(void *ptr, size_t size);
 
@@ -29,6 +31,10 @@ typedef struct my_heap_t {
 
 my_heap_t my_heap;
 
+#ifdef ENABLE_ALLOC_STATS
+alloc_stats_t my_alloc_stats;
+#endif
+
 // Calculate which bin a size should go into
 int get_bin_index(size_t size) {
   if (size <= 32) return 0;      // 8-32 bytes
@@ -63,6 +69,7 @@ void my_initialize() {
   }
   my_heap.dummy.size = 0;
   my_heap.dummy.next = NULL;
+  ALLOC_STATS_RESET(my_alloc_stats);
 }
 
 void *my_malloc(size_t size) {
@@ -77,6 +84,7 @@ void *my_malloc(size_t size) {
     prev = NULL;
     
     while (metadata) {
+      ALLOC_STATS_INC(my_alloc_stats, list_walk_steps);
       if (metadata->size >= size) {
         found_bin = bin_index;
         break;
@@ -86,23 +94,31 @@ void *my_malloc(size_t size) {
     }
     
     if (found_bin != -1) break;
+    ALLOC_STATS_INC(my_alloc_stats, bin_misses);
   }
 
   if (found_bin == -1) {
     // No suitable free slot found, request new memory
     size_t buffer_size = 4096;
     my_metadata_t *new_metadata = (my_metadata_t *)mmap_from_system(buffer_size);
+    ALLOC_STATS_INC(my_alloc_stats, refills);
+    ALLOC_STATS_ADD(my_alloc_stats, refill_size, buffer_size);
     new_metadata->size = buffer_size - sizeof(my_metadata_t);
     new_metadata->next = NULL;
     my_add_to_free_list(new_metadata);
     return my_malloc(size);
   }
 
+  ALLOC_STATS_INC(my_alloc_stats, mallocs);
+  if (found_bin == start_bin) {
+    ALLOC_STATS_INC(my_alloc_stats, fast_path_hits);
+  }
   void *ptr = metadata + 1;
   size_t remaining_size = metadata->size - size;
   my_remove_from_free_list(metadata, prev, found_bin);
 
   if (remaining_size > sizeof(my_metadata_t)) {
+    ALLOC_STATS_INC(my_alloc_stats, splits);
     metadata->size = size;
     my_metadata_t *new_metadata = (my_metadata_t *)((char *)ptr + size);
     new_metadata->size = remaining_size - sizeof(my_metadata_t);
@@ -114,11 +130,12 @@ void *my_malloc(size_t size) {
 
 void my_free(void *ptr) {
   my_metadata_t *metadata = (my_metadata_t *)ptr - 1;
+  ALLOC_STATS_INC(my_alloc_stats, frees);
   my_add_to_free_list(metadata);
 }
 
 void my_finalize() {
-  // Nothing here for now
+  ALLOC_STATS_PRINT("freelistbin", my_alloc_stats);
 }
 
 void test() {
@@ -138,6 +155,7 @@ void test() {
   // Free some blocks to populate bins
   for (int i = 0; i < 5; i++) {
     my_free(small_ptrs[i]);
+    small_ptrs[i] = NULL;  // Don't free it again in the clean up below.
   }
   
   // Reallocate to test bin usage
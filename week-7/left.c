@@ -11,6 +11,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "alloc_stats.h"
+
 void *mmap_from_system(size_t size);
 void munmap_to_system(void *ptr, size_t size);
 
@@ -27,6 +29,10 @@ typedef struct my_heap_t {
 
 my_heap_t my_heap;
 
+#ifdef ENABLE_ALLOC_STATS
+alloc_stats_t my_alloc_stats;
+#endif
+
 void my_add_to_free_list(my_metadata_t *metadata) {
   assert(!metadata->next);
   metadata->is_free = true;
@@ -49,6 +55,7 @@ my_metadata_t *find_left_neighbor(void *ptr) {
   my_metadata_t *current = my_heap.free_head;
   
   while (current) {
+    ALLOC_STATS_INC(my_alloc_stats, free_walk_steps);
     if (current->is_free) {
       // Calculate where this block ends
       char *block_end = (char *)(current + 1) + current->size;
@@ -66,6 +73,7 @@ void my_initialize() {
   my_heap.dummy.size = 0;
   my_heap.dummy.next = NULL;
   my_heap.dummy.is_free = true;
+  ALLOC_STATS_RESET(my_alloc_stats);
 }
 
 void *my_malloc(size_t size) {
@@ -73,14 +81,21 @@ void *my_malloc(size_t size) {
   my_metadata_t *prev = NULL;
   
   // First-fit search
-  while (metadata && metadata->size < size) {
+  while (metadata) {
+    ALLOC_STATS_INC(my_alloc_stats, list_walk_steps);
+    if (metadata->size >= size) {
+      break;
+    }
     prev = metadata;
     metadata = metadata->next;
   }
 
   if (!metadata) {
+    ALLOC_STATS_INC(my_alloc_stats, bin_misses);
     size_t buffer_size = 4096;
     my_metadata_t *new_metadata = (my_metadata_t *)mmap_from_system(buffer_size);
+    ALLOC_STATS_INC(my_alloc_stats, refills);
+    ALLOC_STATS_ADD(my_alloc_stats, refill_size, buffer_size);
     new_metadata->size = buffer_size - sizeof(my_metadata_t);
     new_metadata->next = NULL;
     new_metadata->is_free = false;
@@ -88,11 +103,13 @@ void *my_malloc(size_t size) {
     return my_malloc(size);
   }
 
+  ALLOC_STATS_INC(my_alloc_stats, mallocs);
   void *ptr = metadata + 1;
   size_t remaining_size = metadata->size - size;
   my_remove_from_free_list(metadata, prev);
 
   if (remaining_size > sizeof(my_metadata_t)) {
+    ALLOC_STATS_INC(my_alloc_stats, splits);
     metadata->size = size;
     my_metadata_t *new_metadata = (my_metadata_t *)((char *)ptr + size);
     new_metadata->size = remaining_size - sizeof(my_metadata_t);
@@ -105,6 +122,7 @@ void *my_malloc(size_t size) {
 
 void my_free(void *ptr) {
   my_metadata_t *metadata = (my_metadata_t *)ptr - 1;
+  ALLOC_STATS_INC(my_alloc_stats, frees);
   
   // Look for left neighbor to coalesce
   my_metadata_t *left_neighbor = find_left_neighbor(metadata);
@@ -116,6 +134,7 @@ void my_free(void *ptr) {
     my_metadata_t *prev = NULL;
     
     while (current && current != left_neighbor) {
+      ALLOC_STATS_INC(my_alloc_stats, free_walk_steps);
       prev = current;
       current = current->next;
     }
@@ -125,6 +144,7 @@ void my_free(void *ptr) {
       
       // Expand left neighbor to include current block
       left_neighbor->size += sizeof(my_metadata_t) + metadata->size;
+      ALLOC_STATS_INC(my_alloc_stats, coalesce_left);
       my_add_to_free_list(left_neighbor);
     }
   } else {
@@ -134,7 +154,7 @@ void my_free(void *ptr) {
 }
 
 void my_finalize() {
-  // Nothing here for now
+  ALLOC_STATS_PRINT("left", my_alloc_stats);
 }
 
 void test() {
@@ -0,0 +1,21 @@
+//
+// Lifetime hints
+//
+// The challenge knows how long every object will live before it allocates it.
+// With hints on, the harness passes that along through the optional
+// my_malloc_hint(size, lifetime_class), so an allocator can keep objects that
+// die soon away from the ones that stay. Then a few survivors don't pin pages
+// that the short-lived churn would otherwise free up completely.
+//
+
+#ifndef LIFETIME_H
+#define LIFETIME_H
+
+typedef enum lifetime_class_t {
+  LIFETIME_SHORT,     // Freed within a few epochs. Also objects without a hint.
+  LIFETIME_LONG,      // Freed later in the cycle.
+  LIFETIME_IMMORTAL,  // Never freed.
+  NUM_LIFETIME_CLASSES,
+} lifetime_class_t;
+
+#endif  // LIFETIME_H
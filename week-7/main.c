@@ -7,12 +7,21 @@
 
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
-#include <sys/time.h>
+
+#include "lifetime.h"
+#include "perf_counters.h"
+#include "telemetry.h"
+#include "timer.h"
+#include "trace.h"
+#include "workload.h"
 
 //
 // [Simple malloc]
@@ -31,6 +40,49 @@ void my_free(void *ptr);
 void my_finalize();
 void test();
 
+// Optional: fills |heap_stats| with the allocator's free blocks for the
+// per-epoch telemetry (see telemetry.h). Allocators that do not define it
+// get this weak default, which marks the stats unavailable.
+__attribute__((weak)) void my_heap_stats(heap_stats_t *heap_stats) {
+  heap_stats->available = false;
+}
+
+// Optional: resize / allocate zeroed memory. The weak defaults return NULL,
+// which (as with realloc / calloc failing) leaves the old object alone; the
+// harness then falls back to malloc + memcpy + free / malloc + memset.
+__attribute__((weak)) void *my_realloc(void *ptr, size_t size) { return NULL; }
+__attribute__((weak)) void *my_calloc(size_t count, size_t size) {
+  return NULL;
+}
+
+// Optional: allocate |size| bytes at a multiple of |alignment| (a power of
+// two). The weak default returns NULL, and the harness over-allocates with
+// malloc and aligns the pointer itself.
+__attribute__((weak)) void *my_aligned_alloc(size_t alignment, size_t size) {
+  return NULL;
+}
+
+// Optional: malloc with a hint of how long the object will live (see
+// lifetime.h). The weak default returns NULL, and the harness falls back to
+// plain malloc.
+__attribute__((weak)) void *my_malloc_hint(size_t size,
+                                           lifetime_class_t lifetime_class) {
+  return NULL;
+}
+
+// Optional: change a tuning knob of the allocator at runtime, e.g.
+// --option=coalesce=deferred. Return false if |name| or |value| is unknown.
+// The weak default knows no options.
+__attribute__((weak)) bool my_set_option(const char *name, const char *value) {
+  return false;
+}
+
+// Optional: check the whole heap for corruption and abort with a message if
+// it is broken. |live_size| is how many bytes of objects the harness hasn't
+// freed yet. Called every few epochs in builds with ENABLE_HEAP_CHECK (make
+// run_check). The weak default checks nothing and returns false.
+__attribute__((weak)) bool my_check_heap(size_t live_size) { return false; }
+
 // This is code to run challenges. Please do NOT modify the code.
 
 // Vector
@@ -38,6 +90,7 @@ typedef struct object_t {
   void *ptr;
   size_t size;
   char tag;  // A tag to check the object is not broken.
+  uint32_t id;  // The order the object was allocated in. Used by traces.
 } object_t;
 
 typedef struct vector_t {
@@ -83,15 +136,91 @@ void vector_destroy(vector_t *vector) {
   free(vector);
 }
 
-// Return the current time in seconds.
-double get_time(void) {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return tv.tv_sec + tv.tv_usec * 1e-6;
+//
+// [Latency histograms]
+//
+// Log-bucketed: every power of two [2^e, 2^(e+1)) ns is split into
+// LATENCY_SUB_BUCKETS equal buckets, so a percentile read from the histogram
+// is within 25% of the true value.
+//
+#define LATENCY_SUB_BUCKETS_LOG2 2
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKETS_LOG2)
+#define LATENCY_NUM_BUCKETS (64 * LATENCY_SUB_BUCKETS)
+
+typedef struct latency_histogram_t {
+  uint64_t counts[LATENCY_NUM_BUCKETS];
+  uint64_t num_samples;
+  uint64_t max_ns;
+} latency_histogram_t;
+
+// Timing every malloc / free call costs two clock reads, so it is only done
+// with --latency.
+bool latency_enabled;
+bool hints_enabled = true;  // Cleared with --no-hints.
+// With --perf, run_challenge() counts hardware events (see perf_counters.h)
+// over the same interval it times.
+bool perf_enabled;
+perf_counters_t perf_counters;
+// Builds with ENABLE_HEAP_CHECK call the allocator's my_check_heap() every
+// this many epochs (--check-every=K).
+int heap_check_interval = 10;
+
+int latency_bucket(uint64_t ns) {
+  if (ns < LATENCY_SUB_BUCKETS) {
+    return (int)ns;
+  }
+  int e = 63 - __builtin_clzll(ns);
+  int sub =
+      (int)(ns >> (e - LATENCY_SUB_BUCKETS_LOG2)) & (LATENCY_SUB_BUCKETS - 1);
+  return (e - LATENCY_SUB_BUCKETS_LOG2 + 1) * LATENCY_SUB_BUCKETS + sub;
 }
 
+// The largest value that falls into |bucket|.
+uint64_t latency_bucket_upper_bound(int bucket) {
+  if (bucket < LATENCY_SUB_BUCKETS) {
+    return bucket;
+  }
+  int e = bucket / LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS_LOG2 - 1;
+  uint64_t sub = bucket % LATENCY_SUB_BUCKETS;
+  uint64_t step = (uint64_t)1 << (e - LATENCY_SUB_BUCKETS_LOG2);
+  return ((uint64_t)1 << e) + (sub + 1) * step - 1;
+}
+
+void latency_record(latency_histogram_t *histogram, uint64_t ns) {
+  histogram->counts[latency_bucket(ns)]++;
+  histogram->num_samples++;
+  if (ns > histogram->max_ns) {
+    histogram->max_ns = ns;
+  }
+}
+
+// Return the |quantile| (e.g. 0.99) latency in ns, rounded up to the bucket
+// bound (but never above the max seen).
+uint64_t latency_percentile(latency_histogram_t *histogram, double quantile) {
+  uint64_t rank = (uint64_t)ceil(quantile * histogram->num_samples);
+  uint64_t seen = 0;
+  for (int i = 0; i < LATENCY_NUM_BUCKETS; i++) {
+    seen += histogram->counts[i];
+    if (seen >= rank && seen > 0) {
+      uint64_t bound = latency_bucket_upper_bound(i);
+      return bound < histogram->max_ns ? bound : histogram->max_ns;
+    }
+  }
+  return histogram->max_ns;
+}
+
+// Per-thread random state used by worker threads of the threaded challenges.
+// NULL means rand(), so single-threaded runs produce the same sequence as
+// before.
+__thread unsigned *urand_state;
+
 // Return a random number in [0, 1).
-double urand() { return rand() / ((double)RAND_MAX + 1); }
+double urand() {
+  if (urand_state) {
+    return rand_r(urand_state) / ((double)RAND_MAX + 1);
+  }
+  return rand() / ((double)RAND_MAX + 1);
+}
 
 // Return an object size. The returned size is a random number in
 // [min_size, max_size] that follows an exponential distribution.
@@ -133,6 +262,129 @@ typedef void (*initialize_func_t)();
 typedef void *(*malloc_func_t)(size_t size);
 typedef void (*free_func_t)(void *ptr);
 typedef void (*finalize_func_t)();
+typedef void (*heap_stats_func_t)(heap_stats_t *heap_stats);
+typedef void *(*realloc_func_t)(void *ptr, size_t size);
+typedef void *(*calloc_func_t)(size_t count, size_t size);
+typedef void *(*aligned_alloc_func_t)(size_t alignment, size_t size);
+typedef bool (*set_option_func_t)(const char *name, const char *value);
+typedef void *(*malloc_hint_func_t)(size_t size,
+                                    lifetime_class_t lifetime_class);
+typedef bool (*check_heap_func_t)(size_t live_size);
+
+//
+// [Allocator registry]
+//
+// Every allocator the harness can run. "my" is the one linked as my_malloc
+// (MALLOC= in the Makefile). Builds with ENABLE_ALLOCATOR_REGISTRY also link
+// every strategy listed in allocators.def, with its my_* functions renamed to
+// <name>_* (see the Makefile).
+//
+typedef struct allocator_t {
+  const char *name;
+  initialize_func_t initialize_func;
+  malloc_func_t malloc_func;
+  free_func_t free_func;
+  finalize_func_t finalize_func;
+  void (*test_func)();  // NULL if the allocator has no test.
+  heap_stats_func_t heap_stats_func;  // NULL if there are no heap stats.
+  realloc_func_t realloc_func;        // NULL if the allocator has no realloc.
+  calloc_func_t calloc_func;          // NULL if the allocator has no calloc.
+  aligned_alloc_func_t aligned_alloc_func;  // NULL if there is none.
+  set_option_func_t set_option_func;        // NULL if there are no options.
+  malloc_hint_func_t malloc_hint_func;      // NULL if hints are ignored.
+  check_heap_func_t check_heap_func;        // NULL if there is no checker.
+} allocator_t;
+
+#ifdef ENABLE_ALLOCATOR_REGISTRY
+#define ALLOCATOR(name)                                                     \
+  void name##_initialize();                                                 \
+  void *name##_malloc(size_t size);                                         \
+  void name##_free(void *ptr);                                              \
+  void name##_finalize();                                                   \
+  void name##_test();                                                       \
+  __attribute__((weak)) void name##_heap_stats(heap_stats_t *heap_stats) { \
+    heap_stats->available = false;                                          \
+  }                                                                         \
+  __attribute__((weak)) void *name##_realloc(void *ptr, size_t size) {      \
+    return NULL;                                                            \
+  }                                                                         \
+  __attribute__((weak)) void *name##_calloc(size_t count, size_t size) {    \
+    return NULL;                                                            \
+  }                                                                         \
+  __attribute__((weak)) void *name##_aligned_alloc(size_t alignment,        \
+                                                   size_t size) {           \
+    return NULL;                                                            \
+  }                                                                         \
+  __attribute__((weak)) bool name##_set_option(const char *option_name,     \
+                                               const char *value) {         \
+    return false;                                                           \
+  }                                                                         \
+  __attribute__((weak)) void *name##_malloc_hint(                           \
+      size_t size, lifetime_class_t lifetime_class) {                       \
+    return NULL;                                                            \
+  }                                                                         \
+  __attribute__((weak)) bool name##_check_heap(size_t live_size) {          \
+    return false;                                                           \
+  }
+#include "allocators.def"
+#undef ALLOCATOR
+#endif
+
+allocator_t allocators[] = {
+    {"my", my_initialize, my_malloc, my_free, my_finalize, test,
+     my_heap_stats, my_realloc, my_calloc, my_aligned_alloc, my_set_option,
+     my_malloc_hint, my_check_heap},
+    {"simple", simple_initialize, simple_malloc, simple_free, simple_finalize,
+     NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
+#ifdef ENABLE_ALLOCATOR_REGISTRY
+#define ALLOCATOR(name)                                                \
+  {#name,           name##_initialize, name##_malloc,  name##_free,   \
+   name##_finalize, name##_test,       name##_heap_stats, name##_realloc, \
+   name##_calloc,   name##_aligned_alloc, name##_set_option,             \
+   name##_malloc_hint, name##_check_heap},
+#include "allocators.def"
+#undef ALLOCATOR
+#endif
+};
+
+#define NUM_ALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+
+// The allocator that runs as "my_malloc". Selected with --allocator=NAME.
+allocator_t *my_allocator = &allocators[0];
+allocator_t *simple_allocator = &allocators[1];
+
+// Return the registered allocator called |name|, or NULL.
+allocator_t *find_allocator(const char *name) {
+  for (size_t i = 0; i < NUM_ALLOCATORS; i++) {
+    if (strcmp(allocators[i].name, name) == 0) {
+      return &allocators[i];
+    }
+  }
+  return NULL;
+}
+
+// Pass |option| ("NAME=VALUE") to every allocator that has options. Return
+// false if the option is malformed or no allocator knows it.
+bool set_allocator_option(const char *option) {
+  const char *separator = strchr(option, '=');
+  if (!separator || separator == option) {
+    return false;
+  }
+  char name[64];
+  size_t name_length = separator - option;
+  if (name_length >= sizeof(name)) {
+    return false;
+  }
+  memcpy(name, option, name_length);
+  name[name_length] = '\0';
+  bool accepted = false;
+  for (size_t i = 0; i < NUM_ALLOCATORS; i++) {
+    if (allocators[i].set_option_func) {
+      accepted |= allocators[i].set_option_func(name, separator + 1);
+    }
+  }
+  return accepted;
+}
 
 // Record the statistics of each challenge.
 typedef struct stats_t {
@@ -142,51 +394,237 @@ typedef struct stats_t {
   size_t munmap_size;
   size_t allocated_size;
   size_t freed_size;
+  size_t live_pages;  // Pages holding live objects at the end of the run.
+  size_t resident_pages;  // Mapped pages backed by physical memory at the end.
+  size_t syscalls;        // mmap / munmap / madvise calls.
+  size_t operations;      // malloc / free calls.
+  uint64_t perf_values[NUM_PERF_EVENTS];  // Only filled with --perf.
+  latency_histogram_t malloc_latency;  // Only filled with --latency.
+  latency_histogram_t free_latency;
 } stats_t;
 
 stats_t stats;
-FILE *trace_fp;
+trace_writer_t trace_writer;
+telemetry_writer_t telemetry_writer;  // Opened with --telemetry=FILE.
+
+// The shape of the workload of one challenge. SMALL_WORKLOAD shrinks it for
+// slow builds (ASan, Valgrind).
+#ifdef SMALL_WORKLOAD
+#define EPOCHS_PER_CYCLE 10
+#define OBJECTS_PER_EPOCH_SMALL 25
+#define OBJECTS_PER_EPOCH_LARGE 50
+#else
+#define EPOCHS_PER_CYCLE 100
+#define OBJECTS_PER_EPOCH_SMALL 100
+#define OBJECTS_PER_EPOCH_LARGE 2000
+#endif
+#define CYCLES 10
+
+// The workload of run_challenge() and the threaded challenges. The defaults
+// are the ones above, changed at runtime with --workload=SPEC (see
+// workload.h).
+workload_t workload = {
+    .size_distribution = SIZE_EXPONENTIAL,
+    .lifetime_model = LIFETIME_MODEL_EXPONENTIAL,
+    .cycles = CYCLES,
+    .epochs_per_cycle = EPOCHS_PER_CYCLE,
+    .objects_per_epoch_small = OBJECTS_PER_EPOCH_SMALL,
+    .objects_per_epoch_large = OBJECTS_PER_EPOCH_LARGE,
+    .never_freed_ratio = 0.04,
+};
+
+#define FIRST_CHALLENGE_INDEX 1
+#define LAST_CHALLENGE_INDEX 5
+
+typedef struct challenge_t {
+  size_t min_size;
+  size_t max_size;
+} challenge_t;
+
+// The object sizes of challenges #1 to #5.
+const challenge_t challenges[] = {
+    {0, 0}, {128, 128}, {16, 16}, {16, 128}, {256, 4000}, {8, 4000}};
+
+// Check that the tag of an object is not broken.
+void check_object(object_t object) {
+  if (((char *)object.ptr)[0] != object.tag ||
+      ((char *)object.ptr)[object.size - 1] != object.tag) {
+    printf("An allocated object is broken!");
+    assert(0);
+  }
+}
+
+int compare_page(const void *a, const void *b) {
+  uintptr_t page_a = *(const uintptr_t *)a;
+  uintptr_t page_b = *(const uintptr_t *)b;
+  return page_a < page_b ? -1 : page_a > page_b;
+}
+
+// Count the distinct pages that hold at least one byte of a live object.
+// Utilization only sees mapped bytes; this shows how tightly the allocator
+// packs live data. These pages stay resident (and in the TLB) however many
+// free pages around them are given back.
+size_t count_live_pages(vector_t **vectors, int num_vectors) {
+  size_t num_pages = 0;
+  for (int i = 0; i < num_vectors; i++) {
+    for (size_t j = 0; j < vector_size(vectors[i]); j++) {
+      object_t object = vector_at(vectors[i], j);
+      num_pages += ((uintptr_t)object.ptr + object.size - 1) / 4096 -
+                   (uintptr_t)object.ptr / 4096 + 1;
+    }
+  }
+  uintptr_t *pages = (uintptr_t *)malloc(num_pages * sizeof(uintptr_t));
+  size_t index = 0;
+  for (int i = 0; i < num_vectors; i++) {
+    for (size_t j = 0; j < vector_size(vectors[i]); j++) {
+      object_t object = vector_at(vectors[i], j);
+      uintptr_t last = ((uintptr_t)object.ptr + object.size - 1) / 4096;
+      for (uintptr_t page = (uintptr_t)object.ptr / 4096; page <= last;
+           page++) {
+        pages[index++] = page;
+      }
+    }
+  }
+  qsort(pages, num_pages, sizeof(uintptr_t), compare_page);
+  size_t live_pages = 0;
+  for (size_t i = 0; i < num_pages; i++) {
+    if (i == 0 || pages[i] != pages[i - 1]) {
+      live_pages++;
+    }
+  }
+  free(pages);
+  return live_pages;
+}
+
+// The ranges mapped with mmap_from_system() since the challenge started, so
+// count_resident_pages() knows where to look. Appended in mmap order and cut
+// by munmap_to_system(), which searches from the newest: allocators mostly
+// unmap what they mapped recently.
+typedef struct mapping_t {
+  uintptr_t begin;
+  uintptr_t end;
+} mapping_t;
+
+mapping_t *mappings;
+size_t num_mappings;
+size_t mappings_capacity;
+pthread_mutex_t mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void add_mapping(uintptr_t begin, uintptr_t end) {
+  if (num_mappings == mappings_capacity) {
+    mappings_capacity = mappings_capacity ? 2 * mappings_capacity : 1024;
+    mappings = (mapping_t *)realloc(mappings,
+                                    mappings_capacity * sizeof(mapping_t));
+    assert(mappings);
+  }
+  mappings[num_mappings++] = (mapping_t){begin, end};
+}
+
+// Cut [begin, end) out of the tracked mappings. Ranges mapped before the
+// challenge started aren't tracked and are ignored.
+void remove_mapping(uintptr_t begin, uintptr_t end) {
+  for (size_t i = num_mappings; i-- > 0;) {
+    mapping_t mapping = mappings[i];
+    if (mapping.end <= begin || end <= mapping.begin) {
+      continue;
+    }
+    if (mapping.begin < begin && end < mapping.end) {
+      // A hole in the middle: keep both sides.
+      mappings[i].end = begin;
+      add_mapping(end, mapping.end);
+      return;
+    } else if (mapping.begin < begin) {
+      mappings[i].end = begin;
+    } else if (end < mapping.end) {
+      mappings[i].begin = end;
+    } else {
+      mappings[i] = mappings[--num_mappings];
+    }
+  }
+}
+
+// Count the tracked pages that are resident (in RAM, per mincore()).
+// Utilization charges every mapped byte; this is what the process really
+// costs once free pages are given back with madvise_to_system() instead of
+// being unmapped.
+size_t count_resident_pages() {
+  size_t resident_pages = 0;
+  unsigned char vector[256];
+  for (size_t i = 0; i < num_mappings; i++) {
+    for (uintptr_t begin = mappings[i].begin; begin < mappings[i].end;
+         begin += sizeof(vector) * 4096) {
+      size_t size = mappings[i].end - begin;
+      if (size > sizeof(vector) * 4096) {
+        size = sizeof(vector) * 4096;
+      }
+      int ret = mincore((void *)begin, size, vector);
+      assert(ret == 0);
+      for (size_t page = 0; page < size / 4096; page++) {
+        resident_pages += vector[page] & 1;
+      }
+    }
+  }
+  return resident_pages;
+}
+
+// Objects that live up to a tenth of a cycle are hinted as short lived. With
+// the default exponential lifetimes that is about half of them.
+lifetime_class_t get_lifetime_class(int lifetime, bool never_freed) {
+  if (never_freed) {
+    return LIFETIME_IMMORTAL;
+  }
+  return lifetime <= workload.epochs_per_cycle / 10 ? LIFETIME_SHORT
+                                                    : LIFETIME_LONG;
+}
 
 // Run one challenge.
-// |min_size|: The min size of an allocated object
-// |max_size|: The max size of an allocated object
-// |*_func|: Function pointers to initialize / malloc / free.
-void run_challenge(const char *trace_file_name, size_t min_size,
-                   size_t max_size, initialize_func_t initialize_func,
-                   malloc_func_t malloc_func, free_func_t free_func,
-                   finalize_func_t finalize_func) {
-  trace_fp = NULL;
+// |challenge_index|: Picks the object sizes from |challenges|
+// |trace_file_name|: Where to write the trace, or NULL
+// |allocator|: The allocator to run
+void run_challenge(int challenge_index, const char *trace_file_name,
+                   allocator_t *allocator) {
+  size_t min_size = challenges[challenge_index].min_size;
+  size_t max_size = challenges[challenge_index].max_size;
+  initialize_func_t initialize_func = allocator->initialize_func;
+  malloc_func_t malloc_func = allocator->malloc_func;
+  free_func_t free_func = allocator->free_func;
+  finalize_func_t finalize_func = allocator->finalize_func;
+  malloc_hint_func_t malloc_hint_func =
+      hints_enabled ? allocator->malloc_hint_func : NULL;
+  trace_writer.fp = NULL;
 #ifdef ENABLE_MALLOC_TRACE
   if (trace_file_name) {
-    trace_fp = fopen(trace_file_name, "wb");
-    if (!trace_fp) {
+    if (!trace_open(&trace_writer, trace_file_name)) {
       fprintf(stderr, "Failed to open a trace file: %s\n", trace_file_name);
       exit(EXIT_FAILURE);
     }
   }
-  const int epochs_per_cycle = 10;
-  const int objects_per_epoch_small = 25;
-  const int objects_per_epoch_large = 50;
-#else
-  const int epochs_per_cycle = 100;
-  const int objects_per_epoch_small = 100;
-  const int objects_per_epoch_large = 2000;
 #endif
-  const int cycles = 10;
+  const int epochs_per_cycle = workload.epochs_per_cycle;
+  const int objects_per_epoch_small = workload.objects_per_epoch_small;
+  const int objects_per_epoch_large = workload.objects_per_epoch_large;
+  const int cycles = workload.cycles;
   char tag = 0;
+  uint32_t next_id = 0;
   // The last entry of the vector is used to store objects that are never freed.
   vector_t *objects[epochs_per_cycle + 1];
   for (int i = 0; i < epochs_per_cycle + 1; i++) {
     objects[i] = vector_create();
   }
+  num_mappings = 0;
   initialize_func();
   stats.mmap_size = stats.munmap_size = 0;
+  stats.syscalls = 0;
+  stats.operations = 0;
   stats.allocated_size = stats.freed_size = 0;
+  memset(&stats.malloc_latency, 0, sizeof(stats.malloc_latency));
+  memset(&stats.free_latency, 0, sizeof(stats.free_latency));
+  if (perf_enabled) {
+    perf_counters_start(&perf_counters);
+  }
   stats.begin_time = get_time();
   for (int cycle = 0; cycle < cycles; cycle++) {
     for (int epoch = 0; epoch < epochs_per_cycle; epoch++) {
-      size_t allocated = 0;
-      size_t freed = 0;
 
       // Allocate |objects_per_epoch| objects.
       int objects_per_epoch = objects_per_epoch_small;
@@ -196,24 +634,37 @@ void run_challenge(const char *trace_file_name, size_t min_size,
         objects_per_epoch = objects_per_epoch_large;
       }
       for (int i = 0; i < objects_per_epoch; i++) {
-        size_t size = get_object_size(min_size, max_size);
-        int lifetime = get_object_lifetime(1, epochs_per_cycle);
+        size_t size = workload_object_size(&workload, min_size, max_size);
+        int lifetime = workload_object_lifetime(&workload);
+        // 4% of objects (by default) are set as never freed. (Drawn before
+        // the malloc so the hint can say so. Allocators don't call rand(), so
+        // the sequence of objects is the same as before.)
+        bool never_freed = urand() < workload.never_freed_ratio;
         stats.allocated_size += size;
-        allocated += size;
-        void *ptr = malloc_func(size);
-        if (trace_fp) {
-          fprintf(trace_fp, "a %llu %ld\n", (unsigned long long)ptr, size);
+        uint64_t begin_ns = latency_enabled ? get_time_ns() : 0;
+        void *ptr = NULL;
+        if (malloc_hint_func) {
+          ptr = malloc_hint_func(
+              size, get_lifetime_class(lifetime, never_freed));
+        }
+        if (!ptr) {
+          ptr = malloc_func(size);
+        }
+        if (latency_enabled) {
+          latency_record(&stats.malloc_latency, get_time_ns() - begin_ns);
         }
+        stats.operations++;
+        trace_write(&trace_writer, TRACE_MALLOC, next_id, size);
         memset(ptr, tag, size);
-        object_t object = {ptr, size, tag};
+        object_t object = {ptr, size, tag, next_id};
+        next_id++;
         tag++;
         if (tag == 0) {
           // Avoid 0 for tagging since it is not distinguishable from fresh
           // mmaped memory.
           tag++;
         }
-        if (urand() < 0.04) {
-          // 4% of objects are set as never freed.
+        if (never_freed) {
           vector_push(objects[epochs_per_cycle], object);
         } else {
           vector_push(objects[(epoch + lifetime) % epochs_per_cycle], object);
@@ -225,52 +676,86 @@ void run_challenge(const char *trace_file_name, size_t min_size,
       for (size_t i = 0; i < vector_size(vector); i++) {
         object_t object = vector_at(vector, i);
         stats.freed_size += object.size;
-        freed += object.size;
-        // Check that the tag is not broken.
-        if (((char *)object.ptr)[0] != object.tag ||
-            ((char *)object.ptr)[object.size - 1] != object.tag) {
-          printf("An allocated object is broken!");
-          assert(0);
-        }
-        if (trace_fp) {
-          fprintf(trace_fp, "f %llu %ld\n", (unsigned long long)object.ptr,
-                  object.size);
-        }
+        check_object(object);
+        trace_write(&trace_writer, TRACE_FREE, object.id, object.size);
+        uint64_t begin_ns = latency_enabled ? get_time_ns() : 0;
         free_func(object.ptr);
+        if (latency_enabled) {
+          latency_record(&stats.free_latency, get_time_ns() - begin_ns);
+        }
+        stats.operations++;
       }
 
-#if 0
-      // Debug print
-      printf("epoch = %d, allocated = %ld bytes, freed = %ld bytes\n",
-             cycle * epochs_per_cycle + epoch, allocated, freed);
-      printf("allocated = %.2f MB, freed = %.2f MB, mmap = %.2f MB, munmap = %.2f MB, utilization = %d%%\n",
-             stats.allocated_size / 1024.0 / 1024.0,
-             stats.freed_size / 1024.0 / 1024.0,
-             stats.mmap_size / 1024.0 / 1024.0,
-             stats.munmap_size / 1024.0 / 1024.0,
-             (int)(100.0 * (stats.allocated_size - stats.freed_size)
-                   / (stats.mmap_size - stats.munmap_size)));
+      if (telemetry_writer.fp) {
+        heap_stats_t heap_stats = {0};
+        if (allocator->heap_stats_func) {
+          allocator->heap_stats_func(&heap_stats);
+        }
+        telemetry_write(&telemetry_writer, allocator->name, challenge_index,
+                        cycle * epochs_per_cycle + epoch,
+                        stats.allocated_size - stats.freed_size,
+                        stats.mmap_size - stats.munmap_size, &heap_stats);
+      }
+#ifdef ENABLE_HEAP_CHECK
+      if (allocator->check_heap_func &&
+          (cycle * epochs_per_cycle + epoch + 1) % heap_check_interval == 0) {
+        allocator->check_heap_func(stats.allocated_size - stats.freed_size);
+      }
 #endif
       vector_clear(vector);
     }
   }
   stats.end_time = get_time();
+  if (perf_enabled) {
+    perf_counters_stop(&perf_counters);
+    memcpy(stats.perf_values, perf_counters.values, sizeof(stats.perf_values));
+  }
+  stats.live_pages = count_live_pages(objects, epochs_per_cycle + 1);
+  stats.resident_pages = count_resident_pages();
   for (int i = 0; i < epochs_per_cycle + 1; i++) {
     vector_destroy(objects[i]);
   }
   finalize_func();
-  if (trace_fp) {
-    fclose(trace_fp);
-    trace_fp = NULL;
-  }
+  trace_close(&trace_writer);
 }
 
-#define FIRST_CHALLENGE_INDEX 1
-#define LAST_CHALLENGE_INDEX 5
-
 int my_malloc_time_ms[LAST_CHALLENGE_INDEX + 1];
 int my_malloc_utilization_percentage[LAST_CHALLENGE_INDEX + 1];
 
+// Print the latency percentiles of one operation.
+void print_latency(const char *operation, latency_histogram_t *simple_latency,
+                   latency_histogram_t *my_latency) {
+  const double quantiles[] = {0.5, 0.99, 0.999};
+  const char *labels[] = {"p50", "p99", "p99.9"};
+  char label[32];
+  for (int i = 0; i < 3; i++) {
+    snprintf(label, sizeof(label), "%s %s ns", operation, labels[i]);
+    printf("%16s| %15lu => %15lu\n", label,
+           (unsigned long)latency_percentile(simple_latency, quantiles[i]),
+           (unsigned long)latency_percentile(my_latency, quantiles[i]));
+  }
+  snprintf(label, sizeof(label), "%s max ns", operation);
+  printf("%16s| %15lu => %15lu\n", label, (unsigned long)simple_latency->max_ns,
+         (unsigned long)my_latency->max_ns);
+}
+
+// Print the hardware events per malloc / free call. The counts cover the
+// whole timed loop, so they include the harness's memset and tag checks; those
+// cost the same for every allocator except for the misses on the objects.
+void print_perf(stats_t *simple_stats, stats_t *my_stats) {
+  for (int i = 0; i < NUM_PERF_EVENTS; i++) {
+    char label[32];
+    snprintf(label, sizeof(label), "%s/op", perf_event_name(i));
+    if (perf_counter_available(&perf_counters, i)) {
+      printf("%16s| %15.2f => %15.2f\n", label,
+             (double)simple_stats->perf_values[i] / simple_stats->operations,
+             (double)my_stats->perf_values[i] / my_stats->operations);
+    } else {
+      printf("%16s| %15s => %15s\n", label, "n/a", "n/a");
+    }
+  }
+}
+
 // Print stats
 void print_stats(int challenge_index, stats_t simple_stats, stats_t my_stats) {
   assert(FIRST_CHALLENGE_INDEX <= challenge_index &&
@@ -292,6 +777,20 @@ void print_stats(int challenge_index, stats_t simple_stats, stats_t my_stats) {
   printf("%16s| %15d => %15d\n", "Time [ms]", simple_time_ms, my_time_ms);
   printf("%16s| %15d => %15d\n", "Utilization [%] ",
          simple_utilization_percentage, my_utilization_percentage);
+  printf("%16s| %15zu => %15zu\n", "Live pages", simple_stats.live_pages,
+         my_stats.live_pages);
+  printf("%16s| %15zu => %15zu\n", "Resident pages",
+         simple_stats.resident_pages, my_stats.resident_pages);
+  printf("%16s| %15zu => %15zu\n", "Syscalls", simple_stats.syscalls,
+         my_stats.syscalls);
+  if (latency_enabled) {
+    print_latency("malloc", &simple_stats.malloc_latency,
+                  &my_stats.malloc_latency);
+    print_latency("free", &simple_stats.free_latency, &my_stats.free_latency);
+  }
+  if (perf_enabled) {
+    print_perf(&simple_stats, &my_stats);
+  }
 
   my_malloc_time_ms[challenge_index] = my_time_ms;
   my_malloc_utilization_percentage[challenge_index] = my_utilization_percentage;
@@ -310,83 +809,779 @@ void print_score_data() {
 void run_challenges() {
   stats_t simple_stats, my_stats;
 
-#ifdef ENABLE_MALLOC_TRACE
+#if defined(ENABLE_MALLOC_TRACE) || defined(SMALL_WORKLOAD) || \
+    defined(ENABLE_HEAP_CHECK)
   printf(
-      "!!! WARNING - MALLOC_TRACE is enabled.\n"
+      "!!! WARNING - MALLOC_TRACE, SMALL_WORKLOAD or HEAP_CHECK is enabled.\n"
       "The result will be different compare to normal builds.\n");
 #endif
 
-  // Warm up run.
-  run_challenge(NULL, 128, 128, simple_initialize, simple_malloc, simple_free,
-                simple_finalize);
+  // Warm up run. Keep it out of the telemetry.
+  FILE *telemetry_fp = telemetry_writer.fp;
+  telemetry_writer.fp = NULL;
+  run_challenge(1, NULL, simple_allocator);
+  telemetry_writer.fp = telemetry_fp;
 
   // Challenge 1:
-  run_challenge("trace1_simple.txt", 128, 128, simple_initialize, simple_malloc,
-                simple_free, simple_finalize);
+  run_challenge(1, "trace1_simple.trace", simple_allocator);
   simple_stats = stats;
-  run_challenge("trace1_my.txt", 128, 128, my_initialize, my_malloc, my_free,
-                my_finalize);
+  run_challenge(1, "trace1_my.trace", my_allocator);
   my_stats = stats;
   print_stats(1, simple_stats, my_stats);
 
   // Challenge 2:
-  run_challenge("trace2_simple.txt", 16, 16, simple_initialize, simple_malloc,
-                simple_free, simple_finalize);
+  run_challenge(2, "trace2_simple.trace", simple_allocator);
   simple_stats = stats;
-  run_challenge("trace2_my.txt", 16, 16, my_initialize, my_malloc, my_free,
-                my_finalize);
+  run_challenge(2, "trace2_my.trace", my_allocator);
   my_stats = stats;
   print_stats(2, simple_stats, my_stats);
 
   // Challenge 3:
-  run_challenge("trace3_simple.txt", 16, 128, simple_initialize, simple_malloc,
-                simple_free, simple_finalize);
+  run_challenge(3, "trace3_simple.trace", simple_allocator);
   simple_stats = stats;
-  run_challenge("trace3_my.txt", 16, 128, my_initialize, my_malloc, my_free,
-                my_finalize);
+  run_challenge(3, "trace3_my.trace", my_allocator);
   my_stats = stats;
   print_stats(3, simple_stats, my_stats);
 
   // Challenge 4:
-  run_challenge("trace4_simple.txt", 256, 4000, simple_initialize,
-                simple_malloc, simple_free, simple_finalize);
+  run_challenge(4, "trace4_simple.trace", simple_allocator);
   simple_stats = stats;
-  run_challenge("trace4_my.txt", 256, 4000, my_initialize, my_malloc, my_free,
-                my_finalize);
+  run_challenge(4, "trace4_my.trace", my_allocator);
   my_stats = stats;
   print_stats(4, simple_stats, my_stats);
 
   // Challenge 5:
-  run_challenge("trace5_simple.txt", 8, 4000, simple_initialize, simple_malloc,
-                simple_free, simple_finalize);
+  run_challenge(5, "trace5_simple.trace", simple_allocator);
   simple_stats = stats;
-  run_challenge("trace5_my.txt", 8, 4000, my_initialize, my_malloc, my_free,
-                my_finalize);
+  run_challenge(5, "trace5_my.trace", my_allocator);
   my_stats = stats;
   print_stats(5, simple_stats, my_stats);
 
-#ifdef ENABLE_MALLOC_TRACE
+#if defined(ENABLE_MALLOC_TRACE) || defined(SMALL_WORKLOAD) || \
+    defined(ENABLE_HEAP_CHECK)
   printf(
-      "!!! WARNING - MALLOC_TRACE is enabled.\n"
+      "!!! WARNING - MALLOC_TRACE, SMALL_WORKLOAD or HEAP_CHECK is enabled.\n"
       "The result will be different compare to normal builds.\n");
 #endif
 
-#ifndef ENABLE_MALLOC_TRACE
-  print_score_data();
+#if !defined(ENABLE_MALLOC_TRACE) && !defined(SMALL_WORKLOAD) && \
+    !defined(ENABLE_HEAP_CHECK)
+  // Scores are only comparable on the standard workload.
+  if (!workload.is_custom) {
+    print_score_data();
+  }
 #endif
 }
 
+// Run all challenges with each allocator in |names| (comma separated, or NULL
+// for every registered one) and print one table to compare them. With --perf,
+// every allocator also gets a row per hardware event, per malloc / free call.
+void run_comparison(const char *names) {
+  printf("%-14s", "Allocator");
+  for (int i = FIRST_CHALLENGE_INDEX; i <= LAST_CHALLENGE_INDEX; i++) {
+    printf(" | #%d %7s %5s %5s %5s", i, "ms", "util%", "pages", "rss");
+  }
+  printf("\n");
+  for (size_t a = 0; a < NUM_ALLOCATORS; a++) {
+    allocator_t *allocator = &allocators[a];
+    if (names) {
+      // Match whole comma-separated entries only.
+      size_t length = strlen(allocator->name);
+      const char *match = names;
+      while ((match = strstr(match, allocator->name)) &&
+             !((match == names || match[-1] == ',') &&
+               (match[length] == ',' || match[length] == '\0'))) {
+        match++;
+      }
+      if (!match) {
+        continue;
+      }
+    }
+    if (allocator->test_func) {
+      allocator->test_func();
+    }
+    printf("%-14s", allocator->name);
+    double perf_per_op[LAST_CHALLENGE_INDEX + 1][NUM_PERF_EVENTS];
+    for (int i = FIRST_CHALLENGE_INDEX; i <= LAST_CHALLENGE_INDEX; i++) {
+      run_challenge(i, NULL, allocator);
+      for (int e = 0; e < NUM_PERF_EVENTS; e++) {
+        perf_per_op[i][e] = (double)stats.perf_values[e] / stats.operations;
+      }
+      int time_ms = (stats.end_time - stats.begin_time) * 1000;
+      int utilization_percentage =
+          (int)(100.0 * (stats.allocated_size - stats.freed_size) /
+                (stats.mmap_size - stats.munmap_size));
+      printf(" | %10d %5d %5zu %5zu", time_ms, utilization_percentage,
+             stats.live_pages, stats.resident_pages);
+      fflush(stdout);
+    }
+    printf("\n");
+    for (int e = 0; perf_enabled && e < NUM_PERF_EVENTS; e++) {
+      if (!perf_counter_available(&perf_counters, e)) {
+        continue;
+      }
+      printf(" %-13s", perf_event_name(e));
+      for (int i = FIRST_CHALLENGE_INDEX; i <= LAST_CHALLENGE_INDEX; i++) {
+        printf(" | %28.2f", perf_per_op[i][e]);
+      }
+      printf("\n");
+    }
+  }
+}
+
+//
+// [Growth challenge]
+//
+// Buffers that grow as data is appended to them (string builders, vectors).
+// GROWTH_BUFFERS buffers are live at a time. Each starts as a zeroed calloc of
+// GROWTH_MIN_SIZE to 2 * GROWTH_MIN_SIZE bytes and grows by 1/8 to 1/2 of its
+// size per step. A buffer that would grow past GROWTH_MAX_SIZE (kept under
+// 4096 like the other challenges, since simple_malloc maps one page at a time)
+// is freed instead and a new one takes its slot. A realloc that moves a
+// buffer copies its old contents; one that grows in place copies nothing. An
+// allocator without realloc pays for malloc + memcpy + free every time.
+//
+#define GROWTH_BUFFERS 1000
+#define GROWTH_STEPS 50000
+#define GROWTH_MIN_SIZE 16
+#define GROWTH_MAX_SIZE 4000
+
+typedef struct growth_stats_t {
+  double seconds;
+  uint64_t reallocs;
+  uint64_t in_place;     // Reallocs that returned the same pointer.
+  uint64_t copied_size;  // Bytes copied because a buffer moved.
+  uint64_t old_size;     // Bytes malloc + memcpy + free would have copied.
+  int utilization_percentage;  // Live bytes / mapped bytes at the end.
+} growth_stats_t;
+
+// Resize |object| to |size| bytes with the allocator's realloc, or with
+// malloc + memcpy + free if it has none (or its realloc returns NULL).
+void *growth_realloc(allocator_t *allocator, object_t *object, size_t size) {
+  if (allocator->realloc_func) {
+    void *ptr = allocator->realloc_func(object->ptr, size);
+    if (ptr) {
+      return ptr;
+    }
+  }
+  void *ptr = allocator->malloc_func(size);
+  memcpy(ptr, object->ptr, object->size);
+  allocator->free_func(object->ptr);
+  return ptr;
+}
+
+// Allocate |size| zeroed bytes with the allocator's calloc, or malloc + memset.
+void *growth_calloc(allocator_t *allocator, size_t size) {
+  if (allocator->calloc_func) {
+    void *ptr = allocator->calloc_func(1, size);
+    if (ptr) {
+      return ptr;
+    }
+  }
+  void *ptr = allocator->malloc_func(size);
+  memset(ptr, 0, size);
+  return ptr;
+}
+
+// Start a new buffer in |object|, checking that calloc really zeroed it.
+void growth_new_buffer(allocator_t *allocator, object_t *object, char tag) {
+  // Sizes are multiples of 8, like in the other challenges.
+  object->size =
+      (GROWTH_MIN_SIZE + (size_t)(urand() * GROWTH_MIN_SIZE)) / 8 * 8;
+  object->ptr = growth_calloc(allocator, object->size);
+  object->tag = tag;
+  for (size_t i = 0; i < object->size; i++) {
+    if (((char *)object->ptr)[i] != 0) {
+      printf("A calloc-ed object is not zeroed!");
+      assert(0);
+    }
+  }
+  memset(object->ptr, tag, object->size);
+  stats.allocated_size += object->size;
+}
+
+growth_stats_t run_growth_challenge(allocator_t *allocator) {
+  growth_stats_t result = {0};
+  object_t objects[GROWTH_BUFFERS];
+  char tag = 1;
+  num_mappings = 0;
+  allocator->initialize_func();
+  stats.mmap_size = stats.munmap_size = 0;
+  stats.allocated_size = stats.freed_size = 0;
+  double begin_time = get_time();
+  for (int i = 0; i < GROWTH_BUFFERS; i++) {
+    growth_new_buffer(allocator, &objects[i], tag);
+  }
+  for (int step = 0; step < GROWTH_STEPS; step++) {
+    object_t *object = &objects[(size_t)(urand() * GROWTH_BUFFERS)];
+    check_object(*object);
+    size_t size = (object->size + object->size / 8 +
+                   (size_t)(urand() * (object->size * 3 / 8)) + 7) /
+                  8 * 8;
+    if (size > GROWTH_MAX_SIZE) {
+      stats.freed_size += object->size;
+      allocator->free_func(object->ptr);
+      tag = tag == 127 ? 1 : tag + 1;
+      growth_new_buffer(allocator, object, tag);
+      continue;
+    }
+    void *ptr = growth_realloc(allocator, object, size);
+    result.reallocs++;
+    result.old_size += object->size;
+    if (ptr == object->ptr) {
+      result.in_place++;
+    } else {
+      result.copied_size += object->size;
+    }
+    // The old contents must have come along; fill in the appended part.
+    object->ptr = ptr;
+    check_object(*object);
+    memset((char *)ptr + object->size, object->tag, size - object->size);
+    stats.allocated_size += size - object->size;
+    object->size = size;
+  }
+  result.seconds = get_time() - begin_time;
+  result.utilization_percentage =
+      (int)(100.0 * (stats.allocated_size - stats.freed_size) /
+            (stats.mmap_size - stats.munmap_size));
+  for (int i = 0; i < GROWTH_BUFFERS; i++) {
+    allocator->free_func(objects[i].ptr);
+  }
+  allocator->finalize_func();
+  return result;
+}
+
+// Run the growth challenge with simple_malloc and my_malloc.
+void run_growth_challenges() {
+  growth_stats_t simple_result = run_growth_challenge(simple_allocator);
+  growth_stats_t my_result = run_growth_challenge(my_allocator);
+  growth_stats_t *results[] = {&simple_result, &my_result};
+  int time_ms[2], in_place_percentage[2], saved_percentage[2];
+  unsigned long copied_kib[2];
+  for (int i = 0; i < 2; i++) {
+    time_ms[i] = results[i]->seconds * 1000;
+    in_place_percentage[i] =
+        (int)(100.0 * results[i]->in_place / results[i]->reallocs);
+    saved_percentage[i] =
+        (int)(100.0 * (results[i]->old_size - results[i]->copied_size) /
+              results[i]->old_size);
+    copied_kib[i] = results[i]->copied_size / 1024;
+  }
+  printf("====================================================\n");
+  printf("Growth          | %15s => %15s\n", "simple_malloc", "my_malloc");
+  printf("%-16s+ %15s => %15s\n", "---------------", "---------------",
+         "---------------");
+  printf("%16s| %15d => %15d\n", "Time [ms]", time_ms[0], time_ms[1]);
+  printf("%16s| %15d => %15d\n", "Utilization [%] ",
+         simple_result.utilization_percentage,
+         my_result.utilization_percentage);
+  printf("%16s| %15d => %15d\n", "In place [%]", in_place_percentage[0],
+         in_place_percentage[1]);
+  printf("%16s| %15lu => %15lu\n", "Copied [KiB]", copied_kib[0],
+         copied_kib[1]);
+  printf("%16s| %15d => %15d\n", "Copy saved [%]", saved_percentage[0],
+         saved_percentage[1]);
+}
+
+//
+// [Alignment challenge]
+//
+// A mix of aligned objects: 64-byte aligned cache-line objects, 4096-byte
+// aligned I/O buffers and plain 16-byte aligned objects. ALIGNED_SLOTS objects
+// are live at a time; every step frees a random one and allocates a new one
+// in its place. The same allocator runs it twice: once through its
+// my_aligned_alloc, once by over-allocating with my_malloc and aligning the
+// pointer in the harness, which is what a caller without an aligned
+// allocation API has to do (and what the aligned run falls back to when
+// my_aligned_alloc returns NULL). (simple_malloc can't run this: a 4096-byte
+// aligned buffer needs more than the one page it maps at a time.)
+//
+#define ALIGNED_SLOTS 2000
+#define ALIGNED_STEPS 200000
+
+typedef struct aligned_class_t {
+  size_t alignment;
+  size_t min_size;
+  size_t max_size;
+  double ratio;
+} aligned_class_t;
+
+const aligned_class_t aligned_classes[] = {
+    {64, 64, 1024, 0.6}, {4096, 512, 4096, 0.1}, {16, 16, 256, 0.3}};
+
+#define NUM_ALIGNED_CLASSES \
+  (sizeof(aligned_classes) / sizeof(aligned_classes[0]))
+
+typedef struct aligned_stats_t {
+  double seconds;
+  int utilization_percentage;  // Requested bytes / mapped bytes at the end.
+  size_t overhead_size;        // Mapped bytes not requested, at the end.
+} aligned_stats_t;
+
+// Allocate an object for |object| (size and tag already set) with
+// |alignment|. |*base| is what has to be passed to free.
+void aligned_object_alloc(allocator_t *allocator, bool use_aligned_alloc,
+                          size_t alignment, object_t *object, void **base) {
+  object->ptr = NULL;
+  if (use_aligned_alloc && allocator->aligned_alloc_func) {
+    object->ptr = allocator->aligned_alloc_func(alignment, object->size);
+    *base = object->ptr;
+  }
+  if (!object->ptr) {
+    *base = allocator->malloc_func(object->size + alignment - 8);
+    object->ptr = (void *)(((uintptr_t)*base + alignment - 1) &
+                           ~(uintptr_t)(alignment - 1));
+  }
+  if ((uintptr_t)object->ptr % alignment != 0) {
+    printf("An object is not aligned to %zu bytes!", alignment);
+    assert(0);
+  }
+  memset(object->ptr, object->tag, object->size);
+}
+
+aligned_stats_t run_alignment_challenge(allocator_t *allocator,
+                                        bool use_aligned_alloc) {
+  aligned_stats_t result = {0};
+  object_t objects[ALIGNED_SLOTS];
+  void *bases[ALIGNED_SLOTS];
+  char tag = 1;
+  num_mappings = 0;
+  allocator->initialize_func();
+  stats.mmap_size = stats.munmap_size = 0;
+  stats.allocated_size = stats.freed_size = 0;
+  double begin_time = get_time();
+  for (int step = 0; step < ALIGNED_STEPS + ALIGNED_SLOTS; step++) {
+    int slot = step;
+    if (step >= ALIGNED_SLOTS) {
+      // Every slot is filled. Replace a random object.
+      slot = (int)(urand() * ALIGNED_SLOTS);
+      check_object(objects[slot]);
+      stats.freed_size += objects[slot].size;
+      allocator->free_func(bases[slot]);
+    }
+    const aligned_class_t *class = &aligned_classes[NUM_ALIGNED_CLASSES - 1];
+    double r = urand();
+    for (size_t i = 0; i < NUM_ALIGNED_CLASSES; i++) {
+      if (r < aligned_classes[i].ratio) {
+        class = &aligned_classes[i];
+        break;
+      }
+      r -= aligned_classes[i].ratio;
+    }
+    object_t *object = &objects[slot];
+    object->size = get_object_size(class->min_size, class->max_size);
+    object->tag = tag;
+    tag = tag == 127 ? 1 : tag + 1;
+    aligned_object_alloc(allocator, use_aligned_alloc, class->alignment,
+                         object, &bases[slot]);
+    stats.allocated_size += object->size;
+  }
+  result.seconds = get_time() - begin_time;
+  size_t live_size = stats.allocated_size - stats.freed_size;
+  size_t mapped_size = stats.mmap_size - stats.munmap_size;
+  result.utilization_percentage = (int)(100.0 * live_size / mapped_size);
+  result.overhead_size = mapped_size - live_size;
+  for (int i = 0; i < ALIGNED_SLOTS; i++) {
+    allocator->free_func(bases[i]);
+  }
+  allocator->finalize_func();
+  return result;
+}
+
+// Run the alignment challenge with my_malloc, with and without its
+// my_aligned_alloc.
+void run_alignment_challenges() {
+  aligned_stats_t results[2];
+  results[0] = run_alignment_challenge(my_allocator, false);
+  results[1] = run_alignment_challenge(my_allocator, true);
+  printf("====================================================\n");
+  printf("Alignment       | %15s => %15s\n", "malloc + align",
+         "aligned_alloc");
+  printf("%-16s+ %15s => %15s\n", "---------------", "---------------",
+         "---------------");
+  printf("%16s| %15d => %15d\n", "Time [ms]", (int)(results[0].seconds * 1000),
+         (int)(results[1].seconds * 1000));
+  printf("%16s| %15d => %15d\n", "Utilization [%] ",
+         results[0].utilization_percentage, results[1].utilization_percentage);
+  printf("%16s| %15lu => %15lu\n", "Overhead [KiB]",
+         (unsigned long)(results[0].overhead_size / 1024),
+         (unsigned long)(results[1].overhead_size / 1024));
+}
+
+//
+// [Threaded challenges]
+//
+// |num_threads| worker threads each run the same epoch / lifetime workload as
+// run_challenge() (including --workload) against one shared allocator. A
+// fraction of the objects that are due to be freed are handed to the next
+// thread and freed there, so the allocator also sees cross-thread frees. Only
+// thread-safe allocators (e.g. tcache.c) can run these.
+//
+
+#define MAX_THREADS 64
+// The fraction of frees that are handed to another thread.
+#define CROSS_THREAD_FREE_RATIO 0.1
+
+// Objects handed to a thread by the other threads, waiting to be freed.
+typedef struct inbox_t {
+  pthread_mutex_t lock;
+  vector_t *objects;
+} inbox_t;
+
+inbox_t inboxes[MAX_THREADS];
+
+typedef struct worker_t {
+  pthread_t thread;
+  int index;
+  int num_threads;
+  size_t min_size;
+  size_t max_size;
+  const workload_t *workload;
+  malloc_func_t malloc_func;
+  free_func_t free_func;
+  unsigned seed;
+  size_t operations;  // The number of malloc / free calls.
+  size_t cross_thread_frees;
+  size_t allocated_size;
+  size_t freed_size;
+} worker_t;
+
+// Free all objects other threads have handed to |inbox|.
+void drain_inbox(inbox_t *inbox, worker_t *worker) {
+  pthread_mutex_lock(&inbox->lock);
+  vector_t *objects = inbox->objects;
+  inbox->objects = vector_create();
+  pthread_mutex_unlock(&inbox->lock);
+  for (size_t i = 0; i < vector_size(objects); i++) {
+    object_t object = vector_at(objects, i);
+    check_object(object);
+    worker->freed_size += object.size;
+    worker->free_func(object.ptr);
+  }
+  worker->operations += vector_size(objects);
+  worker->cross_thread_frees += vector_size(objects);
+  vector_destroy(objects);
+}
+
+void *run_worker(void *arg) {
+  worker_t *worker = (worker_t *)arg;
+  urand_state = &worker->seed;
+  inbox_t *next_inbox = &inboxes[(worker->index + 1) % worker->num_threads];
+  const workload_t *workload = worker->workload;
+  const int epochs_per_cycle = workload->epochs_per_cycle;
+  char tag = 0;
+  // The last entry of the vector is used to store objects that are never freed.
+  vector_t *objects[epochs_per_cycle + 1];
+  for (int i = 0; i < epochs_per_cycle + 1; i++) {
+    objects[i] = vector_create();
+  }
+  for (int cycle = 0; cycle < workload->cycles; cycle++) {
+    for (int epoch = 0; epoch < epochs_per_cycle; epoch++) {
+      int objects_per_epoch = epoch == 0 ? workload->objects_per_epoch_large
+                                         : workload->objects_per_epoch_small;
+      for (int i = 0; i < objects_per_epoch; i++) {
+        size_t size =
+            workload_object_size(workload, worker->min_size, worker->max_size);
+        int lifetime = workload_object_lifetime(workload);
+        worker->allocated_size += size;
+        void *ptr = worker->malloc_func(size);
+        worker->operations++;
+        memset(ptr, tag, size);
+        object_t object = {ptr, size, tag};
+        tag++;
+        if (tag == 0) {
+          tag++;
+        }
+        if (urand() < workload->never_freed_ratio) {
+          vector_push(objects[epochs_per_cycle], object);
+        } else {
+          vector_push(objects[(epoch + lifetime) % epochs_per_cycle], object);
+        }
+      }
+
+      vector_t *vector = objects[epoch];
+      for (size_t i = 0; i < vector_size(vector); i++) {
+        object_t object = vector_at(vector, i);
+        check_object(object);
+        if (worker->num_threads > 1 && urand() < CROSS_THREAD_FREE_RATIO) {
+          pthread_mutex_lock(&next_inbox->lock);
+          vector_push(next_inbox->objects, object);
+          pthread_mutex_unlock(&next_inbox->lock);
+          continue;
+        }
+        worker->freed_size += object.size;
+        worker->free_func(object.ptr);
+        worker->operations++;
+      }
+      vector_clear(vector);
+      drain_inbox(&inboxes[worker->index], worker);
+    }
+  }
+  for (int i = 0; i < epochs_per_cycle + 1; i++) {
+    vector_destroy(objects[i]);
+  }
+  return NULL;
+}
+
+typedef struct threaded_stats_t {
+  double seconds;
+  size_t operations;
+  size_t cross_thread_frees;
+  int utilization_percentage;
+} threaded_stats_t;
+
+// Run one challenge on |num_threads| threads.
+threaded_stats_t run_threaded_challenge(size_t min_size, size_t max_size,
+                                        int num_threads,
+                                        initialize_func_t initialize_func,
+                                        malloc_func_t malloc_func,
+                                        free_func_t free_func,
+                                        finalize_func_t finalize_func) {
+  assert(0 < num_threads && num_threads <= MAX_THREADS);
+  trace_writer.fp = NULL;
+  worker_t workers[MAX_THREADS];
+  for (int i = 0; i < num_threads; i++) {
+    pthread_mutex_init(&inboxes[i].lock, NULL);
+    inboxes[i].objects = vector_create();
+    worker_t worker = {0};
+    worker.index = i;
+    worker.num_threads = num_threads;
+    worker.min_size = min_size;
+    worker.max_size = max_size;
+    worker.workload = &workload;
+    worker.malloc_func = malloc_func;
+    worker.free_func = free_func;
+    worker.seed = 12 + i;
+    workers[i] = worker;
+  }
+  num_mappings = 0;
+  initialize_func();
+  stats.mmap_size = stats.munmap_size = 0;
+  double begin_time = get_time();
+  for (int i = 0; i < num_threads; i++) {
+    pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+  }
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  double end_time = get_time();
+
+  // Objects handed over after their receiver finished are still in inboxes.
+  worker_t leftover = {0};
+  leftover.free_func = free_func;
+  for (int i = 0; i < num_threads; i++) {
+    drain_inbox(&inboxes[i], &leftover);
+    vector_destroy(inboxes[i].objects);
+    pthread_mutex_destroy(&inboxes[i].lock);
+  }
+
+  threaded_stats_t result = {end_time - begin_time, 0, 0, 0};
+  size_t allocated_size = 0;
+  size_t freed_size = leftover.freed_size;
+  for (int i = 0; i < num_threads; i++) {
+    result.operations += workers[i].operations;
+    result.cross_thread_frees += workers[i].cross_thread_frees;
+    allocated_size += workers[i].allocated_size;
+    freed_size += workers[i].freed_size;
+  }
+  result.utilization_percentage =
+      (int)(100.0 * (allocated_size - freed_size) /
+            (stats.mmap_size - stats.munmap_size));
+  finalize_func();
+  return result;
+}
+
+// Run challenges with 1, 2, 4, ... |max_threads| threads and print how the
+// throughput scales.
+void run_threaded_challenges(int max_threads) {
+  for (int i = FIRST_CHALLENGE_INDEX; i <= LAST_CHALLENGE_INDEX; i++) {
+    printf("====================================================\n");
+    printf("Challenge #%d    | %7s | %8s | %7s | %15s | %11s\n", i, "threads",
+           "Mops/s", "speedup", "xfree/s", "Utilization");
+    double base_throughput = 0;
+    for (int num_threads = 1; num_threads <= max_threads;) {
+      threaded_stats_t result = run_threaded_challenge(
+          challenges[i].min_size, challenges[i].max_size, num_threads,
+          my_allocator->initialize_func, my_allocator->malloc_func,
+          my_allocator->free_func, my_allocator->finalize_func);
+      double throughput = result.operations / result.seconds;
+      if (num_threads == 1) {
+        base_throughput = throughput;
+      }
+      printf("%16s| %7d | %8.2f | %6.2fx | %15.0f | %10d%%\n", "", num_threads,
+             throughput / 1e6, throughput / base_throughput,
+             result.cross_thread_frees / result.seconds,
+             result.utilization_percentage);
+      if (num_threads == max_threads) {
+        break;
+      }
+      num_threads =
+          num_threads * 2 < max_threads ? num_threads * 2 : max_threads;
+    }
+  }
+}
+
+//
+// [Producer / consumer challenge]
+//
+// Threads are paired up: the producer of a pair only allocates and the
+// consumer only frees, so every free is a cross-thread free. Objects are
+// handed over in batches through the consumer's inbox. A producer allocates
+// as many objects as a worker of the threaded challenges, with the sizes of
+// the workload; the consumer frees each batch as soon as it arrives, so the
+// workload's lifetimes don't apply.
+//
+
+#define PRODUCER_BATCH_SIZE 256
+
+int producers_done;
+
+void *run_producer(void *arg) {
+  worker_t *worker = (worker_t *)arg;
+  urand_state = &worker->seed;
+  inbox_t *inbox = &inboxes[worker->index + 1];
+  vector_t *batch = vector_create();
+  const workload_t *workload = worker->workload;
+  int num_objects =
+      workload->cycles * (workload->objects_per_epoch_large +
+                          (workload->epochs_per_cycle - 1) *
+                              workload->objects_per_epoch_small);
+  char tag = 1;
+  for (int i = 0; i < num_objects; i++) {
+    size_t size =
+        workload_object_size(workload, worker->min_size, worker->max_size);
+    worker->allocated_size += size;
+    void *ptr = worker->malloc_func(size);
+    worker->operations++;
+    memset(ptr, tag, size);
+    object_t object = {ptr, size, tag};
+    tag = tag == 127 ? 1 : tag + 1;
+    vector_push(batch, object);
+    if (vector_size(batch) == PRODUCER_BATCH_SIZE || i == num_objects - 1) {
+      pthread_mutex_lock(&inbox->lock);
+      for (size_t j = 0; j < vector_size(batch); j++) {
+        vector_push(inbox->objects, vector_at(batch, j));
+      }
+      pthread_mutex_unlock(&inbox->lock);
+      batch->size = 0;
+    }
+  }
+  vector_destroy(batch);
+  __atomic_fetch_add(&producers_done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+void *run_consumer(void *arg) {
+  worker_t *worker = (worker_t *)arg;
+  inbox_t *inbox = &inboxes[worker->index];
+  while (true) {
+    // Read the flag before draining so a final batch is never missed.
+    bool done = __atomic_load_n(&producers_done, __ATOMIC_ACQUIRE) ==
+                worker->num_threads / 2;
+    size_t freed = worker->cross_thread_frees;
+    drain_inbox(inbox, worker);
+    if (done && worker->cross_thread_frees == freed) {
+      break;
+    }
+    if (worker->cross_thread_frees == freed) {
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+// Run the producer / consumer challenge with |num_threads| / 2 pairs.
+threaded_stats_t run_producer_consumer_challenge(
+    size_t min_size, size_t max_size, int num_threads,
+    initialize_func_t initialize_func, malloc_func_t malloc_func,
+    free_func_t free_func, finalize_func_t finalize_func) {
+  assert(2 <= num_threads && num_threads <= MAX_THREADS &&
+         num_threads % 2 == 0);
+  trace_writer.fp = NULL;
+  producers_done = 0;
+  worker_t workers[MAX_THREADS];
+  for (int i = 0; i < num_threads; i++) {
+    pthread_mutex_init(&inboxes[i].lock, NULL);
+    inboxes[i].objects = vector_create();
+    worker_t worker = {0};
+    worker.index = i;
+    worker.num_threads = num_threads;
+    worker.min_size = min_size;
+    worker.max_size = max_size;
+    worker.workload = &workload;
+    worker.malloc_func = malloc_func;
+    worker.free_func = free_func;
+    worker.seed = 12 + i;
+    workers[i] = worker;
+  }
+  num_mappings = 0;
+  initialize_func();
+  stats.mmap_size = stats.munmap_size = 0;
+  double begin_time = get_time();
+  for (int i = 0; i < num_threads; i++) {
+    pthread_create(&workers[i].thread, NULL,
+                   i % 2 == 0 ? run_producer : run_consumer, &workers[i]);
+  }
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  double end_time = get_time();
+  for (int i = 0; i < num_threads; i++) {
+    vector_destroy(inboxes[i].objects);
+    pthread_mutex_destroy(&inboxes[i].lock);
+  }
+
+  threaded_stats_t result = {end_time - begin_time, 0, 0, 0};
+  for (int i = 0; i < num_threads; i++) {
+    result.operations += workers[i].operations;
+    result.cross_thread_frees += workers[i].cross_thread_frees;
+  }
+  finalize_func();
+  return result;
+}
+
+// Run the producer / consumer challenge with 1, 2, ... |max_threads| / 2
+// pairs and print how the throughput of remote frees scales.
+void run_producer_consumer_challenges(int max_threads) {
+  printf("====================================================\n");
+  printf("Producer/consumer | %7s | %8s | %7s | %15s\n", "threads", "Mops/s",
+         "speedup", "xfree/s");
+  if (max_threads < 2) {
+    // A pair needs two threads.
+    printf("%18s| skipped: needs --threads=2 or more\n", "");
+    return;
+  }
+  double base_throughput = 0;
+  for (int num_threads = 2; num_threads <= max_threads; num_threads *= 2) {
+    threaded_stats_t result = run_producer_consumer_challenge(
+        challenges[LAST_CHALLENGE_INDEX].min_size,
+        challenges[LAST_CHALLENGE_INDEX].max_size, num_threads,
+        my_allocator->initialize_func, my_allocator->malloc_func,
+        my_allocator->free_func, my_allocator->finalize_func);
+    double throughput = result.operations / result.seconds;
+    if (num_threads == 2) {
+      base_throughput = throughput;
+    }
+    printf("%18s| %7d | %8.2f | %6.2fx | %15.0f\n", "", num_threads,
+           throughput / 1e6, throughput / base_throughput,
+           result.cross_thread_frees / result.seconds);
+  }
+}
+
 // Allocate a memory region from the system. |size| needs to be a multiple of
 // 4096 bytes.
 void *mmap_from_system(size_t size) {
   assert(size % 4096 == 0);
-  stats.mmap_size += size;
+  // Atomic because threaded challenges call this from several threads.
+  __atomic_fetch_add(&stats.mmap_size, size, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats.syscalls, 1, __ATOMIC_RELAXED);
   void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
   assert(ptr);
-  if (trace_fp) {
-    fprintf(trace_fp, "m %llu %ld\n", (unsigned long long)ptr, size);
-  }
+  pthread_mutex_lock(&mappings_lock);
+  add_mapping((uintptr_t)ptr, (uintptr_t)ptr + size);
+  pthread_mutex_unlock(&mappings_lock);
+  trace_write(&trace_writer, TRACE_MMAP, 0, size);
   return ptr;
 }
 
@@ -395,22 +1590,141 @@ void *mmap_from_system(size_t size) {
 void munmap_to_system(void *ptr, size_t size) {
   assert(size % 4096 == 0);
   assert((uintptr_t)(ptr) % 4096 == 0);
-  stats.munmap_size += size;
+  __atomic_fetch_add(&stats.munmap_size, size, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats.syscalls, 1, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&mappings_lock);
+  remove_mapping((uintptr_t)ptr, (uintptr_t)ptr + size);
+  pthread_mutex_unlock(&mappings_lock);
   int ret = munmap(ptr, size);
-  if (trace_fp) {
-    fprintf(trace_fp, "u %llu %ld\n", (unsigned long long)ptr, size);
-  }
+  trace_write(&trace_writer, TRACE_MUNMAP, 0, size);
+  assert(ret != -1);
+}
+
+// Give the physical pages of [ptr, ptr + size) back to the system but keep
+// them mapped. The next touch gets zero pages (or, with |lazy|, the old
+// contents if the kernel hasn't needed the memory yet). The range still
+// counts as mapped for utilization; see "Resident pages" for what it saves.
+// |ptr| and |size| need to be a multiple of 4096 bytes.
+void madvise_to_system(void *ptr, size_t size, bool lazy) {
+  assert(size % 4096 == 0);
+  assert((uintptr_t)(ptr) % 4096 == 0);
+  __atomic_fetch_add(&stats.syscalls, 1, __ATOMIC_RELAXED);
+  int ret = madvise(ptr, size, lazy ? MADV_FREE : MADV_DONTNEED);
   assert(ret != -1);
 }
 
 int main(int argc, char **argv) {
+  // --threads=N runs the threaded challenges with up to N threads instead.
+  // --compare[=A,B,...] runs the challenges with several allocators.
+  // --allocator=NAME picks the registered allocator that runs as my_malloc.
+  // --latency times every malloc / free call and prints percentiles.
+  // --check-every=K checks the heap every K epochs (ENABLE_HEAP_CHECK builds).
+  // --perf counts cycles, instructions and cache / TLB / branch misses per
+  // malloc / free call (see perf_counters.h).
+  // --telemetry=FILE writes per-epoch heap statistics to FILE as CSV.
+  // --growth runs the realloc-heavy growth challenge instead.
+  // --alignment runs the aligned allocation challenge instead.
+  // --option=NAME=VALUE sets an allocator tuning knob (can be repeated).
+  // --no-hints calls plain malloc even if the allocator takes lifetime hints.
+  // --workload=SPEC changes the sizes, lifetimes and counts of the challenges
+  // (see workload.h).
+  int max_threads = 0;
+  bool compare = false;
+  bool growth = false;
+  bool alignment = false;
+  const char *compare_names = NULL;
+  const char *telemetry_file_name = NULL;
+  bool usage_error = false;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--threads=", 10) == 0) {
+      max_threads = atoi(argv[i] + 10);
+      usage_error |= max_threads <= 0 || max_threads > MAX_THREADS;
+    } else if (strcmp(argv[i], "--compare") == 0) {
+      compare = true;
+    } else if (strncmp(argv[i], "--compare=", 10) == 0) {
+      compare = true;
+      compare_names = argv[i] + 10;
+    } else if (strcmp(argv[i], "--alignment") == 0) {
+      alignment = true;
+    } else if (strcmp(argv[i], "--growth") == 0) {
+      growth = true;
+    } else if (strcmp(argv[i], "--latency") == 0) {
+      latency_enabled = true;
+    } else if (strcmp(argv[i], "--perf") == 0) {
+      perf_enabled = true;
+    } else if (strncmp(argv[i], "--check-every=", 14) == 0) {
+      heap_check_interval = atoi(argv[i] + 14);
+      usage_error |= heap_check_interval <= 0;
+    } else if (strncmp(argv[i], "--telemetry=", 12) == 0) {
+      telemetry_file_name = argv[i] + 12;
+      usage_error |= !*telemetry_file_name;
+    } else if (strncmp(argv[i], "--allocator=", 12) == 0) {
+      my_allocator = find_allocator(argv[i] + 12);
+      usage_error |= !my_allocator;
+    } else if (strncmp(argv[i], "--workload=", 11) == 0) {
+      if (!workload_parse(&workload, argv[i] + 11)) {
+        return EXIT_FAILURE;
+      }
+    } else if (strcmp(argv[i], "--no-hints") == 0) {
+      hints_enabled = false;
+    } else if (strncmp(argv[i], "--option=", 9) == 0) {
+      if (!set_allocator_option(argv[i] + 9)) {
+        fprintf(stderr, "No allocator accepts the option: %s\n", argv[i] + 9);
+        return EXIT_FAILURE;
+      }
+    } else {
+      usage_error = true;
+    }
+  }
+  if (usage_error) {
+    fprintf(stderr,
+            "Usage: %s [--threads=N (1 <= N <= %d)] [--compare[=A,B,...]] "
+            "[--allocator=NAME] [--alignment] [--growth] [--latency] [--perf]\n"
+            "[--telemetry=FILE] [--option=NAME=VALUE] [--no-hints]\n"
+            "[--workload=SPEC] [--check-every=K]\n"
+            "Allocators:",
+            argv[0], MAX_THREADS);
+    for (size_t i = 0; i < NUM_ALLOCATORS; i++) {
+      fprintf(stderr, " %s", allocators[i].name);
+    }
+    fprintf(stderr, "\n");
+    return EXIT_FAILURE;
+  }
+  if (telemetry_file_name &&
+      !telemetry_open(&telemetry_writer, telemetry_file_name)) {
+    fprintf(stderr, "Failed to open a telemetry file: %s\n",
+            telemetry_file_name);
+    return EXIT_FAILURE;
+  }
+  if (perf_enabled && !perf_counters_open(&perf_counters)) {
+    fprintf(stderr, "No perf counters available (perf_event_paranoid?)\n");
+  }
   srand(12);  // Set the rand seed to make the challenges non-deterministic.
   printf("Welcome to the malloc challenge!\n");
   printf("size_of(uint8_t *) = %ld\n", sizeof(uint8_t *));
   printf("size_of(size_t) = %ld\n", sizeof(size_t));
+  if (workload.is_custom) {
+    char description[256];
+    workload_describe(&workload, description, sizeof(description));
+    printf("Workload: %s\n", description);
+  }
   printf("Running tests...\n");
-  test();
+  if (my_allocator->test_func) {
+    my_allocator->test_func();
+  }
   printf("Finished!\n\n");
-  run_challenges();
+  if (compare) {
+    run_comparison(compare_names);
+  } else if (alignment) {
+    run_alignment_challenges();
+  } else if (growth) {
+    run_growth_challenges();
+  } else if (max_threads) {
+    run_threaded_challenges(max_threads);
+    run_producer_consumer_challenges(max_threads);
+  } else {
+    run_challenges();
+  }
+  telemetry_close(&telemetry_writer);
   return 0;
 }
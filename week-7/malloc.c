@@ -14,6 +14,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "alloc_stats.h"
+
 //
 // Interfaces to get memory pages from OS
 //
@@ -40,6 +42,10 @@ typedef struct my_heap_t {
 //
 my_heap_t my_heap;
 
+#ifdef ENABLE_ALLOC_STATS
+alloc_stats_t my_alloc_stats;
+#endif
+
 //
 // Helper functions (feel free to add/remove/edit!)
 //
@@ -68,6 +74,7 @@ void my_initialize() {
   my_heap.free_head = &my_heap.dummy;
   my_heap.dummy.size = 0;
   my_heap.dummy.next = NULL;
+  ALLOC_STATS_RESET(my_alloc_stats);
 }
 
 // my_malloc() is called every time an object is allocated.
@@ -79,7 +86,11 @@ void *my_malloc(size_t size) {
   my_metadata_t *prev = NULL;
   // First-fit: Find the first free slot the object fits.
   // TODO: Update this logic to Best-fit!
-  while (metadata && metadata->size < size) {
+  while (metadata) {
+    ALLOC_STATS_INC(my_alloc_stats, list_walk_steps);
+    if (metadata->size >= size) {
+      break;
+    }
     prev = metadata;
     metadata = metadata->next;
   }
@@ -95,8 +106,11 @@ void *my_malloc(size_t size) {
     //     metadata
     //     <---------------------->
     //            buffer_size
+    ALLOC_STATS_INC(my_alloc_stats, bin_misses);
     size_t buffer_size = 4096;
     my_metadata_t *metadata = (my_metadata_t *)mmap_from_system(buffer_size);
+    ALLOC_STATS_INC(my_alloc_stats, refills);
+    ALLOC_STATS_ADD(my_alloc_stats, refill_size, buffer_size);
     metadata->size = buffer_size - sizeof(my_metadata_t);
     metadata->next = NULL;
     // Add the memory region to the free list.
@@ -110,12 +124,14 @@ void *my_malloc(size_t size) {
   // ... | metadata | object | ...
   //     ^          ^
   //     metadata   ptr
+  ALLOC_STATS_INC(my_alloc_stats, mallocs);
   void *ptr = metadata + 1;
   size_t remaining_size = metadata->size - size;
   // Remove the free slot from the free list.
   my_remove_from_free_list(metadata, prev);
 
   if (remaining_size > sizeof(my_metadata_t)) {
+    ALLOC_STATS_INC(my_alloc_stats, splits);
     // Shrink the metadata for the allocated object
     // to separate the rest of the region corresponding to remaining_size.
     // If the remaining_size is not large enough to make a new metadata,
@@ -147,14 +163,14 @@ void my_free(void *ptr) {
   //     ^          ^
   //     metadata   ptr
   my_metadata_t *metadata = (my_metadata_t *)ptr - 1;
+  ALLOC_STATS_INC(my_alloc_stats, frees);
   // Add the free slot to the free list.
   my_add_to_free_list(metadata);
 }
 
 // This is called at the end of each challenge.
 void my_finalize() {
-  // Nothing is here for now.
-  // feel free to add something if you want!
+  ALLOC_STATS_PRINT("malloc", my_alloc_stats);
 }
 
 void test() {
@@ -12,45 +12,288 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+
+#include "alloc_stats.h"
+#include "arena.h"
+#include "lifetime.h"
+#include "telemetry.h"
 
 // --- System Memory Interface ---
 // These are just declarations. You'd need to implement these, probably using
 // sbrk() on older Unix systems or mmap() on modern ones. mmap is generally better.
 void *mmap_from_system(size_t size);
 void munmap_to_system(void *ptr, size_t size);
+void madvise_to_system(void *ptr, size_t size, bool lazy);
 
 // --- Metadata Structure ---
 // This struct is placed right before every block of memory we manage.
 // It holds all the info we need to know about a chunk of memory.
+//
+// Only the first word is a real header: the size and all the flags are packed into
+// it as bit-fields, so an in-use block costs HEADER_SIZE (8) bytes. The list links
+// only mean something while the block is free, and then they live in the first 16
+// bytes of the payload, which nobody else is using.
+//
+//   in use: | size|flags | payload .................................. |
+//   free:   | size|flags | next | prev | ...                  | footer |
+//   free, minimum size:  | size|flags | next | prev |   (no room for a footer)
 typedef struct my_metadata_t {
-  size_t size;                // How big is the USER'S data block (doesn't include this struct's size).
+  size_t size : 55;           // How big is the USER'S data block (doesn't include the header).
+  size_t is_free : 1;         // A flag to see if the block is currently free.
+  size_t prev_free : 1;       // Is the block physically to our LEFT free? (boundary tag)
+  size_t prev_min : 1;        // ...and if so, is it a MIN_PAYLOAD_SIZE block without a footer?
+  size_t first_in_region : 1; // Does this block start right at a page-aligned region start?
+  size_t is_fence : 1;        // Is this the size-0 header that terminates a region?
+  size_t is_zeroed : 1;       // Is the payload still fresh zero pages (except the links and footer)?
+  size_t lifetime : 2;        // Which heap (lifetime class) the block's region belongs to.
+  size_t is_huge : 1;         // Does the block have a mapping of its own (see my_huge_t)?
+  // Free blocks only, overlapping the payload:
   struct my_metadata_t *next; // Points to the next FREE block in this bin.
   struct my_metadata_t *prev; // Points to the previous FREE block. Doubly linked makes removal O(1).
-  bool is_free;               // A flag to see if the block is currently free.
 } my_metadata_t;
-// - The 'is_free' flag is somewhat redundant. If a block is in a free list,
-//   it's obviously free. If it's not, it's allocated. You could remove this to save a few bytes
-//   but it might make debugging or certain operations (like the current find_right_neighbor) easier.
-// - For coalescing, a common trick is to add a 'size' field at the END of the block too (a "footer").
-//   This lets you find the metadata of the block to your left in O(1) time, which your
-//   current implementation desperately needs.
+
+#define HEADER_SIZE offsetof(my_metadata_t, next)
+// A free block must hold its two links, so no payload is smaller.
+#define MIN_PAYLOAD_SIZE (2 * sizeof(my_metadata_t *))
+// - With 16-byte objects (challenge 2) a block used to be 32 bytes of header for 16 bytes
+//   of payload. Now it's 8 + 16.
+//
+// Boundary tags: every FREE block bigger than MIN_PAYLOAD_SIZE also stores its size in
+// the last 8 bytes of its payload (the "footer"), after the links. When we free a block
+// and its 'prev_free' bit is set, the size_t right before its header is the left
+// neighbor's footer, and we can jump straight to the left neighbor's header. A
+// minimum-size free block has no room for a footer, but it doesn't need one: its right
+// neighbor's 'prev_min' bit says the left neighbor is MIN_PAYLOAD_SIZE bytes. Allocated
+// blocks don't need a footer, since nobody ever looks at it (their right neighbor has
+// prev_free == false).
+//
+// Each region we get from mmap looks like this:
+//
+//   | metadata | payload ...                       | fence |
+//   ^                                              ^
+//   region start                                   region end - HEADER_SIZE
+//
+// The fence is a size-0 header that is never free. It stops find_right_neighbor() from
+// walking off the end of the region, and its prev_free bit tracks the last real block.
+// The first block of a region always has prev_free == false, so find_left_neighbor()
+// never walks off the start either.
+//
+// Returning memory: when a free block covers whole pages, we cut those pages out and
+// munmap them. The piece to the left gets a new fence, and the piece to the right starts
+// a new "region" (first_in_region == true). If the whole region is free we unmap all of it.
+//
+//   before: | metadata | free ...................................... | metadata | ...
+//   after:  | metadata | free | fence | (unmapped pages) | metadata | free | metadata | ...
+//
+// Getting memory: pages come from an arena (see arena.h) that maps big chunks and hands
+// them out in order. When the new pages sit right after the fence of the last region we
+// grew, and both are in the same arena chunk, we turn that fence into an ordinary block
+// and merge it with whatever is free before it. So a refill usually makes the tail free
+// block bigger instead of creating a new 4096-byte island.
+//
+// Growing in place: my_realloc() first tries to absorb the free block to the right
+// (the one find_right_neighbor() finds) and only moves the object if that isn't enough.
+// my_calloc() skips the memset for blocks whose is_zeroed bit says they were carved from
+// pages nobody wrote to yet. The arena never hands out a page twice, so fresh pages from
+// a refill are always zero; the bit is dropped as soon as a block is freed or merged.
+//
+// Lifetime heaps: my_malloc_hint() takes a lifetime class (see lifetime.h), and each
+// class has its own heap: its own bins, arena and regions. A block never moves between
+// heaps, and its neighbors are always from the same heap, so the few objects that
+// survive an epoch can't pin the pages that the short-lived churn frees up. Plain
+// my_malloc() uses the LIFETIME_SHORT heap, so without hints there is just one heap.
+//
+// Huge objects: anything bigger than huge_threshold bypasses the heaps. It gets a
+// mapping of its own, rounded up to whole pages, with a my_huge_t in front of the
+// header. free() unmaps it right away, so a huge object never leaves an odd-sized
+// remnant in the bins, and the bins never have to carve huge blocks out of regions.
+//
+//   | my_huge_t | header (is_huge) | payload ............. | (rest of the last page) |
+//   ^
+//   page aligned
 
 // --- Heap and Bin Configuration ---
 // These constants define our binning strategy for segregated free lists.
 #define NUM_SMALL_BINS 16       // For small, fast allocations.
-#define NUM_LARGE_BINS 4        // For larger, less frequent allocations.
+#define NUM_LARGE_BINS 8        // For larger, less frequent allocations.
+#define NUM_BINS (NUM_SMALL_BINS + NUM_LARGE_BINS)
 #define SMALL_BIN_MAX_SIZE 256  // Anything this size or smaller goes in a small bin.
-#define LARGE_THRESHOLD 1024    // Just a marker, not really used consistently.
 
-// This is the main struct for our heap. It just holds the heads of all our free lists.
+// Every payload starts on an ALIGNMENT boundary. Regions are page aligned and the
+// header is a multiple of ALIGNMENT, so rounding every block size up to ALIGNMENT
+// keeps every header and payload after it aligned too. Bigger alignments go through
+// my_aligned_alloc().
+#define ALIGNMENT 8
+
+// Hysteresis for returning pages to the OS. We only munmap a run of at least
+// munmap_min_pages pages, and only while more than munmap_retain_size bytes would
+// still be free afterwards. The retained free memory absorbs the next peak, so we
+// don't mmap and munmap the same pages around every epoch. Set them at runtime with
+// --option=munmap_min_pages=PAGES and --option=munmap_retain=BYTES.
+#define MUNMAP_MIN_PAGES 1
+#define MUNMAP_RETAIN_SIZE (32 * 1024)
+
+// How free pages go back to the system (--option=release=MODE):
+//   munmap        Cut them out of their region and unmap them (the default).
+//   madvise       Keep them mapped, in their free block, but drop the physical pages
+//                 with MADV_DONTNEED. The next peak refaults them instead of paying
+//                 for mmap and for rebuilding the regions.
+//   madvise_lazy  The same with MADV_FREE: the kernel only takes the pages when it
+//                 needs memory, so they usually stay resident.
+// The same hysteresis applies to all three.
+typedef enum release_mode_t {
+  RELEASE_MUNMAP,
+  RELEASE_MADVISE,
+  RELEASE_MADVISE_LAZY,
+} release_mode_t;
+
+// Requests bigger than this many bytes are huge objects. Set it at runtime with
+// --option=huge_threshold=BYTES.
+#define HUGE_THRESHOLD (16 * 1024)
+
+// The hot part of a heap: what malloc and free read or write on every call, packed
+// into one cache line. malloc finds the first bin with a block from the bitmap
+// instead of loading the heads of empty bins one by one, and never walks a large bin
+// that can't have a block big enough.
+typedef struct my_bin_summary_t {
+  uint32_t nonempty;         // Bit i: bin i has a free block. Small bins first, then large.
+  uint16_t counts[NUM_BINS]; // Free blocks per bin, saturating at UINT16_MAX (back to
+                             // exact once the bin empties). Only for the stats.
+  size_t free_size; // Total payload bytes sitting in the bins. Drives the munmap hysteresis.
+} __attribute__((aligned(64))) my_bin_summary_t;
+
+_Static_assert(sizeof(my_bin_summary_t) == 64, "the bin summary is one cache line");
+
+// This is the main struct for our heap: the summary, then the heads of all our free
+// lists, then the cold fields that only refills and releases touch.
 typedef struct my_heap_t {
+  my_bin_summary_t summary;
   my_metadata_t *small_bins[NUM_SMALL_BINS]; // Bins for sizes 16, 32, ..., 256.
-  my_metadata_t *large_bins[NUM_LARGE_BINS]; // Bins for 257-512, 512-1024, etc.
-  my_metadata_t dummy; // Not really used, seems like a leftover idea.
+  my_metadata_t *large_bins[NUM_LARGE_BINS]; // Bins for 257-384, 385-512, 513-768, etc.
+  arena_t arena;    // Where new pages come from.
+  char *region_end; // End of the region we grew last (right after its fence), or NULL.
 } my_heap_t;
 
-// The one and only global heap instance.
-my_heap_t my_heap;
+// Arena chunks grow with the heap (see arena.h), from one page up to
+// ARENA_MAX_CHUNK_SIZE. Kept small compared to a general-purpose malloc because the
+// challenge counts every mapped byte, including the unused tail of a chunk, against
+// utilization. Every lifetime heap has its own arena, so a heap that stays small
+// also keeps small chunks.
+#define ARENA_MIN_CHUNK_SIZE 4096
+#define ARENA_MAX_CHUNK_SIZE (128 * 1024)
+
+// One heap per lifetime class.
+my_heap_t my_heaps[NUM_LIFETIME_CLASSES];
+
+// What a huge object has in front of its header.
+typedef struct my_huge_t {
+  void *mapping;              // Where its mapping starts (page aligned).
+  size_t mapping_size;        // A multiple of 4096.
+  struct my_huge_t *next;     // The huge objects, in address order.
+  struct my_huge_t *prev;
+} my_huge_t;
+
+size_t huge_threshold = HUGE_THRESHOLD;
+size_t munmap_min_pages = MUNMAP_MIN_PAGES;
+size_t munmap_retain_size = MUNMAP_RETAIN_SIZE;
+release_mode_t release_mode = RELEASE_MUNMAP;
+my_huge_t *my_huge_objects; // The lowest address first.
+
+#ifdef ENABLE_ALLOC_STATS
+alloc_stats_t my_alloc_stats;
+#endif
+
+// --- Region Registry (debug builds) ---
+// my_check_heap() walks every region block by block, so builds with ENABLE_HEAP_CHECK
+// (make run_check) remember where the regions are. Everywhere else the REGION_*
+// macros expand to nothing, the same way the ALLOC_STATS_* ones do.
+#ifdef ENABLE_HEAP_CHECK
+typedef struct my_region_t {
+  char *begin;
+  char *end;   // Right after the fence.
+} my_region_t;
+
+// The table lives in pages straight from mmap(), not mmap_from_system(), so check
+// builds report the same utilization as normal builds. It's kept across
+// challenges; my_initialize() only empties it.
+my_region_t *my_regions;
+size_t my_num_regions;
+size_t my_regions_capacity;
+
+void add_region(char *begin, char *end) {
+  if (my_num_regions == my_regions_capacity) {
+    size_t old_size = my_regions_capacity * sizeof(my_region_t);
+    size_t new_size = old_size ? 2 * old_size : 4096;
+    my_region_t *regions = (my_region_t *)mmap(
+        NULL, new_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(regions != MAP_FAILED);
+    if (old_size) {
+      memcpy(regions, my_regions, old_size);
+      munmap(my_regions, old_size);
+    }
+    my_regions = regions;
+    my_regions_capacity = new_size / sizeof(my_region_t);
+  }
+  my_regions[my_num_regions].begin = begin;
+  my_regions[my_num_regions].end = end;
+  my_num_regions++;
+}
+
+// A refill continued the region that ended at |old_end|.
+void extend_region(char *old_end, char *new_end) {
+  for (size_t i = 0; i < my_num_regions; i++) {
+    if (my_regions[i].end == old_end) {
+      my_regions[i].end = new_end;
+      return;
+    }
+  }
+  assert(false);
+}
+
+// release_free_pages() unmapped [begin, end) from the middle, start or end of a region.
+void cut_regions(char *begin, char *end) {
+  for (size_t i = my_num_regions; i-- > 0;) {
+    my_region_t region = my_regions[i];
+    if (region.end <= begin || end <= region.begin) {
+      continue;
+    }
+    if (region.begin < begin && end < region.end) {
+      my_regions[i].end = begin;
+      add_region(end, region.end);
+      return;
+    } else if (region.begin < begin) {
+      my_regions[i].end = begin;
+    } else if (end < region.end) {
+      my_regions[i].begin = end;
+    } else {
+      my_regions[i] = my_regions[--my_num_regions];
+    }
+  }
+}
+
+// The region holding |ptr|, or NULL.
+my_region_t *find_region(void *ptr) {
+  for (size_t i = 0; i < my_num_regions; i++) {
+    if (my_regions[i].begin <= (char *)ptr && (char *)ptr < my_regions[i].end) {
+      return &my_regions[i];
+    }
+  }
+  return NULL;
+}
+
+#define REGION_ADD(begin, end) add_region((begin), (end))
+#define REGION_EXTEND(old_end, new_end) extend_region((old_end), (new_end))
+#define REGION_CUT(begin, end) cut_regions((begin), (end))
+#define REGION_RESET() (my_num_regions = 0)
+
+void check_block_in_use(void *ptr);  // Under "Heap Checking" below.
+#else
+#define REGION_ADD(begin, end) ((void)0)
+#define REGION_EXTEND(old_end, new_end) ((void)0)
+#define REGION_CUT(begin, end) ((void)0)
+#define REGION_RESET() ((void)0)
+#endif
 
 
 // --- Binning Logic ---
@@ -62,40 +305,112 @@ int get_small_bin_index(size_t size) {
 }
 
 // Purpose: Figures out which large bin a given size belongs to.
-// Hardcoded ranges. Not very flexible.
+// Two bins per power of two: 257-384, 385-512, 513-768, 769-1024, ..., and the last
+// bin takes everything else. A large bin is a sorted list, so the shorter the lists,
+// the fewer block headers malloc and free walk through.
 int get_large_bin_index(size_t size) {
-  if (size <= 512) return 0;
-  if (size <= 1024) return 1;
-  if (size <= 2048) return 2;
-  return 3; // The "everything else" bin.
+  int index = 0;
+  size_t limit = SMALL_BIN_MAX_SIZE + SMALL_BIN_MAX_SIZE / 2;
+  while (size > limit && index < NUM_LARGE_BINS - 1) {
+    limit = index % 2 ? limit / 2 * 3 : limit / 3 * 4; // 384, 512, 768, 1024, ...
+    index++;
+  }
+  return index;
+}
+
+// Purpose: Bookkeeping in the summary when a block joins or leaves bin |bin|
+// (0 to NUM_BINS - 1, large bins after the small ones).
+void count_bin_add(my_heap_t *heap, int bin) {
+  heap->summary.nonempty |= 1u << bin;
+  if (heap->summary.counts[bin] != UINT16_MAX) {
+    heap->summary.counts[bin]++;
+  }
+}
+
+void count_bin_remove(my_heap_t *heap, int bin, bool now_empty) {
+  if (now_empty) {
+    heap->summary.nonempty &= ~(1u << bin);
+    heap->summary.counts[bin] = 0;
+  } else if (heap->summary.counts[bin] != UINT16_MAX) {
+    heap->summary.counts[bin]--;
+  }
+}
+
+// Purpose: The first nonempty bin at or after |bin|, or -1.
+int find_nonempty_bin(my_heap_t *heap, int bin) {
+  uint32_t candidates = heap->summary.nonempty & ~((1u << bin) - 1);
+  return candidates ? __builtin_ctz(candidates) : -1;
+}
+
+// --- Boundary Tags ---
+// Purpose: Convert between a block's header and the pointer the user gets.
+void *get_payload(my_metadata_t *metadata) {
+  return (char *)metadata + HEADER_SIZE;
+}
+
+my_metadata_t *get_metadata(void *ptr) {
+  return (my_metadata_t *)((char *)ptr - HEADER_SIZE);
+}
+
+// Purpose: The heap whose bins a block belongs in.
+my_heap_t *get_heap(my_metadata_t *metadata) {
+  return &my_heaps[metadata->lifetime];
+}
+
+// Purpose: The header of the block physically to the right of this one.
+my_metadata_t *get_next_block(my_metadata_t *metadata) {
+  return (my_metadata_t *)((char *)get_payload(metadata) + metadata->size);
+}
+
+// Purpose: Copies the block's size into its footer (the last size_t of the payload).
+// A minimum-size block has no footer: that size_t is its prev link.
+void set_footer(my_metadata_t *metadata) {
+  if (metadata->size == MIN_PAYLOAD_SIZE) {
+    return;
+  }
+  size_t *footer = (size_t *)get_next_block(metadata) - 1;
+  *footer = metadata->size;
+}
+
+// Purpose: Writes the size-0 fence header that terminates a region.
+void set_fence(void *region_end) {
+  // Only the header word: there's no payload, so never touch the links.
+  my_metadata_t *fence = get_metadata(region_end);
+  fence->size = 0;
+  fence->is_free = false;
+  fence->prev_free = false;
+  fence->prev_min = false;
+  fence->first_in_region = false;
+  fence->is_fence = true;
+  fence->is_zeroed = false;
+  fence->is_huge = false;
 }
-// - The hardcoded values are brittle. If you change NUM_BINS, you have to rewrite this logic.
-//   A more programmatic or logarithmic approach could be more scalable.
-// - The mapping could be more granular to reduce internal fragmentation.
 
 // --- Free List Management ---
 // Purpose: Adds a free block to the front of the appropriate small bin list (LIFO).
 // This is for First-Fit allocation. Quick and dirty.
 void add_to_small_bin(my_metadata_t *metadata) {
+  my_heap_t *heap = get_heap(metadata);
   int bin_index = get_small_bin_index(metadata->size);
   if (bin_index >= NUM_SMALL_BINS) return; // Should not happen if logic is correct.
 
-  metadata->next = my_heap.small_bins[bin_index];
+  metadata->next = heap->small_bins[bin_index];
   metadata->prev = NULL;
-  if (my_heap.small_bins[bin_index]) {
-    my_heap.small_bins[bin_index]->prev = metadata;
+  if (heap->small_bins[bin_index]) {
+    heap->small_bins[bin_index]->prev = metadata;
   }
-  my_heap.small_bins[bin_index] = metadata;
-  metadata->is_free = true;
+  heap->small_bins[bin_index] = metadata;
+  count_bin_add(heap, bin_index);
 }
 
 // Purpose: Adds a free block to the correct large bin, but keeps the list SORTED by size.
 // This is the key to making the Best-Fit search for large blocks faster.
 void add_to_large_bin(my_metadata_t *metadata) {
+  my_heap_t *heap = get_heap(metadata);
   int bin_index = get_large_bin_index(metadata->size);
 
   // Walk the list to find the correct insertion point.
-  my_metadata_t *current = my_heap.large_bins[bin_index];
+  my_metadata_t *current = heap->large_bins[bin_index];
   my_metadata_t *prev = NULL;
   while (current && current->size < metadata->size) {
     prev = current;
@@ -108,41 +423,48 @@ void add_to_large_bin(my_metadata_t *metadata) {
   if (prev) {
     prev->next = metadata;
   } else {
-    my_heap.large_bins[bin_index] = metadata; // It's the new head.
+    heap->large_bins[bin_index] = metadata; // It's the new head.
   }
   if (current) {
     current->prev = metadata;
   }
-  metadata->is_free = true;
+  count_bin_add(heap, NUM_SMALL_BINS + bin_index);
 }
 
 // Purpose: A simple dispatcher. Decides whether to call the small or large bin function.
+// Also the one place that marks a block free, so the footer and the right neighbor's
+// prev_free and prev_min bits can never get out of sync with the bins.
 void my_add_to_free_list(my_metadata_t *metadata) {
   if (metadata->size <= SMALL_BIN_MAX_SIZE) {
     add_to_small_bin(metadata);
   } else {
     add_to_large_bin(metadata);
   }
+  metadata->is_free = true;
+  get_heap(metadata)->summary.free_size += metadata->size;
+  set_footer(metadata);
+  my_metadata_t *right = get_next_block(metadata);
+  right->prev_free = true;
+  right->prev_min = metadata->size == MIN_PAYLOAD_SIZE;
 }
 
 // Purpose: Removes a block from whatever free list it's in.
 // This is why we use a doubly-linked list. Unlinking is O(1).
 void my_remove_from_free_list(my_metadata_t *metadata) {
+  my_heap_t *heap = get_heap(metadata);
+  int bin = metadata->size <= SMALL_BIN_MAX_SIZE
+                ? get_small_bin_index(metadata->size)
+                : NUM_SMALL_BINS + get_large_bin_index(metadata->size);
   if (metadata->prev) {
     // It's not the head of the list.
     metadata->prev->next = metadata->next;
-  } else {
+  } else if (bin < NUM_SMALL_BINS) {
     // It IS the head of the list. We need to update the heap's bin pointer.
-    if (metadata->size <= SMALL_BIN_MAX_SIZE) {
-      int bin_index = get_small_bin_index(metadata->size);
-      if (bin_index < NUM_SMALL_BINS) { // Safety check
-        my_heap.small_bins[bin_index] = metadata->next;
-      }
-    } else {
-      int bin_index = get_large_bin_index(metadata->size);
-      my_heap.large_bins[bin_index] = metadata->next;
-    }
+    heap->small_bins[bin] = metadata->next;
+  } else {
+    heap->large_bins[bin - NUM_SMALL_BINS] = metadata->next;
   }
+  count_bin_remove(heap, bin, !metadata->prev && !metadata->next);
 
   if (metadata->next) {
     metadata->next->prev = metadata->prev;
@@ -151,213 +473,850 @@ void my_remove_from_free_list(my_metadata_t *metadata) {
   metadata->next = NULL;
   metadata->prev = NULL;
   metadata->is_free = false;
+  heap->summary.free_size -= metadata->size;
+  get_next_block(metadata)->prev_free = false;
+  get_next_block(metadata)->prev_min = false;
 }
 
 // --- Coalescing (Merging Free Blocks) ---
-// Purpose: Find the block physically to the LEFT of the given pointer in memory.
-// !!! CRITICAL PERFORMANCE BOTTLENECK !!!
-my_metadata_t *find_left_neighbor(void *ptr) {
-  // This is HORRIBLY inefficient. It iterates through EVERY SINGLE free block in the
-  // entire heap just to find the one that happens to end right where `ptr` begins.
-  // This turns your free() operation from a potential O(1) into an O(N) disaster,
-  // where N is the number of free blocks.
-  for (int i = 0; i < NUM_SMALL_BINS; i++) {
-    my_metadata_t *current = my_heap.small_bins[i];
-    while (current) {
-      if (current->is_free) { // Redundant check, they should all be free.
-        char *block_end = (char *)(current + 1) + current->size;
-        if (block_end == (char *)ptr) {
-          return current;
-        }
-      }
-      current = current->next;
-    }
-  }
-  for (int i = 0; i < NUM_LARGE_BINS; i++) {
-    my_metadata_t *current = my_heap.large_bins[i];
-    while (current) {
-      if (current->is_free) {
-        char *block_end = (char *)(current + 1) + current->size;
-        if (block_end == (char *)ptr) {
-          return current;
-        }
-      }
-      current = current->next;
-    }
+// Purpose: Find the block physically to the LEFT of the given block in memory.
+// O(1): the prev_free bit tells us whether there is a free block there at all, and
+// its footer (the size_t right before our header), or else the prev_min bit, tells us
+// where it starts.
+my_metadata_t *find_left_neighbor(my_metadata_t *metadata) {
+  if (!metadata->prev_free) {
+    return NULL;
   }
-  return NULL;
+  size_t left_size = metadata->prev_min ? MIN_PAYLOAD_SIZE : *((size_t *)metadata - 1);
+  return get_metadata((char *)metadata - left_size);
 }
-// - FIX THIS. The standard solution is to store the size of the block in a "footer"
-//   at the very end of the allocated chunk. When freeing `ptr`, you can look at the bytes
-//   immediately before `ptr`'s metadata to find the size of the preceding block.
-//   Then you can calculate its starting address in O(1) time. No searching needed.
 
 // Purpose: Find the block physically to the RIGHT of the given block in memory.
-// This implementation is much better because memory is contiguous.
+// The fence at the end of every region means there is always a valid header here,
+// so reading 'is_free' never touches memory outside the mmap'd region.
 my_metadata_t *find_right_neighbor(my_metadata_t *metadata) {
-  // Calculate the address immediately after our current block ends.
-  char *block_end = (char *)(metadata + 1) + metadata->size;
-  my_metadata_t *potential_neighbor = (my_metadata_t *)block_end;
-
-  // Now, how do we know this is a valid block and not just random memory?
-  // Here, we're checking its 'is_free' flag. risky tho. If that memory
-  // belongs to another allocated block, its 'is_free' would be false.
-  // could lead to a segfault.
+  my_metadata_t *potential_neighbor = get_next_block(metadata);
   if (potential_neighbor->is_free) {
     return potential_neighbor;
   }
   return NULL;
 }
-// - To make this safer, the heap needs to know its boundaries (the start and end
-//   addresses of the memory it got from `mmap`). You should check if `potential_neighbor`
-//   is within those boundaries before trying to dereference it.
+
+// Purpose: Merges a block that just became free with its free neighbors and puts
+// the result on a free list. Returns the merged block.
+my_metadata_t *coalesce(my_metadata_t *metadata) {
+  // Both lookups are O(1) thanks to the boundary tags, so this no longer
+  // slows down as the heap grows.
+  my_metadata_t *left_neighbor = find_left_neighbor(metadata);
+  my_metadata_t *right_neighbor = find_right_neighbor(metadata);
+
+  my_metadata_t *merged = metadata;
+  if (left_neighbor && right_neighbor) {
+    // Case 1: Merge with both left and right.
+    my_remove_from_free_list(left_neighbor);
+    my_remove_from_free_list(right_neighbor);
+    left_neighbor->size += HEADER_SIZE + metadata->size +
+                           HEADER_SIZE + right_neighbor->size;
+    merged = left_neighbor;
+    ALLOC_STATS_INC(my_alloc_stats, coalesce_left);
+    ALLOC_STATS_INC(my_alloc_stats, coalesce_right);
+
+  } else if (left_neighbor) {
+    // Case 2: Merge with left only.
+    my_remove_from_free_list(left_neighbor);
+    left_neighbor->size += HEADER_SIZE + metadata->size;
+    merged = left_neighbor;
+    ALLOC_STATS_INC(my_alloc_stats, coalesce_left);
+
+  } else if (right_neighbor) {
+    // Case 3: Merge with right only.
+    my_remove_from_free_list(right_neighbor);
+    metadata->size += HEADER_SIZE + right_neighbor->size;
+    ALLOC_STATS_INC(my_alloc_stats, coalesce_right);
+  }
+  // Case 4 (no free neighbors) just falls through: the block goes back on its own.
+  if (left_neighbor || right_neighbor) {
+    merged->is_zeroed = false; // The old headers are in the payload now.
+  }
+  my_add_to_free_list(merged);
+  return merged;
+}
+
+// --- Returning Memory to the System ---
+// Purpose: Cut the whole pages out of a (fully coalesced) free block and munmap them.
+void release_free_pages(my_metadata_t *metadata) {
+  my_heap_t *heap = get_heap(metadata);
+  char *start = (char *)metadata;
+  my_metadata_t *right = get_next_block(metadata);
+  const size_t min_left = 2 * HEADER_SIZE + MIN_PAYLOAD_SIZE;
+  const size_t min_right = HEADER_SIZE + MIN_PAYLOAD_SIZE;
+
+  // The left piece needs room for its header, a minimal payload and a new fence,
+  // unless the block is the first one in its region and can go away entirely.
+  uintptr_t begin = (uintptr_t)start;
+  if (!metadata->first_in_region) {
+    begin = ((uintptr_t)start + min_left + 4095) / 4096 * 4096;
+  }
+  // The right piece needs room for a header and a minimal payload, unless the
+  // block runs up to the fence, in which case the fence's page goes too.
+  uintptr_t end = ((uintptr_t)right - min_right) / 4096 * 4096;
+  if (right->is_fence) {
+    end = (uintptr_t)get_payload(right);
+  }
+  if (end <= begin || (end - begin) / 4096 < munmap_min_pages) {
+    return;
+  }
+  if (heap->summary.free_size < (end - begin) + munmap_retain_size) {
+    return;
+  }
+
+  my_remove_from_free_list(metadata);
+  if (begin != (uintptr_t)start) {
+    metadata->size = begin - (uintptr_t)start - 2 * HEADER_SIZE;
+    set_fence((void *)begin);
+    my_add_to_free_list(metadata);
+  }
+  if (!right->is_fence) {
+    my_metadata_t *new_metadata = (my_metadata_t *)end;
+    new_metadata->size = (uintptr_t)right - end - HEADER_SIZE;
+    new_metadata->prev_free = false;
+    new_metadata->prev_min = false;
+    new_metadata->first_in_region = true;
+    new_metadata->is_fence = false;
+    new_metadata->is_zeroed = metadata->is_zeroed;
+    new_metadata->lifetime = metadata->lifetime;
+    new_metadata->is_huge = false;
+    my_add_to_free_list(new_metadata);
+  }
+  ALLOC_STATS_INC(my_alloc_stats, releases);
+  ALLOC_STATS_ADD(my_alloc_stats, release_size, end - begin);
+  if (right->is_fence && (char *)end == heap->region_end) {
+    // The fence we would extend on the next refill is going away.
+    heap->region_end = NULL;
+  }
+  REGION_CUT((char *)begin, (char *)end);
+  munmap_to_system((void *)begin, end - begin);
+}
+
+// Purpose: The madvise version of release_free_pages(). The free of the block that
+// was at [freed_begin, freed_end) made |metadata| (fully coalesced); give back the
+// physical pages that free exposed and leave the block where it is.
+// The free neighbors' pages went back when they were freed, except the pages with
+// their header, links or footer, which are now in the middle of the block. The
+// pages with |metadata|'s own header, links and footer stay, since we use them.
+void advise_free_pages(my_metadata_t *metadata, uintptr_t freed_begin,
+                       uintptr_t freed_end) {
+  my_heap_t *heap = get_heap(metadata);
+  const size_t links = 2 * sizeof(my_metadata_t *);
+  uintptr_t begin = ((uintptr_t)get_payload(metadata) + links + 4095) / 4096 * 4096;
+  uintptr_t end = ((uintptr_t)get_next_block(metadata) - sizeof(size_t)) / 4096 * 4096;
+  uintptr_t exposed_begin = (freed_begin - sizeof(size_t)) / 4096 * 4096;
+  uintptr_t exposed_end = (freed_end + HEADER_SIZE + links + 4095) / 4096 * 4096;
+  if (begin < exposed_begin) {
+    begin = exposed_begin;
+  }
+  if (end > exposed_end) {
+    end = exposed_end;
+  }
+  if (end <= begin || (end - begin) / 4096 < munmap_min_pages) {
+    return;
+  }
+  if (heap->summary.free_size < (end - begin) + munmap_retain_size) {
+    return;
+  }
+  metadata->is_zeroed = false; // Only MADV_DONTNEED zeroes, and not the whole payload.
+  ALLOC_STATS_INC(my_alloc_stats, releases);
+  ALLOC_STATS_ADD(my_alloc_stats, release_size, end - begin);
+  madvise_to_system((void *)begin, end - begin, release_mode == RELEASE_MADVISE_LAZY);
+}
+
+// --- Huge Objects ---
+// Purpose: The my_huge_t in front of a huge object's header.
+my_huge_t *get_huge(my_metadata_t *metadata) {
+  assert(metadata->is_huge);
+  return (my_huge_t *)metadata - 1;
+}
+
+// Purpose: Insert a huge object into the address-ordered list.
+// mmap tends to hand out addresses top-down, so the walk is usually short.
+void add_huge_object(my_huge_t *huge) {
+  my_huge_t *current = my_huge_objects;
+  my_huge_t *prev = NULL;
+  while (current && current < huge) {
+    prev = current;
+    current = current->next;
+  }
+  huge->next = current;
+  huge->prev = prev;
+  if (prev) {
+    prev->next = huge;
+  } else {
+    my_huge_objects = huge;
+  }
+  if (current) {
+    current->prev = huge;
+  }
+}
+
+void remove_huge_object(my_huge_t *huge) {
+  if (huge->prev) {
+    huge->prev->next = huge->next;
+  } else {
+    my_huge_objects = huge->next;
+  }
+  if (huge->next) {
+    huge->next->prev = huge->prev;
+  }
+}
+
+// Purpose: Map a huge object of |size| bytes whose payload is a multiple of
+// |alignment| (a power of two). mmap only promises page alignment, so for bigger
+// alignments we map |alignment| bytes extra and unmap the whole pages on either side.
+void *huge_alloc(size_t size, size_t alignment) {
+  size_t overhead = sizeof(my_huge_t) + HEADER_SIZE;
+  size_t extra = alignment > ALIGNMENT ? alignment : 0;
+  size_t mapping_size = (overhead + extra + size + 4095) / 4096 * 4096;
+  char *mapping = (char *)mmap_from_system(mapping_size);
+  ALLOC_STATS_INC(my_alloc_stats, refills);
+  ALLOC_STATS_ADD(my_alloc_stats, refill_size, mapping_size);
+
+  uintptr_t payload = ((uintptr_t)mapping + overhead + alignment - 1) &
+                      ~(uintptr_t)(alignment - 1);
+  char *begin = (char *)((payload - overhead) / 4096 * 4096);
+  char *end = (char *)((payload + size + 4095) / 4096 * 4096);
+  if (begin != mapping) {
+    munmap_to_system(mapping, begin - mapping);
+  }
+  if (end != mapping + mapping_size) {
+    munmap_to_system(end, mapping + mapping_size - end);
+  }
+
+  my_metadata_t *metadata = get_metadata((void *)payload);
+  metadata->size = (uintptr_t)end - payload;
+  metadata->is_free = false;
+  metadata->prev_free = false;
+  metadata->prev_min = false;
+  metadata->first_in_region = true;
+  metadata->is_fence = false;
+  metadata->is_zeroed = true; // Fresh pages, and nothing of ours lives in the payload.
+  metadata->lifetime = LIFETIME_SHORT;
+  metadata->is_huge = true;
+  my_huge_t *huge = get_huge(metadata);
+  huge->mapping = begin;
+  huge->mapping_size = end - begin;
+  add_huge_object(huge);
+  ALLOC_STATS_INC(my_alloc_stats, mallocs);
+  return (void *)payload;
+}
+
+// Purpose: Unmap a huge object.
+void huge_free(my_metadata_t *metadata) {
+  my_huge_t *huge = get_huge(metadata);
+  remove_huge_object(huge);
+  ALLOC_STATS_INC(my_alloc_stats, releases);
+  ALLOC_STATS_ADD(my_alloc_stats, release_size, huge->mapping_size);
+  munmap_to_system(huge->mapping, huge->mapping_size);
+}
+
+// Purpose: Shrink a huge object in place by unmapping the pages it no longer needs.
+void huge_shrink(my_metadata_t *metadata, size_t size) {
+  my_huge_t *huge = get_huge(metadata);
+  char *payload = (char *)get_payload(metadata);
+  char *end = (char *)(((uintptr_t)payload + size + 4095) / 4096 * 4096);
+  char *mapping_end = (char *)huge->mapping + huge->mapping_size;
+  if (end == mapping_end) {
+    return;
+  }
+  metadata->size = end - payload;
+  huge->mapping_size = end - (char *)huge->mapping;
+  ALLOC_STATS_INC(my_alloc_stats, releases);
+  ALLOC_STATS_ADD(my_alloc_stats, release_size, mapping_end - end);
+  munmap_to_system(end, mapping_end - end);
+}
 
 // --- Core Allocator Functions ---
-// Purpose: Initialize the heap. Sets all bin heads to NULL.
+// Purpose: Initialize the heaps. Sets all bin heads to NULL.
 void my_initialize() {
-  for (int i = 0; i < NUM_SMALL_BINS; i++) {
-    my_heap.small_bins[i] = NULL;
+  for (int lifetime = 0; lifetime < NUM_LIFETIME_CLASSES; lifetime++) {
+    my_heap_t *heap = &my_heaps[lifetime];
+    for (int i = 0; i < NUM_SMALL_BINS; i++) {
+      heap->small_bins[i] = NULL;
+    }
+    for (int i = 0; i < NUM_LARGE_BINS; i++) {
+      heap->large_bins[i] = NULL;
+    }
+    memset(&heap->summary, 0, sizeof(heap->summary));
+    arena_initialize(&heap->arena, ARENA_MIN_CHUNK_SIZE, ARENA_MAX_CHUNK_SIZE);
+    heap->region_end = NULL;
   }
-  for (int i = 0; i < NUM_LARGE_BINS; i++) {
-    my_heap.large_bins[i] = NULL;
+  my_huge_objects = NULL;
+  REGION_RESET();
+  ALLOC_STATS_RESET(my_alloc_stats);
+}
+
+// Purpose: Parse a whole decimal number. Returns false if |value| is anything else.
+bool parse_size(const char *value, size_t *result) {
+  char *end;
+  unsigned long long number = strtoull(value, &end, 10);
+  if (end == value || *end != '\0') {
+    return false;
+  }
+  *result = number;
+  return true;
+}
+
+// Purpose: Runtime knobs (--option=NAME=VALUE): huge_threshold, release,
+// munmap_min_pages and munmap_retain.
+bool my_set_option(const char *name, const char *value) {
+  if (strcmp(name, "huge_threshold") == 0) {
+    return parse_size(value, &huge_threshold);
+  } else if (strcmp(name, "munmap_min_pages") == 0) {
+    size_t pages;
+    if (!parse_size(value, &pages) || pages == 0) {
+      return false;
+    }
+    munmap_min_pages = pages;
+  } else if (strcmp(name, "munmap_retain") == 0) {
+    return parse_size(value, &munmap_retain_size);
+  } else if (strcmp(name, "release") == 0) {
+    if (strcmp(value, "munmap") == 0) {
+      release_mode = RELEASE_MUNMAP;
+    } else if (strcmp(value, "madvise") == 0) {
+      release_mode = RELEASE_MADVISE;
+    } else if (strcmp(value, "madvise_lazy") == 0) {
+      release_mode = RELEASE_MADVISE_LAZY;
+    } else {
+      return false;
+    }
+  } else {
+    return false;
   }
-  my_heap.dummy.size = 0; // The dummy isn't used. Can be removed.
-  my_heap.dummy.next = NULL;
-  my_heap.dummy.prev = NULL;
-  my_heap.dummy.is_free = true;
+  return true;
+}
+
+// --- Block Splitting ---
+// Purpose: Shrink an in-use block to |size| bytes and give the rest back to the free
+// lists, if the rest is big enough to be a block of its own (a header plus a minimal
+// payload). This is key to reducing internal fragmentation.
+void split_block(my_metadata_t *metadata, size_t size) {
+  size_t remaining_size = metadata->size - size;
+  if (remaining_size < HEADER_SIZE + MIN_PAYLOAD_SIZE) {
+    return;
+  }
+  metadata->size = size; // Shrink the original block.
+
+  // Create a new metadata for the leftover piece.
+  my_metadata_t *new_metadata = get_next_block(metadata);
+  new_metadata->size = remaining_size - HEADER_SIZE;
+  new_metadata->is_free = false; // Will be set to true by add_to_free_list
+  new_metadata->prev_free = false; // Its left neighbor is the block we just handed out.
+  new_metadata->prev_min = false;
+  new_metadata->first_in_region = false;
+  new_metadata->is_fence = false;
+  new_metadata->is_zeroed = metadata->is_zeroed; // It's a piece of the same payload.
+  new_metadata->lifetime = metadata->lifetime;
+  new_metadata->is_huge = false;
+
+  // Put the leftover piece back on the free lists. When my_realloc() shrinks a block
+  // the block to its right may be free, so merge with it.
+  coalesce(new_metadata);
+  ALLOC_STATS_INC(my_alloc_stats, splits);
+}
+
+// Purpose: Round a request up to a block size. Never below MIN_PAYLOAD_SIZE, so the
+// block can hold its links and footer once it's freed.
+size_t get_block_size(size_t size) {
+  if (size < MIN_PAYLOAD_SIZE) return MIN_PAYLOAD_SIZE;
+  return (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
 }
 
 // Purpose: The main allocation function. The heart of the allocator.
-void *my_malloc(size_t size) {
+// Serves the request from the heap of |lifetime_class| only, unless it's huge.
+void *my_malloc_hint(size_t size, lifetime_class_t lifetime_class) {
+  assert(lifetime_class < NUM_LIFETIME_CLASSES);
+  if (size > huge_threshold) {
+    void *ptr = huge_alloc(size, ALIGNMENT);
+    get_metadata(ptr)->lifetime = lifetime_class; // So my_realloc() keeps the hint.
+    return ptr;
+  }
+  my_heap_t *heap = &my_heaps[lifetime_class];
   my_metadata_t *metadata = NULL;
+  size = get_block_size(size);
 
   if (size <= SMALL_BIN_MAX_SIZE) {
     // Small allocation: Use First-Fit. It's fast.
-    // We search for a block in the "perfect" bin first, then check larger small bins.
+    // A bin holds a 16-byte range of sizes, so the "perfect" bin may contain blocks
+    // that are slightly too small. Walk it, then take the head of any larger small bin.
     int bin_index = get_small_bin_index(size);
-    for (int i = bin_index; i < NUM_SMALL_BINS; i++) {
-      if (my_heap.small_bins[i]) {
-        metadata = my_heap.small_bins[i]; // Found one!
+    my_metadata_t *current = heap->small_bins[bin_index];
+    while (current) {
+      ALLOC_STATS_INC(my_alloc_stats, list_walk_steps);
+      if (current->size >= size) {
         break;
       }
+      current = current->next;
     }
-  } else {
-    // Large allocation: Use Best-Fit. Slower, but reduces fragmentation.
-    // Our sorted large-bin lists help speed this up.
-    my_metadata_t *best_fit = NULL;
-    size_t best_size = SIZE_MAX;
+    metadata = current;
+    if (metadata) {
+      ALLOC_STATS_INC(my_alloc_stats, fast_path_hits);
+    } else {
+      ALLOC_STATS_INC(my_alloc_stats, bin_misses);
+      // Any block in a larger small bin fits. The bitmap says which one has one.
+      int bin = find_nonempty_bin(heap, bin_index + 1);
+      if (bin != -1 && bin < NUM_SMALL_BINS) {
+        metadata = heap->small_bins[bin]; // Found one!
+        ALLOC_STATS_INC(my_alloc_stats, list_walk_steps);
+      }
+    }
+  }
 
-    for (int i = 0; i < NUM_LARGE_BINS; i++) {
-      my_metadata_t *current = my_heap.large_bins[i];
+  if (!metadata) {
+    // Large allocation (or a small one with empty small bins): Use Best-Fit.
+    // Slower, but reduces fragmentation. Our sorted large-bin lists help speed this up.
+    // Blocks in the bins below the request's own bin are all too small, and every
+    // block in a bin above it is bigger than every block in its own bin. So the best
+    // fit is the first block that fits in the request's bin, or else the head (the
+    // smallest block) of the next nonempty bin.
+    int first_bin = size <= SMALL_BIN_MAX_SIZE ? 0 : get_large_bin_index(size);
+    int bin = find_nonempty_bin(heap, NUM_SMALL_BINS + first_bin);
+    if (bin == NUM_SMALL_BINS + first_bin) {
       // Since the list is sorted, we only need to find the first block that fits.
+      my_metadata_t *current = heap->large_bins[first_bin];
       while (current) {
-        if (current->size >= size) { // The first one that fits is the best fit in its bin.
-            if (current->size < best_size) {
-                best_fit = current;
-                best_size = current->size;
-            }
-            break; // Since list is sorted, no need to check further in this bin.
+        ALLOC_STATS_INC(my_alloc_stats, list_walk_steps);
+        if (current->size >= size) {
+          break;
         }
         current = current->next;
       }
+      metadata = current;
+      if (!metadata) {
+        ALLOC_STATS_INC(my_alloc_stats, bin_misses);
+        bin = find_nonempty_bin(heap, bin + 1);
+      }
+    }
+    if (!metadata && bin != -1) {
+      metadata = heap->large_bins[bin - NUM_SMALL_BINS];
+      ALLOC_STATS_INC(my_alloc_stats, list_walk_steps);
     }
-    metadata = best_fit;
   }
 
   if (!metadata) {
-    // No suitable free block was found. We must ask the OS for more memory.
-    // The buffer gives us extra room to avoid calling mmap too often.
-    size_t buffer_size = (size > 2048) ? size + sizeof(my_metadata_t) + 1024 : 4096;
-    my_metadata_t *new_metadata = (my_metadata_t *)mmap_from_system(buffer_size);
-    new_metadata->size = buffer_size - sizeof(my_metadata_t);
-    new_metadata->next = NULL;
-    new_metadata->prev = NULL;
-    new_metadata->is_free = false; // It's about to be used, but we free it first.
-
-    // Add this new giant block to our free lists.
-    my_add_to_free_list(new_metadata);
+    // No suitable free block was found. We must ask the arena for more pages.
+    // It has to be a multiple of 4096 and leave room for the block header and the fence.
+    size_t buffer_size = (size + 2 * HEADER_SIZE + 4095) / 4096 * 4096;
+    char *region = (char *)arena_alloc(&heap->arena, buffer_size);
+    ALLOC_STATS_INC(my_alloc_stats, refills);
+    ALLOC_STATS_ADD(my_alloc_stats, refill_size, buffer_size);
+    set_fence(region + buffer_size);
+    if (region == heap->region_end &&
+        arena_same_chunk(&heap->arena, region - 1, region + buffer_size)) {
+      // The new pages continue the last region. Its old fence becomes the header
+      // of a block spanning the new pages, merged with a free block before it.
+      my_metadata_t *old_fence = get_metadata(region);
+      old_fence->size = buffer_size - HEADER_SIZE;
+      old_fence->is_free = false;
+      old_fence->is_fence = false;
+      old_fence->is_zeroed = true; // Stays true only if there is nothing to merge with.
+      old_fence->lifetime = lifetime_class;
+      REGION_EXTEND(region, region + buffer_size);
+      coalesce(old_fence);
+    } else {
+      my_metadata_t *new_metadata = (my_metadata_t *)region;
+      new_metadata->size = buffer_size - 2 * HEADER_SIZE;
+      new_metadata->is_free = false; // It's about to be used, but we free it first.
+      new_metadata->prev_free = false; // Nothing to the left of a region.
+      new_metadata->prev_min = false;
+      new_metadata->first_in_region = true;
+      new_metadata->is_fence = false;
+      new_metadata->is_zeroed = true; // Fresh pages from the arena.
+      new_metadata->lifetime = lifetime_class;
+      new_metadata->is_huge = false;
+      REGION_ADD(region, region + buffer_size);
+
+      // Add this new giant block to our free lists.
+      my_add_to_free_list(new_metadata);
+    }
+    heap->region_end = region + buffer_size;
 
     // This recursion is a bit weird. It's generally safer to use a loop or a goto
     // to restart the allocation attempt. A deep recursion could blow the stack,
     // though it's very unlikely here.
-    return my_malloc(size);
+    return my_malloc_hint(size, lifetime_class);
   }
 
   // We found a block! Now let's prepare it for the user.
-  void *ptr = metadata + 1; // The user pointer is AFTER the metadata.
-  size_t remaining_size = metadata->size - size;
+  ALLOC_STATS_INC(my_alloc_stats, mallocs);
   my_remove_from_free_list(metadata); // It's no longer free.
-
-  // Block Splitting: If the block is much bigger than requested, split it.
-  // This is key to reducing internal fragmentation.
-  if (remaining_size > sizeof(my_metadata_t)) {
-    metadata->size = size; // Shrink the original block.
-
-    // Create a new metadata for the leftover piece.
-    my_metadata_t *new_metadata = (my_metadata_t *)((char *)ptr + size);
-    new_metadata->size = remaining_size - sizeof(my_metadata_t);
-    new_metadata->next = NULL;
-    new_metadata->prev = NULL;
-    new_metadata->is_free = false; // Will be set to true by add_to_free_list
-    
-    // Add the new, smaller leftover block back to the free lists.
-    my_add_to_free_list(new_metadata);
-  }
-  return ptr;
+  split_block(metadata, size);
+  return get_payload(metadata); // The user pointer is AFTER the metadata.
 }
 
+// Purpose: malloc without a hint. Everything shares the short-lived heap.
+void *my_malloc(size_t size) {
+  return my_malloc_hint(size, LIFETIME_SHORT);
+}
 
 // Purpose: Frees a previously allocated block of memory.
 void my_free(void *ptr) {
   // Get our metadata header from the user's pointer.
-  my_metadata_t *metadata = (my_metadata_t *)ptr - 1;
+#ifdef ENABLE_HEAP_CHECK
+  check_block_in_use(ptr);
+#endif
+  my_metadata_t *metadata = get_metadata(ptr);
+  ALLOC_STATS_INC(my_alloc_stats, frees);
+  if (metadata->is_huge) {
+    huge_free(metadata);
+    return;
+  }
+  metadata->is_zeroed = false; // The user has written to it.
+  uintptr_t freed_begin = (uintptr_t)metadata;
+  uintptr_t freed_end = (uintptr_t)get_next_block(metadata);
+  my_metadata_t *merged = coalesce(metadata);
 
-  // Coalescing logic: Try to merge with adjacent free blocks.
-  // This is where the HORRIBLE find_left_neighbor is called.
-  my_metadata_t *left_neighbor = find_left_neighbor(metadata);
-  my_metadata_t *right_neighbor = find_right_neighbor(metadata);
+  // A block smaller than a page can never cover a whole page, so skip the math.
+  if (merged->size + 2 * HEADER_SIZE >= 4096) {
+    if (release_mode == RELEASE_MUNMAP) {
+      release_free_pages(merged);
+    } else {
+      advise_free_pages(merged, freed_begin, freed_end);
+    }
+  }
+}
 
-  if (left_neighbor && right_neighbor) {
-    // Case 1: Merge with both left and right.
-    my_remove_from_free_list(left_neighbor);
+// Purpose: Resize an object, in place if the block to its right is free and big enough.
+// Returns NULL (and leaves |ptr| alone) only if a new block can't be had.
+void *my_realloc(void *ptr, size_t size) {
+  if (!ptr) {
+    return my_malloc(size);
+  }
+#ifdef ENABLE_HEAP_CHECK
+  check_block_in_use(ptr);
+#endif
+  my_metadata_t *metadata = get_metadata(ptr);
+  metadata->is_zeroed = false; // The user has written to it.
+  size = get_block_size(size);
+  if (metadata->is_huge && size <= metadata->size && size > huge_threshold) {
+    // Still huge and it fits: give back the pages past the new end.
+    huge_shrink(metadata, size);
+    return ptr;
+  }
+  if (metadata->is_huge || size > huge_threshold) {
+    // Crossing the threshold (or outgrowing the mapping) always moves.
+    void *new_ptr = my_malloc_hint(size, metadata->lifetime);
+    if (!new_ptr) {
+      return NULL;
+    }
+    memcpy(new_ptr, ptr, metadata->size < size ? metadata->size : size);
+    my_free(ptr);
+    return new_ptr;
+  }
+  if (size <= metadata->size) {
+    // Shrinking: hand the tail back.
+    split_block(metadata, size);
+    return ptr;
+  }
+  my_metadata_t *right_neighbor = find_right_neighbor(metadata);
+  if (right_neighbor &&
+      metadata->size + HEADER_SIZE + right_neighbor->size >= size) {
+    // Growing in place: absorb the right neighbor and give back what we don't need.
     my_remove_from_free_list(right_neighbor);
-    left_neighbor->size += sizeof(my_metadata_t) + metadata->size +
-                           sizeof(my_metadata_t) + right_neighbor->size;
-    my_add_to_free_list(left_neighbor);
+    metadata->size += HEADER_SIZE + right_neighbor->size;
+    ALLOC_STATS_INC(my_alloc_stats, coalesce_right);
+    split_block(metadata, size);
+    return ptr;
+  }
+  // No room to grow: move it (within the same heap).
+  void *new_ptr = my_malloc_hint(size, metadata->lifetime);
+  if (!new_ptr) {
+    return NULL;
+  }
+  memcpy(new_ptr, ptr, metadata->size);
+  my_free(ptr);
+  return new_ptr;
+}
 
-  } else if (left_neighbor) {
-    // Case 2: Merge with left only.
-    my_remove_from_free_list(left_neighbor);
-    left_neighbor->size += sizeof(my_metadata_t) + metadata->size;
-    my_add_to_free_list(left_neighbor);
+// Purpose: Allocate |size| bytes whose address is a multiple of |alignment| (a power
+// of two), e.g. 64 for cache-line objects or 4096 for I/O buffers.
+// We over-allocate by |alignment| plus room for one more block, then cut the block at
+// the aligned address. The leading slack gets its own header and goes back on the free
+// lists (merged with a free left neighbor if there is one), and split_block() returns
+// the tail, so the only bytes lost for good are one header.
+//
+//   before: | metadata | payload ........................................ |
+//   after:  | metadata | free slack | metadata | aligned payload | free tail |
+//                                              ^
+//                                              multiple of |alignment|
+void *my_aligned_alloc(size_t alignment, size_t size) {
+  assert(alignment && (alignment & (alignment - 1)) == 0);
+  if (alignment <= ALIGNMENT) {
+    return my_malloc(size);
+  }
+  size = get_block_size(size);
+  const size_t min_slack = HEADER_SIZE + MIN_PAYLOAD_SIZE;
+  if (size + alignment + min_slack > huge_threshold) {
+    // The over-allocation would be huge, so align within a mapping instead.
+    return huge_alloc(size, alignment);
+  }
+  char *ptr = my_malloc(size + alignment + min_slack);
+  my_metadata_t *metadata = get_metadata(ptr);
 
-  } else if (right_neighbor) {
-    // Case 3: Merge with right only.
-    my_remove_from_free_list(right_neighbor);
-    metadata->size += sizeof(my_metadata_t) + right_neighbor->size;
-    my_add_to_free_list(metadata);
+  uintptr_t aligned = ((uintptr_t)ptr + alignment - 1) & ~(uintptr_t)(alignment - 1);
+  while (aligned != (uintptr_t)ptr && aligned - (uintptr_t)ptr < min_slack) {
+    // Too little slack for a block of its own, so go to the next boundary.
+    aligned += alignment;
+  }
+  if (aligned != (uintptr_t)ptr) {
+    size_t slack = aligned - (uintptr_t)ptr;
+    my_metadata_t *new_metadata = get_metadata((void *)aligned);
+    new_metadata->size = metadata->size - slack;
+    new_metadata->is_free = false;
+    new_metadata->prev_free = false; // Set by coalesce() below.
+    new_metadata->prev_min = false;
+    new_metadata->first_in_region = false;
+    new_metadata->is_fence = false;
+    new_metadata->is_zeroed = metadata->is_zeroed;
+    new_metadata->lifetime = metadata->lifetime;
+    new_metadata->is_huge = false;
+    metadata->size = slack - HEADER_SIZE;
+    coalesce(metadata);
+    ALLOC_STATS_INC(my_alloc_stats, splits);
+    metadata = new_metadata;
+  }
+  split_block(metadata, size);
+  return get_payload(metadata);
+}
 
+// Purpose: Allocate zeroed memory for |count| objects of |size| bytes.
+// Blocks carved from fresh pages are already zero except where the links and a footer
+// were, so only those parts need clearing.
+void *my_calloc(size_t count, size_t size) {
+  if (size && count > SIZE_MAX / size) {
+    return NULL;
+  }
+  size_t total = count * size;
+  char *ptr = my_malloc(total);
+  my_metadata_t *metadata = get_metadata(ptr);
+  if (!metadata->is_zeroed) {
+    memset(ptr, 0, total);
   } else {
-    // Case 4: No free neighbors. Just add this block back to the free list.
-    my_add_to_free_list(metadata);
+    size_t links = 2 * sizeof(my_metadata_t *);
+    memset(ptr, 0, total < links ? total : links);
+    size_t footer = metadata->size - sizeof(size_t);
+    if (footer < total) {
+      memset(ptr + footer, 0, total - footer);
+    }
   }
+  return ptr;
 }
-// - The biggest issue is performance due to find_left_neighbor. Fixing that
-//   with footers would make this function vastly more efficient.
-// - This implementation never returns memory to the system (munmap is never called).
-//   A complete implementation should track large, empty chunks at the end of the heap
-//   and return them to the OS to reduce the program's memory footprint.
 
 // Purpose: Cleanup function.
-// It's empty, but you could add stats reporting here (e.g., total memory used,
-// fragmentation statistics, number of mmap calls, etc.).
 void my_finalize() {
-  // Could add statistics reporting here
+  ALLOC_STATS_PRINT("mix", my_alloc_stats);
+}
+
+// Purpose: Report every block in the bins for the per-epoch telemetry (see telemetry.h).
+// Walks all the free lists, so it's only called when telemetry is on. Also checks
+// that the bin summaries agree with the lists.
+void my_heap_stats(heap_stats_t *heap_stats) {
+  heap_stats_reset(heap_stats);
+  size_t free_size = 0;
+  for (int lifetime = 0; lifetime < NUM_LIFETIME_CLASSES; lifetime++) {
+    my_heap_t *heap = &my_heaps[lifetime];
+    for (int i = 0; i < NUM_BINS; i++) {
+      my_metadata_t *head = i < NUM_SMALL_BINS ? heap->small_bins[i]
+                                               : heap->large_bins[i - NUM_SMALL_BINS];
+      size_t count = 0;
+      for (my_metadata_t *m = head; m; m = m->next) {
+        heap_stats_add_free_block(heap_stats, m->size);
+        count++;
+      }
+      assert(((heap->summary.nonempty >> i) & 1) == (count != 0));
+      assert(heap->summary.counts[i] == count || heap->summary.counts[i] == UINT16_MAX);
+    }
+    free_size += heap->summary.free_size;
+  }
+  assert(heap_stats->free_size == free_size);
+}
+
+// --- Heap Checking (debug builds) ---
+#ifdef ENABLE_HEAP_CHECK
+// Purpose: Report a broken heap and stop right there, before the damage spreads.
+#define HEAP_CHECK(condition, message, block)                                    \
+  do {                                                                           \
+    if (!(condition)) {                                                          \
+      heap_check_failed((message), (block));                                     \
+    }                                                                            \
+  } while (0)
+
+void heap_check_failed(const char *message, void *block) {
+  fprintf(stderr, "mix: heap check failed at %p: %s\n", block, message);
+  abort();
 }
 
+// Purpose: The debug-mode wrapper around my_free() and my_realloc(): make sure |ptr|
+// is a block we handed out and still own, before trusting anything in its header.
+// Catches double frees and pointers we never returned.
+void check_block_in_use(void *ptr) {
+  HEAP_CHECK((uintptr_t)ptr % ALIGNMENT == 0, "misaligned pointer", ptr);
+  my_metadata_t *metadata = get_metadata(ptr);
+  if (metadata->is_huge) {
+    my_huge_t *huge = my_huge_objects;
+    while (huge && huge != get_huge(metadata)) {
+      huge = huge->next;
+    }
+    HEAP_CHECK(huge, "not one of our huge objects", ptr);
+    return;
+  }
+  my_region_t *region = find_region(metadata);
+  HEAP_CHECK(region, "not in any of our regions", ptr);
+  HEAP_CHECK(!metadata->is_fence, "a fence, not a block", ptr);
+  HEAP_CHECK(!metadata->is_free, "already free (double free?)", ptr);
+  HEAP_CHECK((char *)get_next_block(metadata) <= region->end - HEADER_SIZE,
+             "block runs past its region", ptr);
+}
+
+// Purpose: Walk every region block by block and every bin, and abort with a message
+// at the first thing that doesn't add up:
+//   - sizes: aligned, at least MIN_PAYLOAD_SIZE, never past the region's fence
+//   - neighbors: prev_free matches the block to the left, and after coalescing no
+//     two free blocks are next to each other; footers (or prev_min) match their headers
+//   - regions: only the first block is first_in_region, one lifetime per region
+//   - bins: every block in a bin is free, in the right bin, correctly linked, large
+//     bins sorted, and the bins hold exactly the free blocks the walk found
+//   - totals: free_size and the bin summary match, and the blocks in use hold at
+//     least the |live_size| bytes the caller hasn't freed yet
+// Called by the harness every few epochs (--check-every=K). Returns true.
+bool my_check_heap(size_t live_size) {
+  size_t used_size = 0;
+  size_t free_blocks[NUM_LIFETIME_CLASSES] = {0};
+  size_t free_size[NUM_LIFETIME_CLASSES] = {0};
+
+  for (size_t i = 0; i < my_num_regions; i++) {
+    my_region_t *region = &my_regions[i];
+    my_metadata_t *first = (my_metadata_t *)region->begin;
+    my_metadata_t *fence = get_metadata(region->end);
+    HEAP_CHECK(first->first_in_region && !first->prev_free,
+               "region doesn't start with a first block", first);
+    bool prev_free = false;
+    bool prev_min = false;
+    my_metadata_t *m = first;
+    while (m != fence) {
+      HEAP_CHECK(!m->is_fence, "fence in the middle of a region", m);
+      HEAP_CHECK(!m->is_huge, "huge block in a region", m);
+      HEAP_CHECK(m->size % ALIGNMENT == 0 && m->size >= MIN_PAYLOAD_SIZE,
+                 "bad block size", m);
+      HEAP_CHECK((char *)get_next_block(m) <= (char *)fence, "block runs past its region", m);
+      HEAP_CHECK(m == first || !m->first_in_region, "first_in_region in the middle", m);
+      HEAP_CHECK(m->lifetime == first->lifetime, "mixed lifetimes in a region", m);
+      HEAP_CHECK(m->prev_free == prev_free, "prev_free doesn't match the left neighbor", m);
+      HEAP_CHECK(!m->prev_min || prev_min, "prev_min doesn't match the left neighbor", m);
+      if (m->is_free) {
+        HEAP_CHECK(!prev_free, "two adjacent free blocks", m);
+        HEAP_CHECK(m->size == MIN_PAYLOAD_SIZE || *((size_t *)get_next_block(m) - 1) == m->size,
+                   "bad footer", m);
+        HEAP_CHECK(get_next_block(m)->prev_min == (m->size == MIN_PAYLOAD_SIZE),
+                   "prev_min doesn't match the left neighbor", get_next_block(m));
+        free_blocks[m->lifetime]++;
+        free_size[m->lifetime] += m->size;
+      } else {
+        used_size += m->size;
+      }
+      prev_free = m->is_free;
+      prev_min = m->is_free && m->size == MIN_PAYLOAD_SIZE;
+      m = get_next_block(m);
+    }
+    HEAP_CHECK(fence->is_fence && fence->size == 0 && !fence->is_free,
+               "bad fence", fence);
+    HEAP_CHECK(fence->prev_free == prev_free, "fence's prev_free is wrong", fence);
+  }
+
+  for (int lifetime = 0; lifetime < NUM_LIFETIME_CLASSES; lifetime++) {
+    my_heap_t *heap = &my_heaps[lifetime];
+    size_t bin_blocks = 0;
+    size_t bin_size = 0;
+    for (int i = 0; i < NUM_BINS; i++) {
+      my_metadata_t *head = i < NUM_SMALL_BINS ? heap->small_bins[i]
+                                               : heap->large_bins[i - NUM_SMALL_BINS];
+      size_t count = 0;
+      my_metadata_t *prev = NULL;
+      for (my_metadata_t *m = head; m; prev = m, m = m->next) {
+        // More blocks than the walk found means a cycle or a block that isn't ours.
+        HEAP_CHECK(bin_blocks + count < free_blocks[lifetime], "stray block in a bin", m);
+        HEAP_CHECK(m->is_free, "block in a bin isn't free", m);
+        HEAP_CHECK(m->lifetime == lifetime, "block in the wrong heap's bin", m);
+        HEAP_CHECK(m->prev == prev, "broken prev link", m);
+        int bin = m->size <= SMALL_BIN_MAX_SIZE
+                      ? get_small_bin_index(m->size)
+                      : NUM_SMALL_BINS + get_large_bin_index(m->size);
+        HEAP_CHECK(bin == i, "block in the wrong bin", m);
+        HEAP_CHECK(i < NUM_SMALL_BINS || !prev || prev->size <= m->size,
+                   "large bin out of order", m);
+        count++;
+        bin_size += m->size;
+      }
+      HEAP_CHECK(((heap->summary.nonempty >> i) & 1) == (count != 0),
+                 "nonempty bit is wrong", head);
+      HEAP_CHECK(heap->summary.counts[i] == count || heap->summary.counts[i] == UINT16_MAX,
+                 "bin count is wrong", head);
+      bin_blocks += count;
+    }
+    HEAP_CHECK(bin_blocks == free_blocks[lifetime], "free block missing from the bins",
+               heap);
+    HEAP_CHECK(bin_size == free_size[lifetime] && heap->summary.free_size == bin_size,
+               "free_size is wrong", heap);
+  }
+
+  my_huge_t *prev = NULL;
+  for (my_huge_t *huge = my_huge_objects; huge; prev = huge, huge = huge->next) {
+    my_metadata_t *metadata = (my_metadata_t *)(huge + 1);
+    HEAP_CHECK(metadata->is_huge && !metadata->is_free, "bad huge header", huge);
+    HEAP_CHECK(huge->prev == prev && (!prev || prev < huge), "huge list out of order", huge);
+    HEAP_CHECK((uintptr_t)huge->mapping % 4096 == 0 && huge->mapping_size % 4096 == 0 &&
+                   (char *)get_next_block(metadata) ==
+                       (char *)huge->mapping + huge->mapping_size,
+               "huge object doesn't match its mapping", huge);
+    used_size += metadata->size;
+  }
+  HEAP_CHECK(used_size >= live_size, "less memory in use than there are live objects",
+             NULL);
+  return true;
+}
+#endif
+
 // --- Test Function ---
 // A basic smoke test to see if the allocator crashes immediately.
 void test() {
+  my_initialize(); // main() calls test() before the first challenge initializes us.
+  // The tests below expect the default hysteresis, whatever --option says.
+  size_t old_min_pages = munmap_min_pages;
+  size_t old_retain_size = munmap_retain_size;
+  munmap_min_pages = MUNMAP_MIN_PAGES;
+  munmap_retain_size = MUNMAP_RETAIN_SIZE;
+
+  // A release that is turned down (too little would stay free) unmaps nothing, so
+  // the next refill can still grow the region through its fence.
+  release_mode_t test_release_mode = release_mode;
+  release_mode = RELEASE_MUNMAP;
+  char *only = my_malloc(64);
+  my_heap_t *only_heap = get_heap(get_metadata(only));
+  char *only_region_end = only_heap->region_end;
+  assert(only_region_end);
+  my_free(only);
+  assert(only_heap->region_end == only_region_end);
+  release_mode = test_release_mode;
+  // The hysteresis is tunable at runtime, but a release is never less than a page.
+  bool accepted = my_set_option("munmap_min_pages", "4");
+  assert(accepted && munmap_min_pages == 4);
+  accepted = my_set_option("munmap_retain", "0");
+  assert(accepted && munmap_retain_size == 0);
+  accepted = my_set_option("munmap_min_pages", "0");
+  assert(!accepted);
+  accepted = my_set_option("munmap_retain", "lots");
+  assert(!accepted);
+  munmap_min_pages = MUNMAP_MIN_PAGES;
+  munmap_retain_size = MUNMAP_RETAIN_SIZE;
+
   void *small_ptrs[20] = {NULL}; // Initialize to NULL to be safe
   void *large_ptrs[10] = {NULL};
 
@@ -397,6 +1356,163 @@ void test() {
     if (large_ptrs[i]) my_free(large_ptrs[i]);
   }
   
+  // Boundary-tag coalescing: three adjacent blocks freed in the order
+  // left, right, middle must come back as one block starting at the left one.
+  char *a = my_malloc(512);
+  char *b = my_malloc(512);
+  char *c = my_malloc(512);
+  assert(b == a + 512 + HEADER_SIZE);
+  assert(c == b + 512 + HEADER_SIZE);
+  my_free(a);
+  my_free(c);
+  my_free(b);
+  my_metadata_t *merged = get_metadata(a);
+  assert(merged->is_free);
+  assert(merged->size >= 3 * 512 + 2 * HEADER_SIZE);
+
+  // A minimum-size free block has no footer; prev_min finds it instead. (The long-lived
+  // heap is still empty, so the three blocks are carved side by side.)
+  char *min1 = my_malloc_hint(MIN_PAYLOAD_SIZE, LIFETIME_LONG);
+  char *min2 = my_malloc_hint(MIN_PAYLOAD_SIZE, LIFETIME_LONG);
+  char *min3 = my_malloc_hint(MIN_PAYLOAD_SIZE, LIFETIME_LONG);
+  assert(min2 == min1 + MIN_PAYLOAD_SIZE + HEADER_SIZE);
+  my_free(min1);
+  assert(get_metadata(min2)->prev_free && get_metadata(min2)->prev_min);
+  memset(min2, 'm', MIN_PAYLOAD_SIZE); // Must not clobber min1's links.
+  my_free(min2);
+  assert(get_metadata(min1)->is_free);
+  assert(get_metadata(min1)->size == 2 * MIN_PAYLOAD_SIZE + HEADER_SIZE);
+  assert(!get_metadata(min3)->prev_min);
+  my_free(min3);
+
+  // my_realloc grows in place into a free right neighbor and keeps the contents.
+  char *d = my_malloc(512);
+  char *e = my_malloc(512);
+  my_free(e);
+  memset(d, 'x', 512);
+  char *grown = my_realloc(d, 900);
+  assert(grown == d);
+  assert(grown[0] == 'x' && grown[511] == 'x');
+  // Shrinking never moves.
+  char *shrunk_in_place = my_realloc(grown, 100);
+  assert(shrunk_in_place == d);
+  my_free(d);
+
+  // my_calloc zeroes a block that was used before.
+  char *dirty = my_malloc(256);
+  memset(dirty, 0xff, 256);
+  my_free(dirty);
+  char *zeroed = my_calloc(32, 8);
+  for (int i = 0; i < 256; i++) {
+    assert(zeroed[i] == 0);
+  }
+  my_free(zeroed);
+
+  // my_aligned_alloc honors the alignment.
+  void *aligned_ptrs[8];
+  for (int i = 0; i < 8; i++) {
+    size_t alignment = (size_t)64 << i;
+    aligned_ptrs[i] = my_aligned_alloc(alignment, 100 + i * 8);
+    assert((uintptr_t)aligned_ptrs[i] % alignment == 0);
+  }
+  for (int i = 0; i < 8; i++) {
+    my_free(aligned_ptrs[i]);
+  }
+  // Plain malloc keeps payloads ALIGNMENT-aligned, even for odd sizes.
+  void *odd1 = my_malloc(13);
+  void *odd2 = my_malloc(7);
+  assert((uintptr_t)odd1 % ALIGNMENT == 0 && (uintptr_t)odd2 % ALIGNMENT == 0);
+  my_free(odd1);
+  my_free(odd2);
+
+  // Hinted objects go to the heap of their lifetime class and stay there.
+  char *short_lived = my_malloc_hint(64, LIFETIME_SHORT);
+  char *immortal = my_malloc_hint(64, LIFETIME_IMMORTAL);
+  assert(get_metadata(immortal)->lifetime == LIFETIME_IMMORTAL);
+  assert(!arena_same_chunk(&my_heaps[LIFETIME_SHORT].arena, immortal, immortal + 64));
+  my_free(immortal);
+  assert(my_heaps[LIFETIME_IMMORTAL].summary.free_size > 0);
+  char *moved = my_realloc(short_lived, 8192);
+  assert(get_metadata(moved)->lifetime == LIFETIME_SHORT);
+  my_free(moved);
+
+  // Huge objects get page-aligned mappings of their own, kept in address order,
+  // and go straight back to the system.
+  size_t old_threshold = huge_threshold;
+  accepted = my_set_option("huge_threshold", "8192");
+  assert(accepted);
+  accepted = my_set_option("huge_threshold", "lots");
+  assert(!accepted);
+  char *huge1 = my_malloc(20000);
+  char *huge2 = my_malloc(9000);
+  my_metadata_t *huge_metadata = get_metadata(huge1);
+  assert(huge_metadata->is_huge);
+  assert((uintptr_t)get_huge(huge_metadata)->mapping % 4096 == 0);
+  assert(huge_metadata->size >= 20000);
+  assert(my_huge_objects && my_huge_objects->next && !my_huge_objects->next->next);
+  assert(my_huge_objects < my_huge_objects->next);
+  memset(huge1, 'h', 20000);
+  char *shrunk = my_realloc(huge1, 10000); // Still huge: shrinks in place.
+  assert(shrunk == huge1 && shrunk[9999] == 'h');
+  assert(get_huge(huge_metadata)->mapping_size == (sizeof(my_huge_t) + HEADER_SIZE + 10000 + 4095) / 4096 * 4096);
+  char *unhuge = my_realloc(shrunk, 100); // No longer huge: moves into a heap.
+  assert(!get_metadata(unhuge)->is_huge && unhuge[99] == 'h');
+  void *huge_aligned = my_aligned_alloc(16384, 10000);
+  assert((uintptr_t)huge_aligned % 16384 == 0 && get_metadata(huge_aligned)->is_huge);
+  char *huge_zeroed = my_calloc(1000, 10);
+  assert(huge_zeroed[0] == 0 && huge_zeroed[9999] == 0);
+  my_free(huge_zeroed);
+  my_free(huge_aligned);
+  my_free(huge2);
+  my_free(unhuge);
+  assert(my_huge_objects == NULL);
+  huge_threshold = old_threshold;
+
+  // In madvise mode freed pages stay mapped, in their free block, but lose their
+  // contents (MADV_DONTNEED zero-fills them). The blocks must not be huge, whatever
+  // --option=huge_threshold says.
+  release_mode_t old_release_mode = release_mode;
+  huge_threshold = HUGE_THRESHOLD;
+  accepted = my_set_option("release", "madvise");
+  assert(accepted);
+  accepted = my_set_option("release", "sometimes");
+  assert(!accepted);
+  char *run[32];
+  for (int i = 0; i < 32; i++) {
+    run[i] = my_malloc(4000);
+    memset(run[i], 'm', 4000);
+  }
+  for (int i = 0; i < 32; i++) {
+    my_free(run[i]);
+  }
+  char *page = (char *)(((uintptr_t)run[30] + 4095) / 4096 * 4096);
+  assert(page[0] == 0 && page[4095] == 0);
+  for (int i = 0; i < 32; i++) {
+    run[i] = my_malloc(4000);
+  }
+  for (int i = 0; i < 32; i++) {
+    my_free(run[i]);
+  }
+  release_mode = old_release_mode;
+  huge_threshold = old_threshold;
+
+  // Large bins: two per power of two, the last one open ended.
+  assert(get_large_bin_index(257) == 0 && get_large_bin_index(384) == 0);
+  assert(get_large_bin_index(385) == 1 && get_large_bin_index(512) == 1);
+  assert(get_large_bin_index(513) == 2 && get_large_bin_index(1024) == 3);
+  assert(get_large_bin_index(4096) == 7 && get_large_bin_index(1 << 20) == 7);
+  // The bin summaries still agree with the free lists (my_heap_stats checks).
+  heap_stats_t heap_stats;
+  my_heap_stats(&heap_stats);
+  munmap_min_pages = old_min_pages;
+  munmap_retain_size = old_retain_size;
+
+#ifdef ENABLE_HEAP_CHECK
+  // Everything above left the heaps consistent.
+  bool heap_ok = my_check_heap(0);
+  assert(heap_ok);
+#endif
+
   // The original test had a bug. It tried to free large_ptrs[0] through [9]
   // after already freeing [0] through [4]. The check `if (large_ptrs[i])`
   // after setting them to NULL fixes this potential double-free.
@@ -0,0 +1,104 @@
+//
+// Hardware performance counters: see perf_counters.h
+//
+
+#include "perf_counters.h"
+
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+typedef struct perf_event_config_t {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+} perf_event_config_t;
+
+#define PERF_CACHE_EVENT(cache, op, result)                          \
+  ((cache) | ((uint64_t)(op) << 8) | ((uint64_t)(result) << 16))
+
+// Indexed by perf_event_t.
+const perf_event_config_t perf_event_configs[NUM_PERF_EVENTS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"L1d misses", PERF_TYPE_HW_CACHE,
+     PERF_CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+                      PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {"LLC misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"dTLB misses", PERF_TYPE_HW_CACHE,
+     PERF_CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ,
+                      PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {"branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+bool perf_counters_open(perf_counters_t *counters) {
+  bool any = false;
+  for (int i = 0; i < NUM_PERF_EVENTS; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perf_event_configs[i].type;
+    attr.config = perf_event_configs[i].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    counters->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    counters->values[i] = 0;
+    any |= counters->fds[i] != -1;
+  }
+  return any;
+}
+
+void perf_counters_start(perf_counters_t *counters) {
+  for (int i = 0; i < NUM_PERF_EVENTS; i++) {
+    if (counters->fds[i] != -1) {
+      ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+void perf_counters_stop(perf_counters_t *counters) {
+  for (int i = 0; i < NUM_PERF_EVENTS; i++) {
+    if (counters->fds[i] != -1) {
+      ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+  for (int i = 0; i < NUM_PERF_EVENTS; i++) {
+    counters->values[i] = 0;
+    if (counters->fds[i] == -1) {
+      continue;
+    }
+    // value, time enabled, time running
+    uint64_t data[3];
+    if (read(counters->fds[i], data, sizeof(data)) != sizeof(data) ||
+        data[2] == 0) {
+      continue;
+    }
+    counters->values[i] =
+        data[2] < data[1] ? (uint64_t)((double)data[0] * data[1] / data[2])
+                          : data[0];
+  }
+}
+
+void perf_counters_close(perf_counters_t *counters) {
+  for (int i = 0; i < NUM_PERF_EVENTS; i++) {
+    if (counters->fds[i] != -1) {
+      close(counters->fds[i]);
+      counters->fds[i] = -1;
+    }
+  }
+}
+
+bool perf_counter_available(const perf_counters_t *counters,
+                            perf_event_t event) {
+  return counters->fds[event] != -1;
+}
+
+const char *perf_event_name(perf_event_t event) {
+  return perf_event_configs[event].name;
+}
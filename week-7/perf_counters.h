@@ -0,0 +1,52 @@
+//
+// Hardware performance counters
+//
+// Time alone doesn't say why an allocator is slow: walking lists (cache
+// misses), touching too many pages (dTLB misses) or unpredictable branches.
+// These wrap Linux perf_event_open() so a benchmark can count the events of
+// just the code between perf_counters_start() and perf_counters_stop(), in
+// user space only. Every event has its own counter, so one the CPU (or a VM)
+// doesn't support is reported as unavailable without losing the others.
+//
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum perf_event_t {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_L1D_MISSES,     // L1 data cache read misses.
+  PERF_LLC_MISSES,     // Last level cache misses (references that go to DRAM).
+  PERF_DTLB_MISSES,    // Data TLB read misses (page walks).
+  PERF_BRANCH_MISSES,  // Mispredicted branches.
+  NUM_PERF_EVENTS,
+} perf_event_t;
+
+typedef struct perf_counters_t {
+  int fds[NUM_PERF_EVENTS];          // -1 if the event isn't available.
+  uint64_t values[NUM_PERF_EVENTS];  // Filled by perf_counters_stop().
+} perf_counters_t;
+
+// Open the counters (stopped) for the calling thread. Return false if none of
+// them is available, e.g. without a PMU or with perf_event_paranoid > 2.
+bool perf_counters_open(perf_counters_t *counters);
+
+// Zero the counters and start counting.
+void perf_counters_start(perf_counters_t *counters);
+
+// Stop counting and read the counts into |counters->values|. Counts of
+// events that had to share the PMU are scaled up to the whole interval.
+void perf_counters_stop(perf_counters_t *counters);
+
+void perf_counters_close(perf_counters_t *counters);
+
+bool perf_counter_available(const perf_counters_t *counters,
+                            perf_event_t event);
+
+// A short name for tables, e.g. "L1d misses".
+const char *perf_event_name(perf_event_t event);
+
+#endif  // PERF_COUNTERS_H
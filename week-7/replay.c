@@ -0,0 +1,237 @@
+//
+// Malloc trace replayer
+//
+// Replays a binary trace recorded by malloc_challenge_with_trace.bin (see
+// trace.h) against the linked allocator at full speed: no tag checks, no
+// memset, no random numbers, no trace I/O while the clock is running.
+//
+//   ./malloc_replay.bin trace5_my.trace           # Replay with my_malloc.
+//   ./malloc_replay.bin --simple trace5_my.trace  # Replay with simple_malloc.
+//   ./malloc_replay.bin --perf trace5_my.trace    # Also count cache misses.
+//
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "perf_counters.h"
+#include "timer.h"
+#include "trace.h"
+
+void simple_initialize();
+void *simple_malloc(size_t size);
+void simple_free(void *ptr);
+void simple_finalize();
+
+void my_initialize();
+void *my_malloc(size_t size);
+void my_free(void *ptr);
+void my_finalize();
+
+size_t mmap_size;
+size_t munmap_size;
+
+void *mmap_from_system(size_t size) {
+  assert(size % 4096 == 0);
+  mmap_size += size;
+  void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(ptr != MAP_FAILED);
+  return ptr;
+}
+
+void munmap_to_system(void *ptr, size_t size) {
+  assert(size % 4096 == 0);
+  assert((uintptr_t)(ptr) % 4096 == 0);
+  munmap_size += size;
+  int ret = munmap(ptr, size);
+  assert(ret != -1);
+}
+
+void madvise_to_system(void *ptr, size_t size, bool lazy) {
+  assert(size % 4096 == 0);
+  assert((uintptr_t)(ptr) % 4096 == 0);
+  int ret = madvise(ptr, size, lazy ? MADV_FREE : MADV_DONTNEED);
+  assert(ret != -1);
+}
+
+// calloc(), but exit if there is not enough memory.
+void *calloc_or_exit(size_t count, size_t size) {
+  void *ptr = calloc(count, size);
+  if (!ptr && count > 0) {
+    fprintf(stderr, "Out of memory: %zu x %zu bytes\n", count, size);
+    exit(EXIT_FAILURE);
+  }
+  return ptr;
+}
+
+// Read the whole trace into memory. Exit on a malformed file.
+trace_record_t *load_trace(const char *file_name, trace_header_t *header) {
+  FILE *fp = fopen(file_name, "rb");
+  if (!fp) {
+    fprintf(stderr, "Failed to open a trace file: %s\n", file_name);
+    exit(EXIT_FAILURE);
+  }
+  if (fread(header, sizeof(*header), 1, fp) != 1 ||
+      header->magic != TRACE_MAGIC || header->version != TRACE_VERSION) {
+    fprintf(stderr, "Not a version %d malloc trace: %s\n", TRACE_VERSION,
+            file_name);
+    exit(EXIT_FAILURE);
+  }
+  // The counts come from the file, so check them against its size before
+  // sizing anything by them.
+  struct stat st;
+  if (fstat(fileno(fp), &st) != 0 || (uint64_t)st.st_size < sizeof(*header) ||
+      header->num_records !=
+          (st.st_size - sizeof(*header)) / sizeof(trace_record_t) ||
+      (st.st_size - sizeof(*header)) % sizeof(trace_record_t) != 0) {
+    fprintf(stderr,
+            "Malformed malloc trace: %s: header does not match the "
+            "file size\n",
+            file_name);
+    exit(EXIT_FAILURE);
+  }
+  if (header->num_objects > header->num_records) {  // One malloc each.
+    fprintf(stderr, "Malformed malloc trace: %s: more objects than records\n",
+            file_name);
+    exit(EXIT_FAILURE);
+  }
+  trace_record_t *records = (trace_record_t *)calloc_or_exit(
+      header->num_records, sizeof(trace_record_t));
+  if (fread(records, sizeof(trace_record_t), header->num_records, fp) !=
+      header->num_records) {
+    fprintf(stderr, "Truncated malloc trace: %s\n", file_name);
+    exit(EXIT_FAILURE);
+  }
+  fclose(fp);
+
+  // Replaying a bad record would crash the allocator, or write past |objects|
+  // in main(), so check every record first. Each object is malloc'd once and
+  // freed at most once, after that.
+  enum { NEVER_ALLOCATED, LIVE, FREED };
+  uint8_t *states =
+      (uint8_t *)calloc_or_exit(header->num_objects, sizeof(uint8_t));
+  for (uint64_t i = 0; i < header->num_records; i++) {
+    trace_record_t record = records[i];
+    const char *error = NULL;
+    if (record.op == TRACE_MMAP || record.op == TRACE_MUNMAP) {
+      continue;
+    } else if (record.op != TRACE_MALLOC && record.op != TRACE_FREE) {
+      error = "unknown op";
+    } else if (record.id >= header->num_objects) {
+      error = "object id out of range";
+    } else if (record.op == TRACE_MALLOC) {
+      if (states[record.id] != NEVER_ALLOCATED) {
+        error = "object allocated twice";
+      }
+      states[record.id] = LIVE;
+    } else {
+      if (states[record.id] != LIVE) {
+        error = states[record.id] == FREED ? "object freed twice"
+                                           : "object freed before allocated";
+      }
+      states[record.id] = FREED;
+    }
+    if (error) {
+      fprintf(stderr, "Malformed malloc trace: %s: record %" PRIu64 ": %s\n",
+              file_name, i, error);
+      exit(EXIT_FAILURE);
+    }
+  }
+  free(states);
+  return records;
+}
+
+int main(int argc, char **argv) {
+  bool use_simple = false;
+  bool use_perf = false;
+  const char *file_name = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--simple") == 0) {
+      use_simple = true;
+    } else if (strcmp(argv[i], "--perf") == 0) {
+      use_perf = true;
+    } else {
+      file_name = argv[i];
+    }
+  }
+  if (!file_name) {
+    fprintf(stderr, "Usage: %s [--simple] [--perf] TRACE_FILE\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  void (*initialize_func)() = use_simple ? simple_initialize : my_initialize;
+  void *(*malloc_func)(size_t) = use_simple ? simple_malloc : my_malloc;
+  void (*free_func)(void *) = use_simple ? simple_free : my_free;
+  void (*finalize_func)() = use_simple ? simple_finalize : my_finalize;
+
+  trace_header_t header;
+  trace_record_t *records = load_trace(file_name, &header);
+  void **objects =
+      (void **)calloc_or_exit(header.num_objects, sizeof(void *));
+  size_t num_mallocs = 0;
+  size_t num_frees = 0;
+  size_t live_size = 0;
+
+  perf_counters_t counters;
+  if (use_perf && !perf_counters_open(&counters)) {
+    fprintf(stderr, "No perf counters available (perf_event_paranoid?)\n");
+  }
+
+  initialize_func();
+  if (use_perf) {
+    perf_counters_start(&counters);
+  }
+  double begin_time = get_time();
+  for (uint64_t i = 0; i < header.num_records; i++) {
+    trace_record_t record = records[i];
+    if (record.op == TRACE_MALLOC) {
+      objects[record.id] = malloc_func(record.size);
+      live_size += record.size;
+      num_mallocs++;
+    } else if (record.op == TRACE_FREE) {
+      free_func(objects[record.id]);
+      live_size -= record.size;
+      num_frees++;
+    }
+    // mmap / munmap records describe the recording allocator; the replayed
+    // one makes its own calls.
+  }
+  double end_time = get_time();
+  if (use_perf) {
+    perf_counters_stop(&counters);
+  }
+  finalize_func();
+
+  double seconds = end_time - begin_time;
+  printf("Replayed %s with %s\n", file_name,
+         use_simple ? "simple_malloc" : "my_malloc");
+  printf("%16s| %15zu\n", "malloc calls", num_mallocs);
+  printf("%16s| %15zu\n", "free calls", num_frees);
+  printf("%16s| %15d\n", "Time [ms]", (int)(seconds * 1000));
+  printf("%16s| %15.2f\n", "Mops/s", (num_mallocs + num_frees) / seconds / 1e6);
+  printf("%16s| %15d\n", "Utilization [%] ",
+         (int)(100.0 * live_size / (mmap_size - munmap_size)));
+  if (use_perf) {
+    // Per malloc or free call, so allocators compare at equal work.
+    for (int i = 0; i < NUM_PERF_EVENTS; i++) {
+      char label[32];
+      snprintf(label, sizeof(label), "%s/op", perf_event_name(i));
+      if (perf_counter_available(&counters, i)) {
+        printf("%16s| %15.3f\n", label,
+               (double)counters.values[i] / (num_mallocs + num_frees));
+      } else {
+        printf("%16s| %15s\n", label, "n/a");
+      }
+    }
+    perf_counters_close(&counters);
+  }
+  free(objects);
+  free(records);
+  return 0;
+}
@@ -0,0 +1,650 @@
+//
+// Thread-caching malloc implementation
+// Each thread keeps small per-size-class caches of free objects (like glibc's
+// tcache), so most malloc/free calls touch no shared state and take no lock.
+// Caches refill from and flush to a shared central heap in batches, and the
+// central heap is protected by a single mutex.
+//
+// The central heap carves every size class from spans of its own. Once all
+// objects of a span are back in the central heap, the span goes back to the
+// system (unless its class keeps it, see SPAN_EMPTY_DIVISOR), so memory freed
+// after a peak doesn't stay mapped.
+//
+// Freeing an object that another thread's cache handed out takes no lock
+// either: it is pushed onto that cache's lock-free remote-free stack (one CAS),
+// and the owner drains the stack in one batch on its next malloc. If the owner
+// has exited, the object goes to the central heap instead.
+// --option=remote_free=off turns this off: cross-thread frees then go to the
+// freeing thread's cache and flush through the central heap's mutex, which is
+// the baseline to measure the contention the stacks save against.
+//
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc_stats.h"
+
+void *mmap_from_system(size_t size);
+void munmap_to_system(void *ptr, size_t size);
+
+// Every object has an 8-byte header with the offset of its span, its size
+// class and the id of the thread cache that handed it out. While an object is
+// free, its first 8 bytes link it into a thread cache, a remote-free stack or
+// its span's free list.
+//
+//   | span_offset | class_index | owner | object ... |
+//                                       ^
+//                                       ptr
+typedef struct my_header_t {
+  uint32_t span_offset;  // Bytes from the start of the span to this header.
+  uint16_t class_index;  // LARGE_CLASS for an object with a mapping of its own.
+  uint16_t owner;
+} my_header_t;
+
+typedef struct my_free_t {
+  struct my_free_t *next;
+} my_free_t;
+
+// A span is a mapping that holds objects of a single size class:
+//
+//   | my_span_t | header | object | header | object | ... | unused tail |
+//
+// The central heap allocates from the spans of a class that have objects it
+// holds, the way slab.c allocates from partial pages. A large object is a span
+// with one object.
+typedef struct my_span_t {
+  struct my_span_t *next;  // Next span of this class with central objects.
+  struct my_span_t *prev;
+  my_free_t *free_list;    // Objects flushed back to the central heap.
+  char *bump;              // Next never-used object.
+  size_t size;             // Of the mapping.
+  uint32_t capacity;       // Objects in the span.
+  uint32_t free_count;     // Central objects, including the never-used ones.
+} my_span_t;
+
+// Size classes: every 8 bytes up to 128, then 4 per power of two (160, 192,
+// 224, 256, 320, ..., 4096), so rounding up wastes at most a fifth of an
+// object, like the second level of tlsf.c.
+#define SMALL_CLASS_MAX_SIZE_LOG2 7
+#define SMALL_CLASS_MAX_SIZE (1 << SMALL_CLASS_MAX_SIZE_LOG2)
+#define NUM_SMALL_CLASSES (SMALL_CLASS_MAX_SIZE / 8)
+#define CLASSES_PER_DOUBLING_LOG2 2
+#define CLASSES_PER_DOUBLING (1 << CLASSES_PER_DOUBLING_LOG2)
+#define CLASS_MAX_SIZE_LOG2 12
+#define CLASS_MAX_SIZE (1 << CLASS_MAX_SIZE_LOG2)  // Bigger objects get their own mapping.
+#define NUM_CLASSES                                                          \
+  (NUM_SMALL_CLASSES +                                                       \
+   (CLASS_MAX_SIZE_LOG2 - SMALL_CLASS_MAX_SIZE_LOG2) * CLASSES_PER_DOUBLING)
+#define LARGE_CLASS NUM_CLASSES
+
+#define SPAN_MIN_SIZE (4 * 1024)  // A span is at least this big,
+#define SPAN_MIN_OBJECTS 4         // and holds at least this many objects.
+// A class keeps up to 1 / SPAN_EMPTY_DIVISOR of its spans (and at least one)
+// mapped while empty, so a class whose live count hovers around a span
+// boundary doesn't mmap and munmap on every batch.
+#define SPAN_EMPTY_DIVISOR 2
+#define TCACHE_MAX_COUNT 64        // A thread cache holds at most this many objects per class,
+#define TCACHE_MAX_SIZE (16 * 1024)  // and at most this many bytes of them. Cached objects
+                                     // stay mapped, so big classes cache fewer.
+#define MAX_TCACHES 128            // At most this many threads can allocate at once.
+
+// The part of a thread cache that other threads can see.
+typedef struct my_tcache_slot_t {
+  // Objects of this cache freed by other threads. Any thread pushes with a
+  // CAS; only the owner pops, and it always takes the whole stack with one
+  // exchange, so there is no ABA problem.
+  my_free_t *remote_head;
+  bool in_use;  // Owned by a live thread.
+} my_tcache_slot_t;
+
+typedef struct my_heap_t {
+  pthread_mutex_t lock;
+  my_span_t *spans[NUM_CLASSES];  // Spans with central objects, per class.
+  unsigned num_spans[NUM_CLASSES];
+  unsigned num_empty_spans[NUM_CLASSES];  // Spans with all their objects back.
+  my_tcache_slot_t slots[MAX_TCACHES];
+  // Bumped by my_initialize(). A thread cache from an older generation holds
+  // objects of a heap that no longer exists and is dropped on next use.
+  unsigned generation;
+} my_heap_t;
+
+typedef struct my_tcache_t {
+  unsigned generation;
+  uint32_t slot_id;
+  my_free_t *bins[NUM_CLASSES];
+  unsigned counts[NUM_CLASSES];
+} my_tcache_t;
+
+my_heap_t my_heap = {PTHREAD_MUTEX_INITIALIZER};
+__thread my_tcache_t my_tcache;
+bool remote_frees = true;  // Set with --option=remote_free=on|off.
+
+#ifdef ENABLE_ALLOC_STATS
+// The central heap's counters are updated with the lock held. Each thread
+// counts its own mallocs and frees without it and folds them in when it exits
+// or calls my_finalize().
+alloc_stats_t my_alloc_stats;
+__thread alloc_stats_t my_thread_alloc_stats;
+#endif
+
+// Per class: how many objects a thread cache holds at most. It moves half of
+// that at once to/from the central heap. Set up by my_initialize().
+unsigned tcache_max_counts[NUM_CLASSES];
+
+// Used only for its destructor, which flushes a thread's cache when it exits.
+pthread_key_t my_tcache_key;
+pthread_once_t my_tcache_key_once = PTHREAD_ONCE_INIT;
+
+int get_class_index(size_t size) {
+  if (size <= SMALL_CLASS_MAX_SIZE) {
+    return (int)(size - 1) / 8;
+  }
+  int log2 = 63 - __builtin_clzl(size - 1);  // size - 1 is in [2^log2, 2^(log2 + 1)).
+  int step_log2 = log2 - CLASSES_PER_DOUBLING_LOG2;
+  return NUM_SMALL_CLASSES + (log2 - SMALL_CLASS_MAX_SIZE_LOG2) * CLASSES_PER_DOUBLING +
+         (int)((size - 1) >> step_log2) - CLASSES_PER_DOUBLING;
+}
+
+size_t get_class_size(int class_index) {
+  if (class_index < NUM_SMALL_CLASSES) {
+    return (class_index + 1) * 8;
+  }
+  int index = class_index - NUM_SMALL_CLASSES;
+  int step_log2 = SMALL_CLASS_MAX_SIZE_LOG2 + index / CLASSES_PER_DOUBLING -
+                  CLASSES_PER_DOUBLING_LOG2;
+  return (size_t)(CLASSES_PER_DOUBLING + index % CLASSES_PER_DOUBLING + 1)
+         << step_log2;
+}
+
+my_header_t *get_header(void *ptr) { return (my_header_t *)ptr - 1; }
+
+my_span_t *get_span(my_header_t *header) {
+  return (my_span_t *)((char *)header - header->span_offset);
+}
+
+void add_to_span_list(my_span_t *span, int class_index) {
+  span->prev = NULL;
+  span->next = my_heap.spans[class_index];
+  if (span->next) {
+    span->next->prev = span;
+  }
+  my_heap.spans[class_index] = span;
+}
+
+void remove_from_span_list(my_span_t *span, int class_index) {
+  if (span->prev) {
+    span->prev->next = span->next;
+  } else {
+    my_heap.spans[class_index] = span->next;
+  }
+  if (span->next) {
+    span->next->prev = span->prev;
+  }
+  span->next = NULL;
+  span->prev = NULL;
+}
+
+// Map a new span for |class_index|: at least SPAN_MIN_SIZE and SPAN_MIN_OBJECTS
+// objects, rounded up to whole pages. Called with the lock held.
+my_span_t *new_span(int class_index) {
+  size_t slot_size = sizeof(my_header_t) + get_class_size(class_index);
+  size_t size = sizeof(my_span_t) + SPAN_MIN_OBJECTS * slot_size;
+  if (size < SPAN_MIN_SIZE) {
+    size = SPAN_MIN_SIZE;
+  }
+  size = (size + 4095) / 4096 * 4096;
+  my_span_t *span = (my_span_t *)mmap_from_system(size);
+  ALLOC_STATS_INC(my_alloc_stats, refills);
+  ALLOC_STATS_ADD(my_alloc_stats, refill_size, size);
+  span->next = NULL;
+  span->prev = NULL;
+  span->free_list = NULL;
+  span->bump = (char *)(span + 1);
+  span->size = size;
+  span->capacity = (size - sizeof(my_span_t)) / slot_size;
+  span->free_count = span->capacity;
+  my_heap.num_spans[class_index]++;
+  my_heap.num_empty_spans[class_index]++;
+  return span;
+}
+
+// Take one object of |class_index| from the central heap, mapping a new span
+// if no span of the class has one. Called with the lock held.
+my_free_t *central_pop(int class_index) {
+  my_span_t *span = my_heap.spans[class_index];
+  if (!span) {
+    span = new_span(class_index);
+    add_to_span_list(span, class_index);
+  }
+  if (span->free_count == span->capacity) {
+    my_heap.num_empty_spans[class_index]--;
+  }
+  my_free_t *object = span->free_list;
+  if (object) {
+    span->free_list = object->next;
+  } else {
+    // Never used yet: write its header.
+    my_header_t *header = (my_header_t *)span->bump;
+    header->span_offset = span->bump - (char *)span;
+    header->class_index = class_index;
+    span->bump += sizeof(my_header_t) + get_class_size(class_index);
+    object = (my_free_t *)(header + 1);
+  }
+  span->free_count--;
+  if (span->free_count == 0) {
+    // Nothing left to hand out until objects come back.
+    remove_from_span_list(span, class_index);
+  }
+  return object;
+}
+
+// Give one object back to its span. If that was the last object out, unmap
+// the span unless its class keeps it (see SPAN_EMPTY_DIVISOR). Called with
+// the lock held.
+void central_push(my_free_t *object) {
+  my_header_t *header = get_header(object);
+  my_span_t *span = get_span(header);
+  object->next = span->free_list;
+  span->free_list = object;
+  span->free_count++;
+  if (span->free_count == 1) {
+    // The span was all handed out, so it is not on the list yet.
+    add_to_span_list(span, header->class_index);
+  }
+  int class_index = header->class_index;
+  if (span->free_count == span->capacity) {
+    my_heap.num_empty_spans[class_index]++;
+    unsigned max_empty_spans = my_heap.num_spans[class_index] / SPAN_EMPTY_DIVISOR;
+    if (my_heap.num_empty_spans[class_index] > (max_empty_spans ? max_empty_spans : 1)) {
+      remove_from_span_list(span, class_index);
+      my_heap.num_spans[class_index]--;
+      my_heap.num_empty_spans[class_index]--;
+      ALLOC_STATS_INC(my_alloc_stats, releases);
+      ALLOC_STATS_ADD(my_alloc_stats, release_size, span->size);
+      munmap_to_system(span, span->size);
+    }
+  }
+}
+
+// Move up to |count| objects of |class_index| from the thread cache to the
+// central heap.
+void flush_tcache_bin(my_tcache_t *tcache, int class_index, unsigned count) {
+  pthread_mutex_lock(&my_heap.lock);
+  for (unsigned i = 0; i < count && tcache->bins[class_index]; i++) {
+    my_free_t *object = tcache->bins[class_index];
+    tcache->bins[class_index] = object->next;
+    tcache->counts[class_index]--;
+    central_push(object);
+  }
+  pthread_mutex_unlock(&my_heap.lock);
+}
+
+// Move a batch of objects of |class_index| from the central heap to the
+// thread cache, carving new ones if the spans run dry. The cache becomes
+// their owner.
+void refill_tcache_bin(my_tcache_t *tcache, int class_index) {
+  pthread_mutex_lock(&my_heap.lock);
+  unsigned batch_count = tcache_max_counts[class_index] / 2;
+  for (unsigned i = 0; i < batch_count; i++) {
+    my_free_t *object = central_pop(class_index);
+    get_header(object)->owner = tcache->slot_id;
+    object->next = tcache->bins[class_index];
+    tcache->bins[class_index] = object;
+    tcache->counts[class_index]++;
+  }
+  pthread_mutex_unlock(&my_heap.lock);
+}
+
+// Put a freed object of this cache back, flushing a batch to the central
+// heap if its class is full.
+void push_tcache(my_tcache_t *tcache, my_free_t *object) {
+  int class_index = get_header(object)->class_index;
+  object->next = tcache->bins[class_index];
+  tcache->bins[class_index] = object;
+  tcache->counts[class_index]++;
+  if (tcache->counts[class_index] > tcache_max_counts[class_index]) {
+    flush_tcache_bin(tcache, class_index, tcache_max_counts[class_index] / 2);
+  }
+}
+
+// Move everything other threads freed back into the thread cache.
+void drain_remote_frees(my_tcache_t *tcache) {
+  my_free_t *object = __atomic_exchange_n(
+      &my_heap.slots[tcache->slot_id].remote_head, NULL, __ATOMIC_ACQUIRE);
+  while (object) {
+    my_free_t *next = object->next;
+    push_tcache(tcache, object);
+    object = next;
+  }
+}
+
+// Move everything on |slot|'s remote-free stack to the central heap.
+void flush_remote_frees(my_tcache_slot_t *slot) {
+  my_free_t *object =
+      __atomic_exchange_n(&slot->remote_head, NULL, __ATOMIC_SEQ_CST);
+  if (!object) {
+    return;
+  }
+  pthread_mutex_lock(&my_heap.lock);
+  while (object) {
+    my_free_t *next = object->next;
+    central_push(object);
+    object = next;
+  }
+  pthread_mutex_unlock(&my_heap.lock);
+}
+
+void push_remote_free(my_tcache_slot_t *slot, my_free_t *object) {
+  if (!__atomic_load_n(&slot->in_use, __ATOMIC_ACQUIRE)) {
+    // The owner has exited: nobody would drain the stack until the slot is
+    // claimed again.
+    pthread_mutex_lock(&my_heap.lock);
+    central_push(object);
+    pthread_mutex_unlock(&my_heap.lock);
+    return;
+  }
+  my_free_t *head = __atomic_load_n(&slot->remote_head, __ATOMIC_RELAXED);
+  do {
+    object->next = head;
+  } while (!__atomic_compare_exchange_n(&slot->remote_head, &head, object, true,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+  // If the owner exited since the check above, it may have flushed the stack
+  // for the last time before the push. Either it sees the object or we see
+  // the slot released (both sides are sequentially consistent).
+  if (!__atomic_load_n(&slot->in_use, __ATOMIC_SEQ_CST)) {
+    flush_remote_frees(slot);
+  }
+}
+
+// Hand everything in the cache to the central heap and give its slot back.
+// Objects freed to the slot after this go to the central heap too (see
+// push_remote_free()).
+void flush_tcache_at_thread_exit(void *arg) {
+  my_tcache_t *tcache = (my_tcache_t *)arg;
+  if (tcache->generation != my_heap.generation) {
+    return;
+  }
+  drain_remote_frees(tcache);
+  for (int i = 0; i < NUM_CLASSES; i++) {
+    flush_tcache_bin(tcache, i, tcache->counts[i]);
+  }
+#ifdef ENABLE_ALLOC_STATS
+  pthread_mutex_lock(&my_heap.lock);
+  ALLOC_STATS_MERGE(my_alloc_stats, my_thread_alloc_stats);
+  pthread_mutex_unlock(&my_heap.lock);
+#endif
+  __atomic_store_n(&my_heap.slots[tcache->slot_id].in_use, false,
+                   __ATOMIC_SEQ_CST);
+  flush_remote_frees(&my_heap.slots[tcache->slot_id]);
+}
+
+void create_tcache_key() {
+  pthread_key_create(&my_tcache_key, flush_tcache_at_thread_exit);
+}
+
+my_tcache_t *get_tcache() {
+  my_tcache_t *tcache = &my_tcache;
+  if (tcache->generation != my_heap.generation) {
+    memset(tcache, 0, sizeof(*tcache));
+    for (uint32_t i = 0;; i++) {
+      assert(i < MAX_TCACHES);
+      bool expected = false;
+      if (__atomic_compare_exchange_n(&my_heap.slots[i].in_use, &expected,
+                                      true, false, __ATOMIC_ACQUIRE,
+                                      __ATOMIC_RELAXED)) {
+        tcache->slot_id = i;
+        break;
+      }
+    }
+    tcache->generation = my_heap.generation;
+    pthread_once(&my_tcache_key_once, create_tcache_key);
+    pthread_setspecific(my_tcache_key, tcache);
+  }
+  return tcache;
+}
+
+void *large_malloc(size_t size) {
+  size_t buffer_size =
+      (sizeof(my_span_t) + sizeof(my_header_t) + size + 4095) / 4096 * 4096;
+  my_span_t *span = (my_span_t *)mmap_from_system(buffer_size);
+  ALLOC_STATS_INC(my_thread_alloc_stats, refills);
+  ALLOC_STATS_ADD(my_thread_alloc_stats, refill_size, buffer_size);
+  span->size = buffer_size;
+  my_header_t *header = (my_header_t *)(span + 1);
+  header->span_offset = sizeof(my_span_t);
+  header->class_index = LARGE_CLASS;
+  header->owner = 0;
+  return header + 1;
+}
+
+void my_initialize() {
+  pthread_mutex_lock(&my_heap.lock);
+  for (int i = 0; i < NUM_CLASSES; i++) {
+    my_heap.spans[i] = NULL;
+    my_heap.num_spans[i] = 0;
+    my_heap.num_empty_spans[i] = 0;
+    unsigned max_count = TCACHE_MAX_SIZE / get_class_size(i);
+    if (max_count > TCACHE_MAX_COUNT) {
+      max_count = TCACHE_MAX_COUNT;
+    }
+    tcache_max_counts[i] = max_count < 2 ? 2 : max_count;
+  }
+  for (int i = 0; i < MAX_TCACHES; i++) {
+    my_heap.slots[i].remote_head = NULL;
+    my_heap.slots[i].in_use = false;
+  }
+  // Generation 0 is what a fresh thread's cache starts with, so skip it.
+  my_heap.generation++;
+  if (my_heap.generation == 0) {
+    my_heap.generation++;
+  }
+  ALLOC_STATS_RESET(my_alloc_stats);
+  ALLOC_STATS_RESET(my_thread_alloc_stats);
+  pthread_mutex_unlock(&my_heap.lock);
+}
+
+// Options: remote_free=on (the default) or remote_free=off.
+bool my_set_option(const char *name, const char *value) {
+  if (strcmp(name, "remote_free") != 0) {
+    return false;
+  }
+  if (strcmp(value, "on") == 0) {
+    remote_frees = true;
+  } else if (strcmp(value, "off") == 0) {
+    remote_frees = false;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void *my_malloc(size_t size) {
+  ALLOC_STATS_INC(my_thread_alloc_stats, mallocs);
+  if (size > CLASS_MAX_SIZE) {
+    return large_malloc(size);
+  }
+  int class_index = get_class_index(size);
+  my_tcache_t *tcache = get_tcache();
+  if (__atomic_load_n(&my_heap.slots[tcache->slot_id].remote_head,
+                      __ATOMIC_RELAXED)) {
+    drain_remote_frees(tcache);
+  }
+  if (!tcache->bins[class_index]) {
+    ALLOC_STATS_INC(my_thread_alloc_stats, bin_misses);
+    refill_tcache_bin(tcache, class_index);
+  } else {
+    ALLOC_STATS_INC(my_thread_alloc_stats, fast_path_hits);
+  }
+  ALLOC_STATS_INC(my_thread_alloc_stats, list_walk_steps);
+  my_free_t *object = tcache->bins[class_index];
+  tcache->bins[class_index] = object->next;
+  tcache->counts[class_index]--;
+  return object;
+}
+
+void my_free(void *ptr) {
+  ALLOC_STATS_INC(my_thread_alloc_stats, frees);
+  my_header_t *header = get_header(ptr);
+  if (header->class_index == LARGE_CLASS) {
+    my_span_t *span = get_span(header);
+    ALLOC_STATS_INC(my_thread_alloc_stats, releases);
+    ALLOC_STATS_ADD(my_thread_alloc_stats, release_size, span->size);
+    munmap_to_system(span, span->size);
+    return;
+  }
+  my_free_t *object = (my_free_t *)ptr;
+  my_tcache_t *tcache = get_tcache();
+  if (remote_frees && header->owner != tcache->slot_id) {
+    push_remote_free(&my_heap.slots[header->owner], object);
+    return;
+  }
+  // Without remote frees the object goes to the cache of the thread freeing
+  // it, whichever thread allocated it.
+  push_tcache(tcache, object);
+}
+
+void my_finalize() {
+  pthread_mutex_lock(&my_heap.lock);
+  ALLOC_STATS_MERGE(my_alloc_stats, my_thread_alloc_stats);
+  ALLOC_STATS_PRINT("tcache", my_alloc_stats);
+  pthread_mutex_unlock(&my_heap.lock);
+}
+
+typedef struct test_thread_arg_t {
+  void **ptrs;
+  uint32_t slot_id;  // The slot the helper thread's cache claimed.
+} test_thread_arg_t;
+
+void *test_thread(void *arg) {
+  // Objects allocated by the main thread are freed here, and this thread's
+  // cache is flushed back to the central heap when it exits.
+  test_thread_arg_t *test_arg = (test_thread_arg_t *)arg;
+  for (int i = 0; i < 100; i++) {
+    my_free(test_arg->ptrs[i]);
+  }
+  test_arg->slot_id = get_tcache()->slot_id;
+  return NULL;
+}
+
+void *test_exiting_thread(void *arg) {
+  // Allocate an object and exit, so the main thread frees it into a slot
+  // whose owner is gone.
+  test_thread_arg_t *test_arg = (test_thread_arg_t *)arg;
+  test_arg->ptrs[0] = my_malloc(104);
+  test_arg->slot_id = get_tcache()->slot_id;
+  return NULL;
+}
+
+void test() {
+  my_initialize();
+  // A freed object is the next one handed out from the thread cache
+  void *ptr1 = my_malloc(40);
+  my_free(ptr1);
+  void *ptr2 = my_malloc(40);
+  assert(ptr1 == ptr2);
+
+  // Sizes round up to 8-byte classes up to 128, then to 4 classes per power
+  // of two
+  void *ptr3 = my_malloc(36);
+  assert(get_class_size(get_header(ptr3)->class_index) == 40);
+  assert(get_class_size(get_class_index(129)) == 160);
+  assert(get_class_size(get_class_index(257)) == 320);
+  assert(get_class_size(get_class_index(3000)) == 3072);
+  assert(get_class_index(CLASS_MAX_SIZE) == NUM_CLASSES - 1);
+  for (int i = 0; i < NUM_CLASSES; i++) {
+    assert(get_class_index(get_class_size(i)) == i);
+  }
+
+  // Cross-thread frees come back to the owner on its next malloc
+  bool old_remote_frees = remote_frees;
+  remote_frees = true;
+  void *ptrs[100];
+  for (int i = 0; i < 100; i++) {
+    ptrs[i] = my_malloc(48);
+  }
+  test_thread_arg_t arg = {ptrs, 0};
+  pthread_t thread;
+  pthread_create(&thread, NULL, test_thread, &arg);
+  pthread_join(thread, NULL);
+  uint32_t slot_id = get_tcache()->slot_id;
+  assert(arg.slot_id != slot_id);
+  assert(my_heap.slots[slot_id].remote_head);
+  void *ptr4 = my_malloc(48);
+  assert(!my_heap.slots[slot_id].remote_head);
+  assert(get_header(ptr4)->owner == slot_id);
+  // The exited thread's slot is free for the next thread to claim
+  assert(!my_heap.slots[arg.slot_id].in_use);
+
+  // Without remote frees they go through the freeing thread's cache, and
+  // from there to the central heap when it exits
+  remote_frees = false;
+  for (int i = 0; i < 100; i++) {
+    ptrs[i] = my_malloc(56);
+  }
+  pthread_create(&thread, NULL, test_thread, &arg);
+  pthread_join(thread, NULL);
+  assert(!my_heap.slots[slot_id].remote_head);
+  assert(my_heap.spans[get_class_index(56)]);
+  remote_frees = old_remote_frees;
+
+  // Spans that get all their objects back are unmapped, beyond the few empty
+  // ones the class keeps
+  int class_index = get_class_index(4000);
+  void *big_ptrs[4 * SPAN_MIN_OBJECTS];
+  for (int i = 0; i < 4 * SPAN_MIN_OBJECTS; i++) {
+    big_ptrs[i] = my_malloc(4000);
+  }
+  assert(get_span(get_header(big_ptrs[0])) !=
+         get_span(get_header(big_ptrs[4 * SPAN_MIN_OBJECTS - 1])));
+  for (int i = 0; i < 4 * SPAN_MIN_OBJECTS; i++) {
+    my_free(big_ptrs[i]);
+  }
+  my_tcache_t *tcache = get_tcache();
+  flush_tcache_bin(tcache, class_index, tcache->counts[class_index]);
+  assert(my_heap.spans[class_index]->free_count ==
+         my_heap.spans[class_index]->capacity);
+  assert(my_heap.num_spans[class_index] == my_heap.num_empty_spans[class_index]);
+  assert(my_heap.num_spans[class_index] < 4);
+
+  // An object freed after its owner exited goes back to the central heap, and
+  // the next malloc of its class can hand it out again. (A refill batch of
+  // 104-byte objects fits in one span, which the class keeps when empty.)
+  old_remote_frees = remote_frees;
+  remote_frees = true;
+  void *orphan = NULL;
+  test_thread_arg_t exiting_arg = {&orphan, 0};
+  pthread_create(&thread, NULL, test_exiting_thread, &exiting_arg);
+  pthread_join(thread, NULL);
+  assert(get_header(orphan)->owner == exiting_arg.slot_id);
+  assert(exiting_arg.slot_id != get_tcache()->slot_id);
+  assert(!my_heap.slots[exiting_arg.slot_id].in_use);
+  my_free(orphan);
+  assert(!my_heap.slots[exiting_arg.slot_id].remote_head);
+  bool reused = false;
+  class_index = get_class_index(104);
+  void *reuse_ptrs[TCACHE_MAX_COUNT];
+  unsigned num_reuse_ptrs = tcache_max_counts[class_index] / 2;
+  for (unsigned i = 0; i < num_reuse_ptrs; i++) {
+    reuse_ptrs[i] = my_malloc(104);
+    reused = reused || reuse_ptrs[i] == orphan;
+  }
+  assert(reused);
+  for (unsigned i = 0; i < num_reuse_ptrs; i++) {
+    my_free(reuse_ptrs[i]);
+  }
+  remote_frees = old_remote_frees;
+
+  // Large objects have their own mapping
+  void *large = my_malloc(8000);
+  my_free(large);
+
+  my_free(ptr2);
+  my_free(ptr3);
+  my_free(ptr4);
+}
@@ -0,0 +1,87 @@
+//
+// Per-epoch heap telemetry: see telemetry.h
+//
+
+#include "telemetry.h"
+
+#include <string.h>
+
+void heap_stats_reset(heap_stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+  stats->available = true;
+}
+
+void heap_stats_add_free_block(heap_stats_t *stats, size_t size) {
+  int bin = 0;
+  if (size >= 16) {
+    bin = 63 - __builtin_clzl(size) - 3;
+    if (bin >= HEAP_STATS_NUM_BINS) {
+      bin = HEAP_STATS_NUM_BINS - 1;
+    }
+  }
+  stats->bins[bin]++;
+  stats->free_blocks++;
+  stats->free_size += size;
+  if (size > stats->largest_free_block) {
+    stats->largest_free_block = size;
+  }
+}
+
+double heap_stats_fragmentation(heap_stats_t *stats) {
+  if (stats->free_size == 0) {
+    return 0;
+  }
+  return 1.0 - (double)stats->largest_free_block / stats->free_size;
+}
+
+bool telemetry_open(telemetry_writer_t *writer, const char *file_name) {
+  writer->fp = fopen(file_name, "w");
+  if (!writer->fp) {
+    return false;
+  }
+  fprintf(writer->fp,
+          "allocator,challenge,epoch,live_bytes,mapped_bytes,utilization,"
+          "free_blocks,free_bytes,largest_free_block,fragmentation");
+  for (int i = 0; i < HEAP_STATS_NUM_BINS; i++) {
+    if (i == HEAP_STATS_NUM_BINS - 1) {
+      fprintf(writer->fp, ",bin_%zu+", (size_t)8 << i);
+    } else {
+      fprintf(writer->fp, ",bin_%zu", i == 0 ? 0 : (size_t)8 << i);
+    }
+  }
+  fprintf(writer->fp, "\n");
+  return true;
+}
+
+void telemetry_write(telemetry_writer_t *writer, const char *allocator_name,
+                     int challenge_index, int epoch, size_t live_size,
+                     size_t mapped_size, heap_stats_t *heap_stats) {
+  if (!writer->fp) {
+    return;
+  }
+  fprintf(writer->fp, "%s,%d,%d,%zu,%zu,%.4f", allocator_name,
+          challenge_index, epoch, live_size, mapped_size,
+          mapped_size ? (double)live_size / mapped_size : 0.0);
+  if (heap_stats->available) {
+    fprintf(writer->fp, ",%zu,%zu,%zu,%.4f", heap_stats->free_blocks,
+            heap_stats->free_size, heap_stats->largest_free_block,
+            heap_stats_fragmentation(heap_stats));
+    for (int i = 0; i < HEAP_STATS_NUM_BINS; i++) {
+      fprintf(writer->fp, ",%zu", heap_stats->bins[i]);
+    }
+  } else {
+    // Leave the columns empty so plotting tools read them as missing.
+    for (int i = 0; i < 4 + HEAP_STATS_NUM_BINS; i++) {
+      fprintf(writer->fp, ",");
+    }
+  }
+  fprintf(writer->fp, "\n");
+}
+
+void telemetry_close(telemetry_writer_t *writer) {
+  if (!writer->fp) {
+    return;
+  }
+  fclose(writer->fp);
+  writer->fp = NULL;
+}
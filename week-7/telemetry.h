@@ -0,0 +1,57 @@
+//
+// Per-epoch heap telemetry
+//
+// The challenge only reports one utilization number at the end of a run,
+// which hides where memory gets stranded (e.g. right after the epoch-0 peak).
+// With telemetry on, the harness writes one CSV row per epoch with the live
+// and mapped bytes, plus free-block statistics that the allocator reports
+// through an optional my_heap_stats() function.
+//
+// Free blocks are counted in power-of-two size bins so rows from different
+// allocators line up column by column, whatever bins they use internally.
+//
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Bin 0 counts free blocks smaller than 16 bytes, bin i counts blocks in
+// [2^(i+3), 2^(i+4)), and the last bin counts everything bigger.
+#define HEAP_STATS_NUM_BINS 16
+
+typedef struct heap_stats_t {
+  bool available;  // False if the allocator has no my_heap_stats().
+  size_t free_blocks;
+  size_t free_size;  // Sum of the payload sizes of all free blocks.
+  size_t largest_free_block;
+  size_t bins[HEAP_STATS_NUM_BINS];
+} heap_stats_t;
+
+// Clear |stats| and mark it available. Allocators call this first in their
+// my_heap_stats(), then heap_stats_add_free_block() for every free block.
+void heap_stats_reset(heap_stats_t *stats);
+
+void heap_stats_add_free_block(heap_stats_t *stats, size_t size);
+
+// 1 - largest free block / free bytes: 0 when all free memory is one block,
+// close to 1 when it is scattered over many small ones.
+double heap_stats_fragmentation(heap_stats_t *stats);
+
+typedef struct telemetry_writer_t {
+  FILE *fp;  // NULL if telemetry is off.
+} telemetry_writer_t;
+
+// Start writing CSV rows to |file_name|. Return false on failure.
+bool telemetry_open(telemetry_writer_t *writer, const char *file_name);
+
+// Append the row of one epoch. Does nothing if the writer is not open.
+void telemetry_write(telemetry_writer_t *writer, const char *allocator_name,
+                     int challenge_index, int epoch, size_t live_size,
+                     size_t mapped_size, heap_stats_t *heap_stats);
+
+void telemetry_close(telemetry_writer_t *writer);
+
+#endif  // TELEMETRY_H
@@ -0,0 +1,15 @@
+//
+// Monotonic timing: see timer.h
+//
+
+#include "timer.h"
+
+#include <time.h>
+
+uint64_t get_time_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+double get_time(void) { return get_time_ns() * 1e-9; }
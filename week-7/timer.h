@@ -0,0 +1,21 @@
+//
+// Monotonic timing
+//
+// The challenges (main.c) and the trace replayer (replay.c) both time with
+// these, so their numbers come from the same clock and can be compared. The
+// clock is CLOCK_MONOTONIC: unlike gettimeofday() it never jumps when the
+// system time is adjusted in the middle of a run.
+//
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+// Return the current time in nanoseconds from a monotonic clock.
+uint64_t get_time_ns(void);
+
+// Return the current time in seconds.
+double get_time(void);
+
+#endif  // TIMER_H
@@ -0,0 +1,374 @@
+//
+// TLSF (Two-Level Segregated Fit) malloc implementation
+// Free blocks are kept in a two-level table of size classes. Non-empty classes
+// are tracked in bitmaps, so both malloc and free are O(1) (find-first-set
+// instead of walking bins), and boundary tags make coalescing O(1) as well.
+//
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc_stats.h"
+#include "telemetry.h"
+
+void *mmap_from_system(size_t size);
+void munmap_to_system(void *ptr, size_t size);
+
+// Same block layout as mix.c: free blocks carry a footer with their size, and
+// each mmap'd region ends with a size-0 fence header that is never free.
+//
+//   | metadata | payload ... [footer] | metadata | payload ... | fence |
+typedef struct my_metadata_t {
+  size_t size;
+  struct my_metadata_t *next;
+  struct my_metadata_t *prev;
+  bool is_free;
+  bool prev_free;  // Is the block physically to the left free?
+} my_metadata_t;
+
+// Size classes. The first level splits sizes by power of two, the second
+// level splits each power-of-two range into SL_INDEX_COUNT equal parts.
+// Sizes below SMALL_BLOCK_SIZE all live in first-level class 0 and are
+// split linearly, so every 8-byte size up to 128 has its own list.
+//
+//   fl = 0:  [0, 128) in steps of 8
+//   fl = 1:  [128, 256) in steps of 8
+//   fl = 2:  [256, 512) in steps of 16
+//   fl = 3:  [512, 1024) in steps of 32
+//   ...
+#define ALIGN_SIZE_LOG2 3
+#define SL_INDEX_COUNT_LOG2 4
+#define SL_INDEX_COUNT (1 << SL_INDEX_COUNT_LOG2)
+#define FL_INDEX_SHIFT (SL_INDEX_COUNT_LOG2 + ALIGN_SIZE_LOG2)
+#define FL_INDEX_MAX 30  // Largest block we can index is just under 1 GiB.
+#define FL_INDEX_COUNT (FL_INDEX_MAX - FL_INDEX_SHIFT + 1)
+#define SMALL_BLOCK_SIZE (1 << FL_INDEX_SHIFT)
+
+// A free block's payload must hold its footer.
+#define MIN_PAYLOAD_SIZE sizeof(size_t)
+
+typedef struct my_heap_t {
+  uint32_t fl_bitmap;                   // Bit fl is set if any list in row fl is non-empty.
+  uint32_t sl_bitmap[FL_INDEX_COUNT];   // Bit sl is set if blocks[fl][sl] is non-empty.
+  my_metadata_t *blocks[FL_INDEX_COUNT][SL_INDEX_COUNT];
+} my_heap_t;
+
+my_heap_t my_heap;
+
+#ifdef ENABLE_ALLOC_STATS
+alloc_stats_t my_alloc_stats;
+#endif
+
+// Index of the most significant set bit. |x| must not be 0.
+int fls_size(size_t x) { return 63 - __builtin_clzl(x); }
+
+// Index of the least significant set bit. |x| must not be 0.
+int ffs_u32(uint32_t x) { return __builtin_ctz(x); }
+
+// Map a block size to the list it is stored in.
+void mapping_insert(size_t size, int *fl, int *sl) {
+  if (size < SMALL_BLOCK_SIZE) {
+    *fl = 0;
+    *sl = (int)size / (SMALL_BLOCK_SIZE / SL_INDEX_COUNT);
+  } else {
+    int t = fls_size(size);
+    *sl = (int)(size >> (t - SL_INDEX_COUNT_LOG2)) ^ SL_INDEX_COUNT;
+    *fl = t - (FL_INDEX_SHIFT - 1);
+  }
+}
+
+// Map a request size to the first list whose blocks are ALL big enough.
+// Rounding the size up to the next class boundary is what lets malloc take
+// the head of a list without walking it.
+void mapping_search(size_t size, int *fl, int *sl) {
+  size_t step = SMALL_BLOCK_SIZE / SL_INDEX_COUNT;
+  if (size >= SMALL_BLOCK_SIZE) {
+    step = (size_t)1 << (fls_size(size) - SL_INDEX_COUNT_LOG2);
+  }
+  mapping_insert(size + step - 1, fl, sl);
+}
+
+// Find the first non-empty list at or above (fl, sl) using the bitmaps.
+my_metadata_t *search_suitable_block(int *fl, int *sl) {
+  if (*fl >= FL_INDEX_COUNT) {
+    return NULL;
+  }
+  uint32_t sl_map = my_heap.sl_bitmap[*fl] & (~0U << *sl);
+  if (!sl_map) {
+    ALLOC_STATS_INC(my_alloc_stats, bin_misses);
+    uint32_t fl_map = my_heap.fl_bitmap & (~0U << (*fl + 1));
+    if (!fl_map) {
+      return NULL;
+    }
+    *fl = ffs_u32(fl_map);
+    sl_map = my_heap.sl_bitmap[*fl];
+  } else {
+    // Found within the first-level row of the request: one bitmap lookup.
+    ALLOC_STATS_INC(my_alloc_stats, fast_path_hits);
+  }
+  *sl = ffs_u32(sl_map);
+  return my_heap.blocks[*fl][*sl];
+}
+
+my_metadata_t *get_next_block(my_metadata_t *metadata) {
+  return (my_metadata_t *)((char *)(metadata + 1) + metadata->size);
+}
+
+void my_add_to_free_list(my_metadata_t *metadata) {
+  int fl, sl;
+  mapping_insert(metadata->size, &fl, &sl);
+  assert(fl < FL_INDEX_COUNT);
+  metadata->prev = NULL;
+  metadata->next = my_heap.blocks[fl][sl];
+  if (metadata->next) {
+    metadata->next->prev = metadata;
+  }
+  my_heap.blocks[fl][sl] = metadata;
+  my_heap.fl_bitmap |= 1U << fl;
+  my_heap.sl_bitmap[fl] |= 1U << sl;
+
+  metadata->is_free = true;
+  *((size_t *)get_next_block(metadata) - 1) = metadata->size;
+  get_next_block(metadata)->prev_free = true;
+}
+
+void my_remove_from_free_list(my_metadata_t *metadata) {
+  int fl, sl;
+  mapping_insert(metadata->size, &fl, &sl);
+  if (metadata->prev) {
+    metadata->prev->next = metadata->next;
+  } else {
+    my_heap.blocks[fl][sl] = metadata->next;
+    if (!metadata->next) {
+      my_heap.sl_bitmap[fl] &= ~(1U << sl);
+      if (!my_heap.sl_bitmap[fl]) {
+        my_heap.fl_bitmap &= ~(1U << fl);
+      }
+    }
+  }
+  if (metadata->next) {
+    metadata->next->prev = metadata->prev;
+  }
+  metadata->next = NULL;
+  metadata->prev = NULL;
+  metadata->is_free = false;
+  get_next_block(metadata)->prev_free = false;
+}
+
+// Get a new region from the system that can hold at least |size| bytes and
+// return its (not yet free-listed) single block.
+my_metadata_t *my_refill(size_t size) {
+  size_t buffer_size = (size + 2 * sizeof(my_metadata_t) + 4095) / 4096 * 4096;
+  char *region = (char *)mmap_from_system(buffer_size);
+  ALLOC_STATS_INC(my_alloc_stats, refills);
+  ALLOC_STATS_ADD(my_alloc_stats, refill_size, buffer_size);
+  my_metadata_t *fence = (my_metadata_t *)(region + buffer_size) - 1;
+  fence->size = 0;
+  fence->next = NULL;
+  fence->prev = NULL;
+  fence->is_free = false;
+  fence->prev_free = false;
+  my_metadata_t *metadata = (my_metadata_t *)region;
+  metadata->size = buffer_size - 2 * sizeof(my_metadata_t);
+  metadata->next = NULL;
+  metadata->prev = NULL;
+  metadata->is_free = false;
+  metadata->prev_free = false;
+  return metadata;
+}
+
+void my_initialize() {
+  my_heap.fl_bitmap = 0;
+  ALLOC_STATS_RESET(my_alloc_stats);
+  for (int i = 0; i < FL_INDEX_COUNT; i++) {
+    my_heap.sl_bitmap[i] = 0;
+    for (int j = 0; j < SL_INDEX_COUNT; j++) {
+      my_heap.blocks[i][j] = NULL;
+    }
+  }
+}
+
+// Round a request up to a block size that can be freed again.
+size_t get_block_size(size_t size) {
+  if (size < MIN_PAYLOAD_SIZE) {
+    return MIN_PAYLOAD_SIZE;
+  }
+  return (size + 7) / 8 * 8;
+}
+
+void *my_malloc(size_t size) {
+  size = get_block_size(size);
+  int fl, sl;
+  mapping_search(size, &fl, &sl);
+  my_metadata_t *metadata = search_suitable_block(&fl, &sl);
+  ALLOC_STATS_INC(my_alloc_stats, mallocs);
+  if (metadata) {
+    ALLOC_STATS_INC(my_alloc_stats, list_walk_steps);
+    my_remove_from_free_list(metadata);
+  } else {
+    // Use the fresh region directly instead of re-searching: the rounded-up
+    // search size may not fit in a single 4096-byte region even when |size| does.
+    metadata = my_refill(size);
+  }
+
+  void *ptr = metadata + 1;
+  size_t remaining_size = metadata->size - size;
+  if (remaining_size >= sizeof(my_metadata_t) + MIN_PAYLOAD_SIZE) {
+    metadata->size = size;
+    my_metadata_t *new_metadata = (my_metadata_t *)((char *)ptr + size);
+    new_metadata->size = remaining_size - sizeof(my_metadata_t);
+    new_metadata->next = NULL;
+    new_metadata->prev = NULL;
+    new_metadata->prev_free = false;
+    my_add_to_free_list(new_metadata);
+    ALLOC_STATS_INC(my_alloc_stats, splits);
+  }
+  return ptr;
+}
+
+void my_free(void *ptr) {
+  my_metadata_t *metadata = (my_metadata_t *)ptr - 1;
+  ALLOC_STATS_INC(my_alloc_stats, frees);
+
+  // Merge with the right neighbor. The fence guarantees there is one.
+  my_metadata_t *right = get_next_block(metadata);
+  if (right->is_free) {
+    my_remove_from_free_list(right);
+    metadata->size += sizeof(my_metadata_t) + right->size;
+    ALLOC_STATS_INC(my_alloc_stats, coalesce_right);
+  }
+  // Merge with the left neighbor, found through its footer.
+  if (metadata->prev_free) {
+    size_t left_size = *((size_t *)metadata - 1);
+    my_metadata_t *left =
+        (my_metadata_t *)((char *)metadata - left_size - sizeof(my_metadata_t));
+    my_remove_from_free_list(left);
+    left->size += sizeof(my_metadata_t) + metadata->size;
+    metadata = left;
+    ALLOC_STATS_INC(my_alloc_stats, coalesce_left);
+  }
+  my_add_to_free_list(metadata);
+}
+
+void my_finalize() {
+  ALLOC_STATS_PRINT("tlsf", my_alloc_stats);
+}
+
+// Report every free block for the per-epoch telemetry (see telemetry.h).
+void my_heap_stats(heap_stats_t *heap_stats) {
+  heap_stats_reset(heap_stats);
+  for (int fl = 0; fl < FL_INDEX_COUNT; fl++) {
+    for (int sl = 0; sl < SL_INDEX_COUNT; sl++) {
+      for (my_metadata_t *metadata = my_heap.blocks[fl][sl]; metadata;
+           metadata = metadata->next) {
+        heap_stats_add_free_block(heap_stats, metadata->size);
+      }
+    }
+  }
+}
+
+// Check that the bitmaps say exactly which lists are non-empty, and that every
+// block sits in the list its size maps to.
+void check_free_lists() {
+  for (int fl = 0; fl < FL_INDEX_COUNT; fl++) {
+    assert(!(my_heap.fl_bitmap & (1U << fl)) == !my_heap.sl_bitmap[fl]);
+    for (int sl = 0; sl < SL_INDEX_COUNT; sl++) {
+      assert(!(my_heap.sl_bitmap[fl] & (1U << sl)) == !my_heap.blocks[fl][sl]);
+      for (my_metadata_t *metadata = my_heap.blocks[fl][sl]; metadata;
+           metadata = metadata->next) {
+        int block_fl, block_sl;
+        mapping_insert(metadata->size, &block_fl, &block_sl);
+        assert(block_fl == fl && block_sl == sl);
+        assert(metadata->is_free);
+      }
+    }
+  }
+}
+
+void test() {
+  // Test size class mapping
+  int fl, sl;
+  mapping_insert(8, &fl, &sl);
+  assert(fl == 0 && sl == 1);
+  mapping_insert(128, &fl, &sl);
+  assert(fl == 1 && sl == 0);
+  mapping_insert(4000, &fl, &sl);
+  assert(fl == 5 && sl == 15);
+  // A search never lands in a list that may hold blocks smaller than asked.
+  mapping_search(129, &fl, &sl);
+  assert(fl == 1 && sl == 1);
+  mapping_search(13, &fl, &sl);
+  assert(fl == 0 && sl == 2);
+  // For every size, the search list is the insert list or the one after it,
+  // and it comes after the list of the next smaller size: every block in it
+  // is big enough.
+  for (size_t size = 16; size <= 64 * 1024; size += 8) {
+    int insert_fl, insert_sl, smaller_fl, smaller_sl;
+    mapping_insert(size, &insert_fl, &insert_sl);
+    mapping_insert(size - 8, &smaller_fl, &smaller_sl);
+    mapping_search(size, &fl, &sl);
+    int insert_index = insert_fl * SL_INDEX_COUNT + insert_sl;
+    int search_index = fl * SL_INDEX_COUNT + sl;
+    assert(search_index == insert_index || search_index == insert_index + 1);
+    assert(smaller_fl * SL_INDEX_COUNT + smaller_sl < search_index);
+  }
+
+  my_initialize();
+  // Test that blocks are reused through the bitmaps
+  void *ptr1 = my_malloc(16);
+  my_free(ptr1);
+  void *ptr2 = my_malloc(16);
+  assert(ptr1 == ptr2);
+  my_free(ptr2);
+  check_free_lists();
+
+  // Good fit, not best fit: a 264-byte block lives in the [256, 272) list,
+  // which a 264-byte request skips because it may hold smaller blocks. A
+  // 256-byte request takes it from the head of that list.
+  my_initialize();
+  char *x = my_malloc(264);
+  char *guard = my_malloc(8);  // Keeps x from merging with the rest.
+  my_free(x);
+  mapping_insert(264, &fl, &sl);
+  assert(my_heap.blocks[fl][sl] == (my_metadata_t *)x - 1);
+  assert(my_heap.sl_bitmap[fl] & (1U << sl));
+  check_free_lists();
+  char *y = my_malloc(264);
+  assert(y != x);
+  char *z = my_malloc(256);
+  assert(z == x);
+  // Taking the last block of a list clears its bit.
+  assert(!(my_heap.sl_bitmap[fl] & (1U << sl)));
+  check_free_lists();
+  my_free(y);
+  my_free(z);
+  my_free(guard);
+  check_free_lists();
+
+  // Every size the challenges use must be servable
+  void *ptrs[4000 / 8];
+  for (int i = 0; i < 4000 / 8; i++) {
+    ptrs[i] = my_malloc((i + 1) * 8);
+  }
+  for (int i = 0; i < 4000 / 8; i++) {
+    my_free(ptrs[i]);
+  }
+  check_free_lists();
+
+  // Odd and tiny sizes are rounded up to a block that can hold a footer.
+  char *tiny = my_malloc(1);
+  char *odd = my_malloc(13);
+  char *empty = my_malloc(0);
+  assert(((my_metadata_t *)tiny - 1)->size == MIN_PAYLOAD_SIZE);
+  assert(((my_metadata_t *)odd - 1)->size == 16);
+  assert(((my_metadata_t *)empty - 1)->size == MIN_PAYLOAD_SIZE);
+  memset(odd, 'o', 13);
+  my_free(tiny);
+  my_free(empty);
+  my_free(odd);
+}
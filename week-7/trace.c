@@ -0,0 +1,58 @@
+//
+// Binary malloc trace format: see trace.h
+//
+
+#include "trace.h"
+
+#include <assert.h>
+
+void trace_flush(trace_writer_t *writer) {
+  size_t written = fwrite(writer->buffer, sizeof(trace_record_t),
+                          writer->num_buffered, writer->fp);
+  assert(written == writer->num_buffered);
+  writer->num_buffered = 0;
+}
+
+bool trace_open(trace_writer_t *writer, const char *file_name) {
+  writer->fp = fopen(file_name, "wb");
+  if (!writer->fp) {
+    return false;
+  }
+  writer->header.magic = TRACE_MAGIC;
+  writer->header.version = TRACE_VERSION;
+  writer->header.num_records = 0;
+  writer->header.num_objects = 0;
+  writer->num_buffered = 0;
+  // The header is rewritten with the final counts by trace_close().
+  fwrite(&writer->header, sizeof(writer->header), 1, writer->fp);
+  return true;
+}
+
+void trace_write(trace_writer_t *writer, trace_op_t op, uint32_t id,
+                 uint64_t size) {
+  if (!writer->fp) {
+    return;
+  }
+  trace_record_t *record = &writer->buffer[writer->num_buffered++];
+  record->op = op;
+  record->id = id;
+  record->size = size;
+  writer->header.num_records++;
+  if (op == TRACE_MALLOC && id >= writer->header.num_objects) {
+    writer->header.num_objects = id + 1;
+  }
+  if (writer->num_buffered == TRACE_BUFFER_RECORDS) {
+    trace_flush(writer);
+  }
+}
+
+void trace_close(trace_writer_t *writer) {
+  if (!writer->fp) {
+    return;
+  }
+  trace_flush(writer);
+  fseek(writer->fp, 0, SEEK_SET);
+  fwrite(&writer->header, sizeof(writer->header), 1, writer->fp);
+  fclose(writer->fp);
+  writer->fp = NULL;
+}
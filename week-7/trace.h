@@ -0,0 +1,61 @@
+//
+// Binary malloc trace format
+//
+// A trace file is one trace_header_t followed by fixed-width trace_record_t
+// records. Objects are identified by the order they were allocated in (0, 1,
+// 2, ...) instead of by address, so a trace recorded with one allocator can
+// be replayed against any other (see replay.c).
+//
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_MAGIC 0x4352544d  // "MTRC" in little endian.
+#define TRACE_VERSION 1
+
+typedef enum trace_op_t {
+  TRACE_MALLOC = 'a',
+  TRACE_FREE = 'f',
+  TRACE_MMAP = 'm',
+  TRACE_MUNMAP = 'u',
+} trace_op_t;
+
+typedef struct trace_header_t {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t num_records;
+  uint64_t num_objects;  // Object ids are in [0, num_objects).
+} trace_header_t;
+
+typedef struct trace_record_t {
+  uint32_t op;    // One of trace_op_t.
+  uint32_t id;    // The object id for TRACE_MALLOC / TRACE_FREE, 0 otherwise.
+  uint64_t size;  // The object size, or the mmap / munmap size.
+} trace_record_t;
+
+#define TRACE_BUFFER_RECORDS 4096
+
+// Records are collected in |buffer| and written with one fwrite() per
+// TRACE_BUFFER_RECORDS records.
+typedef struct trace_writer_t {
+  FILE *fp;  // NULL if tracing is off.
+  trace_header_t header;
+  size_t num_buffered;
+  trace_record_t buffer[TRACE_BUFFER_RECORDS];
+} trace_writer_t;
+
+// Start writing a trace to |file_name|. Return false on failure.
+bool trace_open(trace_writer_t *writer, const char *file_name);
+
+// Append one record. Does nothing if the writer is not open.
+void trace_write(trace_writer_t *writer, trace_op_t op, uint32_t id,
+                 uint64_t size);
+
+// Flush the buffered records, fill in the header and close the file.
+void trace_close(trace_writer_t *writer);
+
+#endif  // TRACE_H
@@ -0,0 +1,286 @@
+//
+// Configurable challenge workloads: see workload.h
+//
+
+#include "workload.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+// From main.c: the random source, and the default exponential distributions
+// (kept there so the default workload stays exactly the same).
+double urand();
+size_t get_object_size(size_t min_size, size_t max_size);
+unsigned get_object_lifetime(unsigned min_epoch, unsigned max_epoch);
+
+int compare_size(const void *a, const void *b) {
+  size_t size_a = *(const size_t *)a;
+  size_t size_b = *(const size_t *)b;
+  return size_a < size_b ? -1 : size_a > size_b;
+}
+
+// Read the malloc sizes recorded in the trace |file_name| into a histogram.
+bool workload_load_trace(workload_t *workload, const char *file_name) {
+  FILE *fp = fopen(file_name, "rb");
+  if (!fp) {
+    fprintf(stderr, "Failed to open a trace file: %s\n", file_name);
+    return false;
+  }
+  trace_header_t header;
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+    fprintf(stderr, "Not a malloc trace: %s\n", file_name);
+    fclose(fp);
+    return false;
+  }
+  size_t *sizes = (size_t *)malloc(header.num_objects * sizeof(size_t));
+  size_t num_sizes = 0;
+  trace_record_t record;
+  while (fread(&record, sizeof(record), 1, fp) == 1) {
+    if (record.op == TRACE_MALLOC && num_sizes < header.num_objects) {
+      size_t size = record.size ? record.size : 8;
+      sizes[num_sizes++] = (size + 7) / 8 * 8;
+    }
+  }
+  fclose(fp);
+  if (!num_sizes) {
+    fprintf(stderr, "No mallocs in the trace: %s\n", file_name);
+    free(sizes);
+    return false;
+  }
+
+  qsort(sizes, num_sizes, sizeof(size_t), compare_size);
+  free(workload->trace_sizes);
+  free(workload->trace_cumulative_counts);
+  workload->trace_sizes = (size_t *)malloc(num_sizes * sizeof(size_t));
+  workload->trace_cumulative_counts =
+      (size_t *)malloc(num_sizes * sizeof(size_t));
+  workload->trace_num_sizes = 0;
+  for (size_t i = 0; i < num_sizes; i++) {
+    if (i == 0 || sizes[i] != sizes[i - 1]) {
+      workload->trace_sizes[workload->trace_num_sizes++] = sizes[i];
+    }
+    workload->trace_cumulative_counts[workload->trace_num_sizes - 1] = i + 1;
+  }
+  free(sizes);
+  return true;
+}
+
+// Parse "NAME" or "NAME:PARAM". Return false if NAME isn't |name|. |param| is
+// left alone if there is no PARAM.
+bool parse_model(const char *value, const char *name, double *param) {
+  size_t length = strlen(name);
+  if (strncmp(value, name, length) != 0) {
+    return false;
+  }
+  if (value[length] == ':') {
+    *param = atof(value + length + 1);
+    return true;
+  }
+  return value[length] == '\0';
+}
+
+bool workload_set(workload_t *workload, const char *key, const char *value) {
+  double param = -1;  // Every PARAM is positive, so this means "not given".
+  if (strcmp(key, "size") == 0) {
+    if (strcmp(value, "exponential") == 0) {
+      workload->size_distribution = SIZE_EXPONENTIAL;
+    } else if (strcmp(value, "uniform") == 0) {
+      workload->size_distribution = SIZE_UNIFORM;
+    } else if (parse_model(value, "bimodal", &param)) {
+      workload->size_distribution = SIZE_BIMODAL;
+      workload->size_param = param < 0 ? 0.9 : param;
+      return workload->size_param <= 1;
+    } else if (parse_model(value, "power_law", &param)) {
+      workload->size_distribution = SIZE_POWER_LAW;
+      workload->size_param = param < 0 ? 1.5 : param;
+      return workload->size_param > 0;
+    } else if (strncmp(value, "trace:", 6) == 0) {
+      workload->size_distribution = SIZE_TRACE;
+      return workload_load_trace(workload, value + 6);
+    } else {
+      return false;
+    }
+  } else if (strcmp(key, "lifetime") == 0) {
+    if (strcmp(value, "exponential") == 0) {
+      workload->lifetime_model = LIFETIME_MODEL_EXPONENTIAL;
+    } else if (strcmp(value, "uniform") == 0) {
+      workload->lifetime_model = LIFETIME_MODEL_UNIFORM;
+    } else if (parse_model(value, "bimodal", &param)) {
+      workload->lifetime_model = LIFETIME_MODEL_BIMODAL;
+      workload->lifetime_param = param < 0 ? 0.5 : param;
+      return workload->lifetime_param <= 1;
+    } else if (parse_model(value, "queue", &param)) {
+      workload->lifetime_model = LIFETIME_MODEL_QUEUE;
+      workload->lifetime_param = param < 0 ? 1 : (int)param;
+      return workload->lifetime_param >= 1;
+    } else {
+      return false;
+    }
+  } else if (strcmp(key, "cycles") == 0) {
+    workload->cycles = atoi(value);
+    return workload->cycles > 0;
+  } else if (strcmp(key, "epochs") == 0) {
+    workload->epochs_per_cycle = atoi(value);
+    return workload->epochs_per_cycle > 0;
+  } else if (strcmp(key, "objects") == 0) {
+    workload->objects_per_epoch_small = atoi(value);
+    return workload->objects_per_epoch_small >= 0;
+  } else if (strcmp(key, "peak") == 0) {
+    workload->objects_per_epoch_large = atoi(value);
+    return workload->objects_per_epoch_large >= 0;
+  } else if (strcmp(key, "never_freed") == 0) {
+    workload->never_freed_ratio = atof(value);
+    return 0 <= workload->never_freed_ratio && workload->never_freed_ratio <= 1;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool workload_parse(workload_t *workload, const char *spec) {
+  char *copy = strdup(spec);
+  bool ok = true;
+  for (char *item = strtok(copy, ","); item && ok; item = strtok(NULL, ",")) {
+    char *value = strchr(item, '=');
+    ok = value != NULL;
+    if (ok) {
+      *value = '\0';
+      ok = workload_set(workload, item, value + 1);
+      *value = '=';
+    }
+    if (!ok) {
+      fprintf(stderr, "Bad workload setting: %s\n", item);
+    }
+  }
+  free(copy);
+  // Checked on the final values, so it holds whichever of lifetime= and
+  // epochs= came last. An object freed N epochs later goes in the bucket
+  // (epoch + N) % epochs, so N = epochs would be the bucket freed right away.
+  if (ok && workload->lifetime_model == LIFETIME_MODEL_QUEUE &&
+      workload->lifetime_param >= workload->epochs_per_cycle) {
+    fprintf(stderr, "lifetime=queue:N needs N < epochs\n");
+    ok = false;
+  }
+  workload->is_custom = true;
+  return ok;
+}
+
+// Round |size| down to a multiple of 8 bytes, within [min_size, max_size].
+size_t clamp_size(double size, size_t min_size, size_t max_size) {
+  size_t result = (size_t)size / 8 * 8;
+  if (result < min_size) {
+    result = min_size;
+  }
+  if (result > max_size) {
+    result = max_size;
+  }
+  return result;
+}
+
+size_t workload_object_size(const workload_t *workload, size_t min_size,
+                            size_t max_size) {
+  assert(min_size <= max_size);
+  assert(min_size % 8 == 0);
+  double range = max_size - min_size;
+  switch (workload->size_distribution) {
+    case SIZE_EXPONENTIAL:
+      return get_object_size(min_size, max_size);
+    case SIZE_UNIFORM:
+      return clamp_size(min_size + urand() * (range + 8), min_size, max_size);
+    case SIZE_BIMODAL: {
+      // Draw both numbers so the sequence doesn't depend on the mode picked.
+      bool small = urand() < workload->size_param;
+      double offset = urand() * range / 8;
+      return clamp_size(small ? min_size + offset : max_size - offset,
+                        min_size, max_size);
+    }
+    case SIZE_POWER_LAW: {
+      // Inverse CDF of a Pareto distribution bounded to [low, high].
+      double alpha = workload->size_param;
+      double low = min_size < 8 ? 8 : min_size;
+      double high = max_size < 8 ? 8 : max_size;
+      double ratio = pow(low / high, alpha);
+      double size = low / pow(1 - urand() * (1 - ratio), 1 / alpha);
+      return clamp_size(size, min_size, max_size);
+    }
+    case SIZE_TRACE: {
+      size_t total =
+          workload->trace_cumulative_counts[workload->trace_num_sizes - 1];
+      size_t rank = (size_t)(urand() * total);
+      // The first size whose cumulative count is above |rank|.
+      size_t low = 0;
+      size_t high = workload->trace_num_sizes - 1;
+      while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (workload->trace_cumulative_counts[middle] > rank) {
+          high = middle;
+        } else {
+          low = middle + 1;
+        }
+      }
+      return workload->trace_sizes[low];
+    }
+  }
+  assert(false);
+  return min_size;
+}
+
+unsigned workload_object_lifetime(const workload_t *workload) {
+  unsigned epochs = workload->epochs_per_cycle;
+  switch (workload->lifetime_model) {
+    case LIFETIME_MODEL_EXPONENTIAL:
+      return get_object_lifetime(1, epochs);
+    case LIFETIME_MODEL_UNIFORM:
+      return 1 + (unsigned)(urand() * epochs);
+    case LIFETIME_MODEL_BIMODAL: {
+      bool short_lived = urand() < workload->lifetime_param;
+      double r = urand();
+      unsigned short_max = epochs / 10 ? epochs / 10 : 1;
+      if (short_lived) {
+        return 1 + (unsigned)(r * short_max);
+      }
+      unsigned long_min = epochs / 2 ? epochs / 2 : 1;
+      return long_min + (unsigned)(r * (epochs - long_min + 1));
+    }
+    case LIFETIME_MODEL_QUEUE:
+      return (unsigned)workload->lifetime_param;
+  }
+  assert(false);
+  return 1;
+}
+
+void workload_describe(const workload_t *workload, char *buffer,
+                       size_t buffer_size) {
+  const char *size_names[] = {"exponential", "uniform", "bimodal",
+                              "power_law", "trace"};
+  const char *lifetime_names[] = {"exponential", "uniform", "bimodal",
+                                  "queue"};
+  char size_param[32] = "";
+  if (workload->size_distribution == SIZE_BIMODAL ||
+      workload->size_distribution == SIZE_POWER_LAW) {
+    snprintf(size_param, sizeof(size_param), ":%g", workload->size_param);
+  } else if (workload->size_distribution == SIZE_TRACE) {
+    snprintf(size_param, sizeof(size_param), " (%zu sizes)",
+             workload->trace_num_sizes);
+  }
+  char lifetime_param[32] = "";
+  if (workload->lifetime_model == LIFETIME_MODEL_BIMODAL ||
+      workload->lifetime_model == LIFETIME_MODEL_QUEUE) {
+    snprintf(lifetime_param, sizeof(lifetime_param), ":%g",
+             workload->lifetime_param);
+  }
+  snprintf(buffer, buffer_size,
+           "size=%s%s lifetime=%s%s cycles=%d epochs=%d objects=%d peak=%d "
+           "never_freed=%g",
+           size_names[workload->size_distribution], size_param,
+           lifetime_names[workload->lifetime_model], lifetime_param,
+           workload->cycles, workload->epochs_per_cycle,
+           workload->objects_per_epoch_small, workload->objects_per_epoch_large,
+           workload->never_freed_ratio);
+}
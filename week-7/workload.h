@@ -0,0 +1,88 @@
+//
+// Configurable challenge workloads
+//
+// By default a challenge draws object sizes and lifetimes from truncated
+// exponential distributions, with the epoch and object counts fixed at build
+// time. A workload_t replaces them at runtime (--workload=SPEC), so allocators
+// can be benchmarked against heaps shaped like the ones we see in production.
+//
+// SPEC is a comma separated list of KEY=VALUE, e.g.
+// "size=bimodal:0.8,lifetime=queue:5,peak=500":
+//
+//   size=exponential       The default.
+//   size=uniform           Uniform in the challenge's [min_size, max_size].
+//   size=bimodal[:P]       P (0.9) of the objects in the bottom 1/8 of the
+//                          range, the others in the top 1/8.
+//   size=power_law[:A]     Bounded Pareto with exponent A (1.5): mostly
+//                          small objects with a long tail of big ones.
+//   size=trace:FILE        The malloc sizes recorded in a trace (see trace.h),
+//                          with their frequencies. Ignores the challenge's
+//                          size range.
+//   lifetime=exponential   The default.
+//   lifetime=uniform       Uniform in [1, epochs].
+//   lifetime=bimodal[:P]   P (0.5) of the objects die within epochs / 10,
+//                          the others live half a cycle or more.
+//   lifetime=queue[:N]     Producer / consumer: every object is freed exactly
+//                          N (1) epochs later, in the order it was allocated.
+//                          N must be less than epochs.
+//   cycles=N, epochs=N     Cycles per challenge, epochs per cycle.
+//   objects=N, peak=N      Objects allocated per epoch, and in epoch 0.
+//   never_freed=R          The share of objects that are never freed (0.04).
+//
+
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum size_distribution_t {
+  SIZE_EXPONENTIAL,
+  SIZE_UNIFORM,
+  SIZE_BIMODAL,
+  SIZE_POWER_LAW,
+  SIZE_TRACE,
+} size_distribution_t;
+
+typedef enum lifetime_model_t {
+  LIFETIME_MODEL_EXPONENTIAL,
+  LIFETIME_MODEL_UNIFORM,
+  LIFETIME_MODEL_BIMODAL,
+  LIFETIME_MODEL_QUEUE,
+} lifetime_model_t;
+
+typedef struct workload_t {
+  size_distribution_t size_distribution;
+  double size_param;  // P for bimodal, A for power_law.
+  // size=trace: the distinct sizes in increasing order, and how many of the
+  // recorded objects had each size or a smaller one.
+  size_t *trace_sizes;
+  size_t *trace_cumulative_counts;
+  size_t trace_num_sizes;
+  lifetime_model_t lifetime_model;
+  double lifetime_param;  // P for bimodal, N for queue.
+  int cycles;
+  int epochs_per_cycle;
+  int objects_per_epoch_small;
+  int objects_per_epoch_large;
+  double never_freed_ratio;
+  bool is_custom;  // False until workload_parse() changes anything.
+} workload_t;
+
+// Apply SPEC on top of |workload|. Print what is wrong and return false if
+// SPEC is malformed or a trace can't be read.
+bool workload_parse(workload_t *workload, const char *spec);
+
+// Return an object size in [min_size, max_size] (any size for size=trace),
+// a multiple of 8 bytes. |min_size| needs to be a multiple of 8 bytes.
+size_t workload_object_size(const workload_t *workload, size_t min_size,
+                            size_t max_size);
+
+// Return an object lifetime in [1, epochs_per_cycle] epochs.
+unsigned workload_object_lifetime(const workload_t *workload);
+
+// Write a one-line summary of |workload| to |buffer|.
+void workload_describe(const workload_t *workload, char *buffer,
+                       size_t buffer_size);
+
+#endif  // WORKLOAD_H
@@ -11,6 +11,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "alloc_stats.h"
+
 void *mmap_from_system(size_t size);
 void munmap_to_system(void *ptr, size_t size);
 
@@ -26,6 +28,10 @@ typedef struct my_heap_t {
 
 my_heap_t my_heap;
 
+#ifdef ENABLE_ALLOC_STATS
+alloc_stats_t my_alloc_stats;
+#endif
+
 void my_add_to_free_list(my_metadata_t *metadata) {
   assert(!metadata->next);
   metadata->next = my_heap.free_head;
@@ -45,6 +51,7 @@ void my_initialize() {
   my_heap.free_head = &my_heap.dummy;
   my_heap.dummy.size = 0;
   my_heap.dummy.next = NULL;
+  ALLOC_STATS_RESET(my_alloc_stats);
 }
 
 void *my_malloc(size_t size) {
@@ -58,6 +65,7 @@ void *my_malloc(size_t size) {
   
   // Search through all free blocks to find the worst (largest) fit
   while (metadata) {
+    ALLOC_STATS_INC(my_alloc_stats, list_walk_steps);
     if (metadata->size >= size && metadata->size > worst_size) {
       worst_metadata = metadata;
       worst_prev = prev;
@@ -69,19 +77,24 @@ void *my_malloc(size_t size) {
 
   if (!worst_metadata) {
     // No suitable free slot found, request new memory
+    ALLOC_STATS_INC(my_alloc_stats, bin_misses);
     size_t buffer_size = 4096;
     my_metadata_t *new_metadata = (my_metadata_t *)mmap_from_system(buffer_size);
+    ALLOC_STATS_INC(my_alloc_stats, refills);
+    ALLOC_STATS_ADD(my_alloc_stats, refill_size, buffer_size);
     new_metadata->size = buffer_size - sizeof(my_metadata_t);
     new_metadata->next = NULL;
     my_add_to_free_list(new_metadata);
     return my_malloc(size);
   }
 
+  ALLOC_STATS_INC(my_alloc_stats, mallocs);
   void *ptr = worst_metadata + 1;
   size_t remaining_size = worst_metadata->size - size;
   my_remove_from_free_list(worst_metadata, worst_prev);
 
   if (remaining_size > sizeof(my_metadata_t)) {
+    ALLOC_STATS_INC(my_alloc_stats, splits);
     worst_metadata->size = size;
     my_metadata_t *new_metadata = (my_metadata_t *)((char *)ptr + size);
     new_metadata->size = remaining_size - sizeof(my_metadata_t);
@@ -93,11 +106,12 @@ void *my_malloc(size_t size) {
 
 void my_free(void *ptr) {
   my_metadata_t *metadata = (my_metadata_t *)ptr - 1;
+  ALLOC_STATS_INC(my_alloc_stats, frees);
   my_add_to_free_list(metadata);
 }
 
 void my_finalize() {
-  // Nothing here for now
+  ALLOC_STATS_PRINT("worst", my_alloc_stats);
 }
 
 void test() {